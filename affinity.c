@@ -0,0 +1,304 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <sched.h>
+
+/*
+** Where a CPU sits in the cache hierarchy, read from sysfs. CPUs are
+** sorted on these so that neighbours in cpu_order share as much cache
+** as possible: same package, same L3, then distinct physical cores
+** before their SMT siblings, so adjacent stages do not share a core.
+*/
+typedef struct CpuPlacement {
+    int cpu;
+    long package;
+    long l3;
+    long thread;
+    long l2;
+    long core;
+} CpuPlacement;
+
+// The CPUs the shell may run on, in cache order, and the first CPU of
+// each of their physical cores, in the same order; loaded on first use
+static int cpu_order[AFFINITY_MAX_CPUS];
+static int num_cpus = -1;
+static int core_order[AFFINITY_MAX_CPUS];
+static int num_cores = 0;
+
+// The parsed PIPELINE_AFFINITY, kept until the variables change
+static uint64_t policy_generation = (uint64_t) -1;
+static AffinityPolicy policy = AFFINITY_NONE;
+static int policy_cpus[AFFINITY_MAX_CPUS];
+static int num_policy_cpus = 0;
+
+
+/**
+ * Read a number from a sysfs file of a CPU.
+ *
+ * @param cpu The CPU.
+ * @param file The file, relative to the CPU's sysfs directory.
+ * @return The number, or -1 if the file does not exist.
+ */
+long read_cpu_value(int cpu, const char *file) {
+    char path[MAX_PATH_STR];
+    snprintf(path, sizeof(path), CPU_SYSFS_DIR "/cpu%d/%s", cpu, file);
+    FILE *stream = fopen(path, "r");
+    if (stream == NULL) {
+        return -1;
+    }
+    long value;
+    if (fscanf(stream, "%ld", &value) != 1) {
+        value = -1;
+    }
+    fclose(stream);
+    return value;
+}
+
+/**
+ * Fill in where a CPU sits in the cache hierarchy.
+ *
+ * @param cpu The CPU.
+ * @param placement The placement to fill in.
+ */
+void read_cpu_placement(int cpu, CpuPlacement *placement) {
+    placement->cpu = cpu;
+    placement->package = read_cpu_value(cpu, "topology/physical_package_id");
+    placement->core = read_cpu_value(cpu, "topology/core_id");
+    placement->l2 = -1;
+    placement->l3 = -1;
+
+    char file[64];
+    for (int index = 0; ; index++) {
+        snprintf(file, sizeof(file), "cache/index%d/level", index);
+        long level = read_cpu_value(cpu, file);
+        if (level < 0) {
+            break;
+        }
+        snprintf(file, sizeof(file), "cache/index%d/id", index);
+        if (level == 2) {
+            placement->l2 = read_cpu_value(cpu, file);
+        } else if (level == 3) {
+            placement->l3 = read_cpu_value(cpu, file);
+        }
+    }
+
+    // the first CPU of a core is its thread 0, the others are SMT siblings
+    placement->thread = 0;
+    char path[MAX_PATH_STR];
+    snprintf(path, sizeof(path), CPU_SYSFS_DIR "/cpu%d/topology/thread_siblings_list", cpu);
+    FILE *stream = fopen(path, "r");
+    if (stream != NULL) {
+        int first;
+        if (fscanf(stream, "%d", &first) == 1 && first != cpu) {
+            placement->thread = 1;
+        }
+        fclose(stream);
+    }
+}
+
+/**
+ * Order two CPUs by where they sit in the cache hierarchy, for qsort.
+ *
+ * @param a The first CpuPlacement.
+ * @param b The second CpuPlacement.
+ * @return Negative, zero or positive as a goes before, with or after b.
+ */
+int compare_cpu_placements(const void *a, const void *b) {
+    const CpuPlacement *first = a;
+    const CpuPlacement *second = b;
+    long keys[][2] = {
+        {first->package, second->package},
+        {first->l3, second->l3},
+        {first->thread, second->thread},
+        {first->l2, second->l2},
+        {first->core, second->core},
+        {first->cpu, second->cpu},
+    };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        if (keys[i][0] != keys[i][1]) {
+            return keys[i][0] < keys[i][1] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Load the CPUs the shell may run on into cpu_order, in cache order.
+ */
+void load_cpu_order(void) {
+    cpu_set_t allowed;
+    num_cpus = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return;
+    }
+
+    CpuPlacement placements[AFFINITY_MAX_CPUS];
+    for (int cpu = 0; cpu < AFFINITY_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            read_cpu_placement(cpu, &placements[num_cpus++]);
+        }
+    }
+    qsort(placements, num_cpus, sizeof(CpuPlacement), compare_cpu_placements);
+    for (int i = 0; i < num_cpus; i++) {
+        cpu_order[i] = placements[i].cpu;
+        if (placements[i].thread == 0) {
+            core_order[num_cores++] = placements[i].cpu;
+        }
+    }
+}
+
+/**
+ * Parse a cpu list like "0-3,8,10-11".
+ *
+ * @param list The cpu list.
+ * @param cpus The array to fill, AFFINITY_MAX_CPUS long.
+ * @return The number of CPUs in the list, or -1 if it is malformed.
+ */
+int parse_cpu_list(const char *list, int *cpus) {
+    int count = 0;
+    const char *c = list;
+    while (*c != '\0') {
+        char *end;
+        long first = strtol(c, &end, 10);
+        long last = first;
+        if (end == c || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            c = end + 1;
+            last = strtol(c, &end, 10);
+            if (end == c || last < first) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (cpu >= AFFINITY_MAX_CPUS || count == AFFINITY_MAX_CPUS) {
+                return -1;
+            }
+            cpus[count++] = cpu;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        c = end;
+    }
+    return count > 0 ? count : -1;
+}
+
+/**
+ * Parse the value of PIPELINE_AFFINITY into the policy, if the variables
+ * changed since it was last parsed.
+ *
+ * @param variables The head of the variables list.
+ */
+void load_affinity_policy(Variable *variables) {
+    uint64_t generation = variable_generation();
+    if (generation == policy_generation) {
+        return;
+    }
+    policy_generation = generation;
+    policy = AFFINITY_NONE;
+
+    const char *value = NULL;
+    for (Variable *curr = variables; curr != NULL; curr = curr->next) {
+        if (strcmp(curr->name, AFFINITY_VAR_NAME) == 0) {
+            value = curr->value;
+        }
+    }
+    if (value == NULL || *value == '\0' || strcmp(value, AFFINITY_NONE_STR) == 0) {
+        return;
+    }
+    if (strcmp(value, AFFINITY_COMPACT_STR) == 0) {
+        policy = AFFINITY_COMPACT;
+    } else if (strcmp(value, AFFINITY_SPREAD_STR) == 0) {
+        policy = AFFINITY_SPREAD;
+    } else if ((num_policy_cpus = parse_cpu_list(value, policy_cpus)) > 0) {
+        policy = AFFINITY_LIST;
+    } else {
+        ERR_PRINT(ERR_AFFINITY, value);
+    }
+}
+
+/*
+** Picks the CPU every stage of a pipeline is pinned to, following the
+** PIPELINE_AFFINITY variable, and stores it in the cpu of each command:
+**
+**   none     (or unset) stages go wherever the scheduler puts them
+**   compact  adjacent stages go on neighbouring cores, sharing L2/L3,
+**            starting from the CPU the shell runs on
+**   spread   stages are spread evenly over the CPUs the shell may use
+**   0-3,8    stage i goes on the i-th CPU of the list, wrapping around
+**
+** Single commands are never pinned. run_command applies the choice in
+** the child, before it execs.
+*/
+void place_pipeline(Command *head, Variable *variables) {
+    int num_stages = 0;
+    for (Command *command = head; command != NULL; command = command->next) {
+        command->cpu = -1;
+        num_stages++;
+    }
+    if (num_stages < 2) {
+        return;
+    }
+
+    load_affinity_policy(variables);
+    if (policy == AFFINITY_NONE) {
+        return;
+    }
+    if (policy == AFFINITY_LIST) {
+        int i = 0;
+        for (Command *command = head; command != NULL; command = command->next) {
+            command->cpu = policy_cpus[i++ % num_policy_cpus];
+        }
+        return;
+    }
+
+    if (num_cpus < 0) {
+        load_cpu_order();
+    }
+    if (num_cpus < 2) {
+        return;
+    }
+    // spread over physical cores while there are enough, so no two stages share one
+    const int *order = cpu_order;
+    int order_length = num_cpus;
+    int stride = 1;
+    if (policy == AFFINITY_SPREAD) {
+        if (num_stages <= num_cores) {
+            order = core_order;
+            order_length = num_cores;
+        }
+        stride = num_stages < order_length ? order_length / num_stages : 1;
+    }
+
+    // start where the shell is, so the first stage shares its caches
+    int base = 0;
+    int current = sched_getcpu();
+    for (int i = 0; i < order_length; i++) {
+        if (order[i] == current) {
+            base = i;
+        }
+    }
+    int i = 0;
+    for (Command *command = head; command != NULL; command = command->next) {
+        command->cpu = order[(base + i * stride) % order_length];
+        i++;
+    }
+}
+
+/*
+** Pins the calling process to a single CPU. Meant for a child of the
+** shell right before it execs, so a failure only costs the placement.
+*/
+void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
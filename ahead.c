@@ -0,0 +1,283 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <pthread.h>
+
+/*
+** A line read ahead of the one being run. Lines without variable usages
+** come with a template compiled against path_value; anything else is
+** parsed by run_script when its turn comes.
+*/
+typedef struct AheadLine {
+    char line[MAX_SINGLE_LINE];
+    Command *template;
+    char *path_value;
+    uint8_t barrier;
+} AheadLine;
+
+struct ParseAhead {
+    FILE *stream;
+    pthread_t thread;
+    uint8_t threaded;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    // Ring buffer, guarded by lock
+    AheadLine lines[PARSE_AHEAD_SIZE];
+    int head;
+    int count;
+    uint8_t done;
+    uint8_t stop;
+    uint8_t at_barrier;     // the reader waits for the block it last read
+    uint8_t took_barrier;   // the caller took that block's line
+
+    // The PATH the reader compiles against; it is replaced by the shell
+    // whenever a line turns out to have been compiled against a stale one
+    char *path_value;
+    uint64_t path_version;
+};
+
+
+/**
+ * Check whether lines can be compiled ahead against a PATH value.
+ *
+ * Only absolute, readable PATH directories are allowed, so compiling
+ * never prints errors out of order, and a `cd` cannot change the result.
+ *
+ * @param path_value The PATH value, or NULL if there is no PATH.
+ * @return 1 if lines can be compiled ahead, 0 otherwise.
+ */
+int path_is_stable(const char *path_value) {
+    if (path_value == NULL) {
+        return 0;
+    }
+    char *path_copy = strdup(path_value);
+    char *save_ptr;
+    int stable = 1;
+    for (char *dir_path = strtok_r(path_copy, ":", &save_ptr); dir_path != NULL && stable;
+         dir_path = strtok_r(NULL, ":", &save_ptr)) {
+        DIR *dir = dir_path[0] == '/' ? opendir(dir_path) : NULL;
+        if (dir == NULL) {
+            stable = 0;
+        } else {
+            closedir(dir);
+        }
+    }
+    free(path_copy);
+    return stable;
+}
+
+/**
+ * Tell whether a command is one of the shell's builtins, for the reader's context.
+ *
+ * @param name The name of the command.
+ * @return 1 if name is a builtin, 0 otherwise.
+ */
+int is_ahead_builtin(const char *name) {
+    return find_builtin(name) != NULL;
+}
+
+/**
+ * Read and compile the lines of a script into the ring buffer, until EOF
+ * or until the shell stops it. Control flow blocks read the rest of their
+ * lines from the stream themselves, so the reader waits at each of them
+ * until the shell is done with it.
+ *
+ * @param arg The ParseAhead to fill.
+ * @return NULL.
+ */
+void *read_ahead(void *arg) {
+    ParseAhead *ahead = arg;
+    Variable path = {PATH_VAR_NAME, NULL, NULL};
+    ParserContext context;
+    init_parser_context(&context, &path);
+    context.is_builtin = is_ahead_builtin;
+    context.path_lookup = path_cache_lookup;
+    context.path_insert = path_cache_insert;
+
+    uint64_t path_version = 0;
+    char *path_value = NULL;
+    int stable = 0;
+    char line[MAX_SINGLE_LINE];
+
+    while (fgets(line, MAX_SINGLE_LINE, ahead->stream) != NULL) {
+        // kill the newline
+        line[strcspn(line, "\n")] = '\0';
+
+        pthread_mutex_lock(&ahead->lock);
+        if (path_value == NULL || path_version != ahead->path_version) {
+            free(path_value);
+            path_value = ahead->path_value == NULL ? NULL : strdup(ahead->path_value);
+            path_version = ahead->path_version;
+            stable = -1;
+        }
+        pthread_mutex_unlock(&ahead->lock);
+        if (stable < 0) {
+            stable = path_is_stable(path_value);
+            path.value = path_value;
+        }
+
+        char *start = line;
+        trim_whitespace_leading(&start);
+        uint8_t barrier = is_block_start(start);
+
+        Command *template = NULL;
+        if (!barrier && stable && strchr(start, VARIABLE_PARSE_MARKER) == NULL) {
+            template = compile_line_r(&context, start);
+            if (template == (Command *) -1) {
+                // parsed again when it is run, so its errors come out in order
+                template = NULL;
+            }
+        }
+
+        pthread_mutex_lock(&ahead->lock);
+        while (ahead->count == PARSE_AHEAD_SIZE && !ahead->stop) {
+            pthread_cond_wait(&ahead->changed, &ahead->lock);
+        }
+        if (ahead->stop) {
+            pthread_mutex_unlock(&ahead->lock);
+            free_command(template);
+            break;
+        }
+        AheadLine *entry = &ahead->lines[(ahead->head + ahead->count) % PARSE_AHEAD_SIZE];
+        strcpy(entry->line, line);
+        entry->template = template;
+        entry->path_value = template == NULL ? NULL : strdup(path_value);
+        entry->barrier = barrier;
+        ahead->count++;
+        if (barrier) {
+            ahead->at_barrier = 1;
+        }
+        pthread_cond_broadcast(&ahead->changed);
+        while (ahead->at_barrier && !ahead->stop) {
+            pthread_cond_wait(&ahead->changed, &ahead->lock);
+        }
+        uint8_t stop = ahead->stop;
+        pthread_mutex_unlock(&ahead->lock);
+        if (stop) {
+            break;
+        }
+    }
+
+    free(path_value);
+    pthread_mutex_lock(&ahead->lock);
+    ahead->done = 1;
+    pthread_cond_broadcast(&ahead->changed);
+    pthread_mutex_unlock(&ahead->lock);
+    return NULL;
+}
+
+/*
+** Starts reading and compiling the lines of stream ahead of the shell,
+** on a thread of its own, with PARSE_AHEAD_SIZE lines of look-ahead.
+** With a single CPU, or if the thread cannot be started, lines are
+** simply read as they are asked for.
+*/
+ParseAhead *start_parse_ahead(FILE *stream, Variable *variables) {
+    ParseAhead *ahead = calloc(1, sizeof(ParseAhead));
+    ahead->stream = stream;
+    pthread_mutex_init(&ahead->lock, NULL);
+    pthread_cond_init(&ahead->changed, NULL);
+    if (variables != NULL && strcmp(variables->name, PATH_VAR_NAME) == 0) {
+        ahead->path_value = strdup(variables->value);
+    }
+
+    // with a single CPU, the reader could only ever run instead of the commands
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        ahead->threaded = pthread_create(&ahead->thread, NULL, read_ahead, ahead) == 0;
+    }
+    return ahead;
+}
+
+/*
+** Takes the next line of the script, in order, copying it into line.
+**
+** *template is set to the commands compiled for the line, or NULL if
+** the line must be parsed as usual. A template is only handed out if it
+** was compiled against the current PATH, and is owned by the caller.
+** If the line starts a control flow block, the caller may read the
+** rest of the block from the stream until it asks for the next line.
+**
+** Returns 1 if a line was taken, 0 at EOF.
+*/
+int next_parsed_line(ParseAhead *ahead, char *line, Command **template, Variable *variables) {
+    *template = NULL;
+    if (!ahead->threaded) {
+        if (fgets(line, MAX_SINGLE_LINE, ahead->stream) == NULL) {
+            return 0;
+        }
+        // kill the newline
+        line[strcspn(line, "\n")] = '\0';
+        return 1;
+    }
+
+    pthread_mutex_lock(&ahead->lock);
+    // the previous line was a block, which the caller is done reading
+    if (ahead->took_barrier) {
+        ahead->took_barrier = 0;
+        ahead->at_barrier = 0;
+        pthread_cond_broadcast(&ahead->changed);
+    }
+    while (ahead->count == 0 && !ahead->done) {
+        pthread_cond_wait(&ahead->changed, &ahead->lock);
+    }
+    if (ahead->count == 0) {
+        pthread_mutex_unlock(&ahead->lock);
+        return 0;
+    }
+
+    AheadLine *entry = &ahead->lines[ahead->head];
+    ahead->head = (ahead->head + 1) % PARSE_AHEAD_SIZE;
+    ahead->count--;
+    strcpy(line, entry->line);
+    Command *compiled = entry->template;
+    char *compiled_path = entry->path_value;
+    ahead->took_barrier = entry->barrier;
+
+    // a PATH assignment since this line was compiled makes its template stale
+    const char *path_value = variables != NULL && strcmp(variables->name, PATH_VAR_NAME) == 0 ?
+                             variables->value : NULL;
+    if (compiled != NULL && (path_value == NULL || strcmp(compiled_path, path_value) != 0)) {
+        free_command(compiled);
+        compiled = NULL;
+    }
+    if ((ahead->path_value == NULL) != (path_value == NULL) ||
+        (path_value != NULL && strcmp(ahead->path_value, path_value) != 0)) {
+        free(ahead->path_value);
+        ahead->path_value = path_value == NULL ? NULL : strdup(path_value);
+        ahead->path_version++;
+    }
+    pthread_cond_broadcast(&ahead->changed);
+    pthread_mutex_unlock(&ahead->lock);
+
+    free(compiled_path);
+    *template = compiled;
+    return 1;
+}
+
+/*
+** Stops the reader thread and frees everything it read that was not
+** taken. The stream is left open.
+*/
+void stop_parse_ahead(ParseAhead *ahead) {
+    if (ahead->threaded) {
+        pthread_mutex_lock(&ahead->lock);
+        ahead->stop = 1;
+        pthread_cond_broadcast(&ahead->changed);
+        pthread_mutex_unlock(&ahead->lock);
+        pthread_join(ahead->thread, NULL);
+    }
+
+    for (int i = 0; i < ahead->count; i++) {
+        AheadLine *entry = &ahead->lines[(ahead->head + i) % PARSE_AHEAD_SIZE];
+        free_command(entry->template);
+        free(entry->path_value);
+    }
+    pthread_mutex_destroy(&ahead->lock);
+    pthread_cond_destroy(&ahead->changed);
+    free(ahead->path_value);
+    free(ahead);
+}
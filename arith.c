@@ -0,0 +1,319 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <ctype.h>
+#include <limits.h>
+
+/*
+** State of the evaluation of one expression; kept on the stack, so the
+** evaluator is reentrant like the rest of the parser.
+*/
+typedef struct ArithReader {
+    const char *next;
+    Variable *variables;
+    int error;
+    int division_by_zero;
+} ArithReader;
+
+/*
+** Binary operators, from the loosest to the tightest binding, as in C.
+*/
+typedef enum ArithOperator {
+    OP_NONE, OP_OR, OP_XOR, OP_AND, OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE,
+    OP_SHL, OP_SHR, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD
+} ArithOperator;
+
+long parse_arith_expression(ArithReader *reader, int min_precedence);
+
+
+/**
+ * Skip the spaces in front of the next token of an expression.
+ *
+ * @param reader The reader of the expression.
+ */
+void skip_arith_spaces(ArithReader *reader) {
+    while (*reader->next == ' ' || *reader->next == '\t') {
+        reader->next++;
+    }
+}
+
+/**
+ * Get the precedence of a binary operator, higher binding tighter.
+ *
+ * @param op The operator.
+ * @return The precedence of op, 0 for OP_NONE.
+ */
+int arith_precedence(ArithOperator op) {
+    switch (op) {
+        case OP_OR: return 1;
+        case OP_XOR: return 2;
+        case OP_AND: return 3;
+        case OP_EQ: case OP_NE: return 4;
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE: return 5;
+        case OP_SHL: case OP_SHR: return 6;
+        case OP_ADD: case OP_SUB: return 7;
+        case OP_MUL: case OP_DIV: case OP_MOD: return 8;
+        default: return 0;
+    }
+}
+
+/**
+ * Read the binary operator at the reader's position, without consuming it.
+ *
+ * @param reader The reader of the expression.
+ * @param length Set to the number of characters of the operator.
+ * @return The operator, or OP_NONE if there is none.
+ */
+ArithOperator peek_arith_operator(ArithReader *reader, int *length) {
+    const char *c = reader->next;
+    *length = 2;
+    if (c[0] == '<' && c[1] == '<') return OP_SHL;
+    if (c[0] == '>' && c[1] == '>') return OP_SHR;
+    if (c[0] == '<' && c[1] == '=') return OP_LE;
+    if (c[0] == '>' && c[1] == '=') return OP_GE;
+    if (c[0] == '=' && c[1] == '=') return OP_EQ;
+    if (c[0] == '!' && c[1] == '=') return OP_NE;
+    *length = 1;
+    switch (c[0]) {
+        case '|': return OP_OR;
+        case '^': return OP_XOR;
+        case '&': return OP_AND;
+        case '<': return OP_LT;
+        case '>': return OP_GT;
+        case '+': return OP_ADD;
+        case '-': return OP_SUB;
+        case '*': return OP_MUL;
+        case '/': return OP_DIV;
+        case '%': return OP_MOD;
+        default: return OP_NONE;
+    }
+}
+
+/**
+ * Look up the value of a variable used in an expression.
+ *
+ * Unknown variables are reported like in any other expansion and count as 0.
+ *
+ * @param reader The reader of the expression.
+ * @param name The name of the variable.
+ * @return The value of the variable.
+ */
+long arith_variable(ArithReader *reader, const char *name) {
+    for (Variable *curr = reader->variables; curr != NULL; curr = curr->next) {
+        if (strcmp(curr->name, name) == 0) {
+            char *end;
+            errno = 0;
+            long value = strtol(curr->value, &end, 0);
+            while (*end == ' ') {
+                end++;
+            }
+            if (errno != 0 || end == curr->value || *end != '\0') {
+                ERR_PRINT(ERR_ARITH_VALUE, name, curr->value);
+                reader->error = 1;
+                return 0;
+            }
+            return value;
+        }
+    }
+    ERR_PRINT(ERR_VAR_NOT_FOUND, name);
+    return 0;
+}
+
+/**
+ * Parse and evaluate a number, a variable, a parenthesised expression,
+ * or a unary operator applied to one of those.
+ *
+ * @param reader The reader of the expression.
+ * @return The value of the operand.
+ */
+long parse_arith_operand(ArithReader *reader) {
+    skip_arith_spaces(reader);
+    char c = *reader->next;
+
+    if (c == '(') {
+        reader->next++;
+        long value = parse_arith_expression(reader, 1);
+        skip_arith_spaces(reader);
+        if (*reader->next != ')') {
+            reader->error = 1;
+            return 0;
+        }
+        reader->next++;
+        return value;
+    }
+    if (c == '-' || c == '+' || c == '~' || c == '!') {
+        reader->next++;
+        long value = parse_arith_operand(reader);
+        switch (c) {
+            case '-': return -(unsigned long) value;
+            case '~': return ~value;
+            case '!': return !value;
+            default: return value;
+        }
+    }
+    if (isdigit((unsigned char) c)) {
+        char *end;
+        errno = 0;
+        long value = strtol(reader->next, &end, 0);
+        if (errno != 0) {
+            reader->error = 1;
+        }
+        reader->next = end;
+        return value;
+    }
+
+    // $NAME and NAME are the same inside an expression
+    if (c == VARIABLE_PARSE_MARKER) {
+        reader->next++;
+    }
+    const char *name_start = reader->next;
+    while (isalpha((unsigned char) *reader->next) || *reader->next == '_') {
+        reader->next++;
+    }
+    size_t length = reader->next - name_start;
+    if (length == 0) {
+        reader->error = 1;
+        return 0;
+    }
+    char name[length + 1];
+    memcpy(name, name_start, length);
+    name[length] = '\0';
+    return arith_variable(reader, name);
+}
+
+/**
+ * Parse and evaluate an expression by precedence climbing: operands are
+ * combined with operators as long as they bind at least as tightly as
+ * min_precedence, and tighter operators on the right are evaluated first.
+ *
+ * @param reader The reader of the expression.
+ * @param min_precedence The loosest operator precedence to consume.
+ * @return The value of the expression.
+ */
+long parse_arith_expression(ArithReader *reader, int min_precedence) {
+    long left = parse_arith_operand(reader);
+
+    while (!reader->error) {
+        skip_arith_spaces(reader);
+        int length;
+        ArithOperator op = peek_arith_operator(reader, &length);
+        int precedence = arith_precedence(op);
+        if (op == OP_NONE || precedence < min_precedence) {
+            break;
+        }
+        reader->next += length;
+        // all binary operators are left associative
+        long right = parse_arith_expression(reader, precedence + 1);
+
+        switch (op) {
+            case OP_OR: left |= right; break;
+            case OP_XOR: left ^= right; break;
+            case OP_AND: left &= right; break;
+            case OP_EQ: left = left == right; break;
+            case OP_NE: left = left != right; break;
+            case OP_LT: left = left < right; break;
+            case OP_LE: left = left <= right; break;
+            case OP_GT: left = left > right; break;
+            case OP_GE: left = left >= right; break;
+            case OP_SHL: left = (unsigned long) left << (right & 63); break;
+            case OP_SHR: left >>= (right & 63); break;
+            case OP_ADD: left = (unsigned long) left + (unsigned long) right; break;
+            case OP_SUB: left = (unsigned long) left - (unsigned long) right; break;
+            case OP_MUL: left = (unsigned long) left * (unsigned long) right; break;
+            case OP_DIV:
+            case OP_MOD:
+                if (right == 0 || (left == LONG_MIN && right == -1)) {
+                    reader->division_by_zero = right == 0;
+                    reader->error = 1;
+                    break;
+                }
+                left = op == OP_DIV ? left / right : left % right;
+                break;
+            default: break;
+        }
+    }
+    return left;
+}
+
+/*
+** Evaluates an integer expression, as found between "$((" and "))".
+**
+** Supports decimal, octal and hex numbers, variables (with or without
+** '$'), parentheses, unary - + ~ !, and the binary operators
+** * / % + - << >> < <= > >= == != & ^ | with C precedence.
+**
+** Returns 0 and sets *result on success, -1 on a syntax error or a
+** division by zero.
+*/
+int evaluate_arithmetic(const char *expression, Variable *variables, long *result) {
+    ArithReader reader = {expression, variables, 0, 0};
+    long value = parse_arith_expression(&reader, 1);
+    skip_arith_spaces(&reader);
+    if (reader.division_by_zero) {
+        ERR_PRINT(ERR_ARITH_ZERO, expression);
+        return -1;
+    }
+    if (reader.error || *reader.next != '\0') {
+        ERR_PRINT(ERR_ARITH, expression);
+        return -1;
+    }
+    *result = value;
+    return 0;
+}
+
+/*
+** Creates a new line on the heap with every "$((expression))" of line
+** replaced by its value, in decimal.
+**
+** Returns NULL if an expression is unterminated or could not be evaluated.
+*/
+char *expand_arithmetic(const char *line, Variable *variables) {
+    size_t capacity = strlen(line) + 1;
+    char *expanded = malloc(capacity);
+    size_t length = 0;
+
+    const char *start;
+    while ((start = strstr(line, ARITH_START)) != NULL) {
+        // find the "))" that balances the opening "(("
+        const char *end = start + strlen(ARITH_START);
+        int depth = 2;
+        while (*end != '\0' && depth > 0) {
+            if (*end == '(') depth++;
+            if (*end == ')') depth--;
+            end++;
+        }
+        if (depth > 0 || end[-2] != ')') {
+            ERR_PRINT(ERR_ARITH, start);
+            free(expanded);
+            return NULL;
+        }
+
+        const char *expression_start = start + strlen(ARITH_START);
+        size_t expression_length = end - 2 - expression_start;
+        char expression[expression_length + 1];
+        memcpy(expression, expression_start, expression_length);
+        expression[expression_length] = '\0';
+
+        long value;
+        if (evaluate_arithmetic(expression, variables, &value) < 0) {
+            free(expanded);
+            return NULL;
+        }
+
+        char digits[32];
+        int num_digits = snprintf(digits, sizeof(digits), "%ld", value);
+        capacity += num_digits;
+        expanded = realloc(expanded, capacity);
+        memcpy(expanded + length, line, start - line);
+        length += start - line;
+        memcpy(expanded + length, digits, num_digits);
+        length += num_digits;
+        line = end;
+    }
+
+    strcpy(expanded + length, line);
+    return expanded;
+}
@@ -0,0 +1,388 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+extern char **environ;
+
+/*
+** State of one `batch` command: the command every batch runs, the
+** batches running right now, and with -k the output of every batch
+** that was not written out yet.
+*/
+typedef struct BatchRun {
+    Command command;
+    char **fixed_args;
+    int num_fixed;
+    int parallel;
+    uint8_t keep_order;
+
+    pid_t *running;
+    int *running_batch;
+    int num_running;
+
+    // -k only, indexed by batch
+    FILE **outputs;
+    uint8_t *finished;
+    int num_batches;
+    int batch_capacity;
+    int next_output;
+
+    int status;
+} BatchRun;
+
+
+/**
+ * Get the number of bytes a single argument takes out of ARG_MAX.
+ *
+ * @param arg The argument.
+ * @return The size of the argument and of its pointer in argv.
+ */
+size_t batch_arg_size(const char *arg) {
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+/**
+ * Get the number of bytes of ARG_MAX left for the items of a batch, once
+ * the environment, the fixed arguments and BATCH_ARG_HEADROOM are taken.
+ *
+ * @param run The batch command.
+ * @return The number of bytes left, 0 if there is no room at all.
+ */
+size_t batch_arg_budget(const BatchRun *run) {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) {
+        arg_max = BATCH_DEFAULT_ARG_MAX;
+    }
+    size_t used = BATCH_ARG_HEADROOM + sizeof(char *);
+    for (char **env = environ; *env != NULL; env++) {
+        used += batch_arg_size(*env);
+    }
+    for (int i = 0; i < run->num_fixed; i++) {
+        used += batch_arg_size(run->fixed_args[i]);
+    }
+    return used < (size_t) arg_max ? (size_t) arg_max - used : 0;
+}
+
+/**
+ * Write out the captured output of every finished batch that is next in
+ * order, for -k.
+ *
+ * @param run The batch command.
+ */
+void flush_batch_outputs(BatchRun *run) {
+    fflush(stdout);
+    while (run->next_output < run->num_batches && run->finished[run->next_output]) {
+        FILE *output = run->outputs[run->next_output];
+        if (output != NULL) {
+            rewind(output);
+            char buffer[BUFSIZ];
+            size_t num_read;
+            while ((num_read = fread(buffer, 1, sizeof(buffer), output)) > 0) {
+                size_t written = 0;
+                while (written < num_read) {
+                    ssize_t result = write(STDOUT_FILENO, buffer + written, num_read - written);
+                    if (result < 0 && errno != EINTR) {
+                        perror("write");
+                        break;
+                    }
+                    written += result < 0 ? 0 : result;
+                }
+            }
+            fclose(output);
+            run->outputs[run->next_output] = NULL;
+        }
+        run->next_output++;
+    }
+}
+
+/**
+ * Wait for one of the running batches to finish, and record its status.
+ *
+ * The shell has no other children while a builtin runs, so any child
+ * that is not a batch is simply reaped and ignored.
+ *
+ * @param run The batch command.
+ */
+void reap_batch(BatchRun *run) {
+    while (run->num_running > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("waitpid");
+            run->num_running = 0;
+            return;
+        }
+
+        for (int i = 0; i < run->num_running; i++) {
+            if (run->running[i] != pid) {
+                continue;
+            }
+            if (!WIFEXITED(status)) {
+                run->status = BATCH_KILLED;
+            } else if (WEXITSTATUS(status) != 0 && run->status == 0) {
+                run->status = BATCH_FAILED;
+            }
+            if (run->keep_order) {
+                run->finished[run->running_batch[i]] = 1;
+                flush_batch_outputs(run);
+            }
+            run->num_running--;
+            run->running[i] = run->running[run->num_running];
+            run->running_batch[i] = run->running_batch[run->num_running];
+            return;
+        }
+    }
+}
+
+/**
+ * Start the command on one batch of items, once fewer than -P batches run.
+ *
+ * @param run The batch command.
+ * @param items The items of the batch.
+ * @param num_items The number of items of the batch.
+ * @return 0 on success, -1 if the command could not be started.
+ */
+int start_batch(BatchRun *run, char **items, int num_items) {
+    while (run->num_running >= run->parallel) {
+        reap_batch(run);
+    }
+
+    // a batch may hold up to ARG_MAX worth of pointers, too many for the stack
+    char **args = malloc((run->num_fixed + num_items + 1) * sizeof(char *));
+    memcpy(args, run->fixed_args, run->num_fixed * sizeof(char *));
+    memcpy(args + run->num_fixed, items, num_items * sizeof(char *));
+    args[run->num_fixed + num_items] = NULL;
+    run->command.args = args;
+    run->command.stdin_fd = STDIN_FILENO;
+    run->command.stdout_fd = STDOUT_FILENO;
+    run->command.cpu = -1;
+    run->command.cgroup_fd = -1;
+
+    int batch = run->num_batches;
+    if (run->keep_order) {
+        if (batch == run->batch_capacity) {
+            run->batch_capacity *= 2;
+            run->outputs = realloc(run->outputs, run->batch_capacity * sizeof(FILE *));
+            run->finished = realloc(run->finished, run->batch_capacity);
+        }
+        run->outputs[batch] = tmpfile();
+        run->finished[batch] = 0;
+        if (run->outputs[batch] == NULL) {
+            perror("tmpfile");
+            free(args);
+            return -1;
+        }
+        // run_command closes the descriptor it is given once the child has it
+        run->command.stdout_fd = fcntl(fileno(run->outputs[batch]), F_DUPFD_CLOEXEC, 0);
+    }
+    run->num_batches++;
+
+    fflush(stdout);
+    int pid = run_command(&run->command);
+    free(args);
+    run->command.args = NULL;
+    if (pid < 0) {
+        if (run->keep_order) {
+            run->finished[batch] = 1;
+        }
+        // run_command already reported why
+        if (pid == EXEC_FAILED) {
+            run->status = errno == ENOENT ? EXIT_NOT_FOUND : EXIT_CANNOT_EXEC;
+        } else {
+            run->status = BATCH_KILLED;
+        }
+        return -1;
+    }
+
+    run->running[run->num_running] = pid;
+    run->running_batch[run->num_running] = batch;
+    run->num_running++;
+    return 0;
+}
+
+/**
+ * Read the items of -a FILE, one per line. Empty lines are skipped.
+ *
+ * @param file_path The file to read.
+ * @param items Pointer to the item array, grown as needed.
+ * @param num_items Pointer to the number of items in *items.
+ * @param capacity Pointer to the allocated size of *items.
+ * @return 0 on success, -1 if the file could not be read.
+ */
+int read_batch_items(const char *file_path, char ***items, int *num_items, int *capacity) {
+    FILE *file = fopen(file_path, "r");
+    if (file == NULL) {
+        ERR_PRINT(ERR_REDIR, file_path, strerror(errno));
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_capacity, file)) >= 0) {
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (*num_items == *capacity) {
+            *capacity *= 2;
+            *items = realloc(*items, *capacity * sizeof(char *));
+        }
+        (*items)[(*num_items)++] = strdup(line);
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+/*
+** Runs a command on a list of items, split into batches that each fit
+** in ARG_MAX, like xargs: `batch [-P N] [-k] [-n MAX] [-a FILE] COMMAND
+** [ARG...] [-- ITEM...]`.
+**
+** The items are the arguments after "--", then the lines of FILE. With
+** -P, up to N batches run at once (0 for one per CPU); with -k, the
+** output of every batch is held back until the batches before it are
+** done, so it comes out in order. -n caps the number of items per batch.
+**
+** Returns 0 if every batch succeeded, BATCH_FAILED if any exited with a
+** non-zero status, BATCH_KILLED if any was killed or could not be
+** started, and EXIT_NOT_FOUND or EXIT_CANNOT_EXEC if COMMAND could not
+** be run at all.
+*/
+int builtin_batch(char **args, Variable **root) {
+    int parallel = 1;
+    int max_items = 0;
+    uint8_t keep_order = 0;
+    const char *items_file = NULL;
+
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && strcmp(args[i], "--") != 0; i++) {
+        if (strcmp(args[i], "-k") == 0) {
+            keep_order = 1;
+        } else if ((strcmp(args[i], "-P") == 0 || strcmp(args[i], "-n") == 0) && args[i + 1] != NULL) {
+            char *end;
+            long value = strtol(args[i + 1], &end, 10);
+            if (*end != '\0' || value < 0) {
+                ERR_PRINT(ERR_BATCH_USAGE);
+                return 1;
+            }
+            if (args[i][1] == 'P') {
+                parallel = value == 0 ? sysconf(_SC_NPROCESSORS_ONLN) : value;
+            } else {
+                max_items = value;
+            }
+            i++;
+        } else if (strcmp(args[i], "-a") == 0 && args[i + 1] != NULL) {
+            items_file = args[++i];
+        } else {
+            ERR_PRINT(ERR_BATCH_USAGE);
+            return 1;
+        }
+    }
+    if (args[i] == NULL || strcmp(args[i], "--") == 0) {
+        ERR_PRINT(ERR_BATCH_USAGE);
+        return 1;
+    }
+
+    BatchRun run;
+    memset(&run, 0, sizeof(BatchRun));
+    run.fixed_args = args + i;
+    while (args[i] != NULL && strcmp(args[i], "--") != 0) {
+        i++;
+    }
+    run.num_fixed = args + i - run.fixed_args;
+    run.parallel = parallel < 1 ? 1 : parallel;
+    run.keep_order = keep_order;
+
+    // the items on the command line are used in place, only -a copies
+    int num_items = 0;
+    int capacity = 16;
+    char **items = malloc(capacity * sizeof(char *));
+    if (args[i] != NULL) {
+        for (i++; args[i] != NULL; i++) {
+            if (num_items == capacity) {
+                capacity *= 2;
+                items = realloc(items, capacity * sizeof(char *));
+            }
+            items[num_items++] = args[i];
+        }
+    }
+    int num_line_items = num_items;
+    if (items_file != NULL && read_batch_items(items_file, &items, &num_items, &capacity) < 0) {
+        free(items);
+        return 1;
+    }
+
+    run.command.exec_path = resolve_executable(run.fixed_args[0], *root);
+    if (run.command.exec_path == NULL) {
+        ERR_PRINT(ERR_NO_EXECU, run.fixed_args[0]);
+        for (int j = num_line_items; j < num_items; j++) {
+            free(items[j]);
+        }
+        free(items);
+        return EXIT_NOT_FOUND;
+    }
+
+    run.running = malloc(run.parallel * sizeof(pid_t));
+    run.running_batch = malloc(run.parallel * sizeof(int));
+    run.batch_capacity = 16;
+    if (keep_order) {
+        run.outputs = malloc(run.batch_capacity * sizeof(FILE *));
+        run.finished = malloc(run.batch_capacity);
+    }
+
+    size_t budget = batch_arg_budget(&run);
+    int start = 0;
+    while (start < num_items) {
+        size_t used = 0;
+        int end = start;
+        while (end < num_items && (max_items == 0 || end - start < max_items)) {
+            size_t size = batch_arg_size(items[end]);
+            // nor can a single argument over the kernel's own limit be passed
+            if (used + size > budget || strlen(items[end]) >= BATCH_MAX_ARG_LENGTH) {
+                break;
+            }
+            used += size;
+            end++;
+        }
+        if (end == start) {
+            ERR_PRINT(ERR_BATCH_TOO_LONG, items[start]);
+            run.status = BATCH_KILLED;
+            break;
+        }
+        if (start_batch(&run, items + start, end - start) < 0) {
+            break;
+        }
+        start = end;
+    }
+
+    while (run.num_running > 0) {
+        reap_batch(&run);
+    }
+    if (keep_order) {
+        // batches that never ran have nothing to write
+        for (int j = run.next_output; j < run.num_batches; j++) {
+            run.finished[j] = 1;
+        }
+        flush_batch_outputs(&run);
+    }
+
+    for (int j = num_line_items; j < num_items; j++) {
+        free(items[j]);
+    }
+    free(items);
+    free(run.command.exec_path);
+    free(run.running);
+    free(run.running_batch);
+    free(run.outputs);
+    free(run.finished);
+    return run.status;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# PIPELINE_AFFINITY on a four-stage pipeline that crunches bytes at every
+# stage: each policy runs the same pipeline, so the difference is only
+# where its stages were placed.
+#
+# Usage: bench/affinity.sh [SHELL]
+#   BENCH_AFFINITY_MB     MiB pushed through the pipeline (default 256)
+#   BENCH_AFFINITY_LIST   the CPU list to try (default the first 4 CPUs)
+
+SHELL_BIN=${1:-./cscshell}
+. "$(dirname "$0")/common.sh"
+
+MB=${BENCH_AFFINITY_MB:-256}
+CPUS=$(nproc)
+LIST=${BENCH_AFFINITY_LIST:-0-$(( (CPUS < 4 ? CPUS : 4) - 1 ))}
+
+for policy in none compact spread "$LIST"; do
+    {
+        echo "PIPELINE_AFFINITY=$policy"
+        echo "head -c ${MB}M /dev/zero | gzip -1 | gzip -d | wc -c"
+    } > "$DIR/pipeline_$policy"
+done
+
+echo "affinity, ${MB} MiB through head | gzip -1 | gzip -d | wc -c on $CPUS CPUs:"
+for policy in none compact spread "$LIST"; do
+    time_script "PIPELINE_AFFINITY=$policy" "$DIR/pipeline_$policy" "$MB" MiB
+done
@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# $((...)) evaluated inside the shell against forking expr for the same
+# arithmetic. The shell has no command substitution, so the expr lines only
+# pay for computing the value, not for using it: the comparison favours expr.
+#
+# Usage: bench/arith.sh [SHELL]
+
+SHELL_BIN=${1:-./cscshell}
+. "$(dirname "$0")/common.sh"
+
+{ echo "I=0"; awk 'BEGIN { for (i = 0; i < 1000; i++) print "I=$((I + 1))" }'; } > "$DIR/arith"
+{ echo "I=0"; awk 'BEGIN { for (i = 0; i < 1000; i++) print "expr ${I} + 1" }'; } > "$DIR/expr"
+{
+    echo "I=0"
+    awk 'BEGIN { for (i = 0; i < 100000; i++) print "I=$(((I * 31 + " i ") % 1000003 << 1 >> 1))" }'
+} > "$DIR/arith_long"
+
+echo "arith:"
+time_script "1000 x 'I=\$((I + 1))'" "$DIR/arith" 1000 op
+time_script "1000 x 'expr \${I} + 1'" "$DIR/expr" 1000 op
+time_script "100k x 'I=\$(((I * 31 + N) % 1000003 << 1 >> 1))'" "$DIR/arith_long" 100000 line
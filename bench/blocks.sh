@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Compiled loop bodies against the same body unrolled into a script:
+# 100k iterations of a builtin with a variable, so the shell's own cost
+# per iteration is measured, then 1000 iterations of an external command,
+# where fork and exec dominate.
+#
+# Usage: bench/blocks.sh [SHELL]
+
+SHELL_BIN=${1:-./cscshell}
+. "$(dirname "$0")/common.sh"
+
+# for_loop FILE BODY: five nested loops of 10, 100k iterations of BODY
+for_loop() {
+    {
+        echo "D=."
+        for var in A B C E F; do
+            echo "for $var in 0 1 2 3 4 5 6 7 8 9; do"
+        done
+        echo "$2"
+        for var in A B C E F; do
+            echo "done"
+        done
+    } > "$1"
+}
+
+for_loop "$DIR/loop" 'cd ${D}'
+{ echo "D=."; awk 'BEGIN { for (i = 0; i < 100000; i++) print "cd ${D}" }'; } > "$DIR/unrolled"
+# what a generator unrolling the innermost loop writes, its variable included
+{ echo "D=."; awk 'BEGIN { for (i = 0; i < 100000; i++) print "F=" i % 10 "\ncd ${D}" }'; } > "$DIR/unrolled_var"
+
+{
+    echo "for A in 0 1 2 3 4 5 6 7 8 9; do"
+    echo "for B in 0 1 2 3 4 5 6 7 8 9; do"
+    echo "for C in 0 1 2 3 4 5 6 7 8 9; do"
+    echo "true"
+    echo "done"
+    echo "done"
+    echo "done"
+} > "$DIR/loop_fork"
+awk 'BEGIN { for (i = 0; i < 1000; i++) print "true" }' > "$DIR/unrolled_fork"
+
+echo "blocks:"
+time_script "100k x 'cd \${D}', nested for loops" "$DIR/loop" 100000 iteration
+time_script "100k x 'cd \${D}', unrolled" "$DIR/unrolled" 100000 line
+time_script "100k x 'F=N' and 'cd \${D}', unrolled" "$DIR/unrolled_var" 100000 iteration
+time_script "1000 x 'true', nested for loops" "$DIR/loop_fork" 1000 iteration
+time_script "1000 x 'true', unrolled" "$DIR/unrolled_fork" 1000 line
@@ -0,0 +1,61 @@
+# Helpers shared by the benchmark scripts, sourced with SHELL_BIN set to
+# the shell under test. Every script gets a scratch directory in $DIR,
+# removed on exit, with an init file that only sets PATH.
+
+if [ ! -x "$SHELL_BIN" ]; then
+    echo "bench: $SHELL_BIN is not executable" >&2
+    exit 2
+fi
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/cscshell-bench.XXXXXX") || exit 2
+trap 'rm -rf "$DIR"' EXIT INT TERM
+echo "PATH=/bin:/usr/bin" > "$DIR/init"
+
+# Best of BENCH_RUNS runs (default 3), wall clock, in milliseconds
+BENCH_RUNS=${BENCH_RUNS:-3}
+
+now_ns() {
+    date +%s%N
+}
+
+# run_shell SCRIPT
+#   Runs SCRIPT with the shell. Its stdin is the file $BENCH_INPUT if set,
+#   given through a pipe instead if BENCH_PIPE=1.
+run_shell() {
+    if [ -z "$BENCH_INPUT" ]; then
+        "$SHELL_BIN" --init-file="$DIR/init" "$1"
+    elif [ "$BENCH_PIPE" = 1 ]; then
+        cat "$BENCH_INPUT" | "$SHELL_BIN" --init-file="$DIR/init" "$1"
+    else
+        "$SHELL_BIN" --init-file="$DIR/init" "$1" < "$BENCH_INPUT"
+    fi
+}
+
+# time_script LABEL SCRIPT [COUNT UNIT]
+#   Runs SCRIPT with the shell and prints its best time, and the time per
+#   UNIT if COUNT of them were run. Fails if the script prints an error.
+time_script() {
+    best=
+    run=0
+    while [ $run -lt "$BENCH_RUNS" ]; do
+        start=$(now_ns)
+        run_shell "$2" > /dev/null 2> "$DIR/err"
+        end=$(now_ns)
+        if [ -s "$DIR/err" ]; then
+            echo "bench: $2 did not run cleanly:" >&2
+            head -n 5 "$DIR/err" >&2
+            exit 1
+        fi
+        elapsed=$(( (end - start) / 1000 ))
+        if [ -z "$best" ] || [ $elapsed -lt $best ]; then
+            best=$elapsed
+        fi
+        run=$((run + 1))
+    done
+    if [ -n "$3" ]; then
+        printf "  %-48s %8d.%03d ms  %8d ns/%s\n" "$1" $((best / 1000)) $((best % 1000)) \
+               $((best * 1000 / $3)) "$4"
+    else
+        printf "  %-48s %8d.%03d ms\n" "$1" $((best / 1000)) $((best % 1000))
+    fi
+}
@@ -0,0 +1,164 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+/*
+** Benchmark of the lexer on 4 KiB and 1 MiB lines, against libcscparse:
+** classify_line with the classifier init_lexer picked and with each of
+** the others this CPU can run, then parse_line_r on the same sizes.
+**
+** Usage: lex_bench
+*/
+
+#include "../cscshell.h"
+#include <time.h>
+
+// The classifiers themselves, normally only reached through classify_line
+void classify_scalar(const char *line, size_t start, size_t length, uint64_t *bits);
+#if defined(__x86_64__) || defined(__i386__)
+void classify_sse2(const char *line, size_t start, size_t length, uint64_t *bits);
+void classify_avx2(const char *line, size_t start, size_t length, uint64_t *bits);
+#endif
+
+#define BENCH_BYTES (256 << 20)
+#define BENCH_MIN_RUNS 8
+
+typedef void (*Classifier)(const char *line, size_t start, size_t length, uint64_t *bits);
+
+
+/**
+ * Return the time on a monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Make a line that looks like a long pipeline: words, variables,
+ * redirections and pipes, a special character every few bytes.
+ *
+ * @param length The length of the line, without its NUL.
+ * @return The line, to be freed by the caller.
+ */
+char *make_line(size_t length) {
+    static const char stage[] = "grep -v $PATTERN ${DIR}/in.txt | sort -k2 > out.txt | ";
+    static const char last_stage[] = "cat";
+    size_t stage_length = sizeof(stage) - 1;
+    size_t last_length = sizeof(last_stage) - 1;
+
+    char *line = malloc(length + 1);
+    size_t end = 0;
+    while (end + stage_length + last_length <= length) {
+        memcpy(line + end, stage, stage_length);
+        end += stage_length;
+    }
+    memcpy(line + end, last_stage, last_length);
+    end += last_length;
+    // trailing blanks up to the exact length, which the parser trims
+    memset(line + end, ' ', length - end);
+    line[length] = '\0';
+    return line;
+}
+
+/**
+ * Resolve every command to /bin, as the PATH cache of an embedder would
+ * without touching the file system, so parse_line_r is timed on its own.
+ *
+ * @param name The command name.
+ * @param path_value Unused.
+ * @return Its path, to be freed by the caller.
+ */
+char *lookup_in_bin(const char *name, const char *path_value) {
+    char *exec_path = malloc(strlen(name) + sizeof("/bin/"));
+    sprintf(exec_path, "/bin/%s", name);
+    return exec_path;
+}
+
+/**
+ * Print the throughput of a classifier on a line, over about
+ * BENCH_BYTES bytes in total.
+ *
+ * @param name The name of the classifier.
+ * @param classify The classifier, or NULL for classify_line itself.
+ * @param line The line.
+ * @param length The length of the line.
+ */
+void bench_classifier(const char *name, Classifier classify, const char *line, size_t length) {
+    int runs = BENCH_BYTES / length > BENCH_MIN_RUNS ? BENCH_BYTES / length : BENCH_MIN_RUNS;
+    uint64_t *bits = calloc((length + 63) / 64, sizeof(uint64_t));
+    uint64_t start = now_ns();
+    for (int i = 0; i < runs; i++) {
+        if (classify == NULL) {
+            LineMask mask;
+            classify_line(line, length, &mask);
+            free_line_mask(&mask);
+        } else {
+            memset(bits, 0, (length + 63) / 64 * sizeof(uint64_t));
+            classify(line, 0, length, bits);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    free(bits);
+    printf("  %-26s %8zu B  %10.1f us/line  %6.2f GB/s\n", name, length,
+           elapsed / 1000.0 / runs, (double) length * runs / elapsed);
+}
+
+/**
+ * Print how long parse_line_r takes on a line.
+ *
+ * @param line The line.
+ * @param length The length of the line.
+ */
+void bench_parse(const char *line, size_t length) {
+    ParserContext context;
+    init_parser_context(&context, NULL);
+    add_variable_r(&context, PATH_VAR_NAME, "/bin:/usr/bin");
+    add_variable_r(&context, "PATTERN", "a");
+    add_variable_r(&context, "DIR", "/tmp");
+    context.path_lookup = lookup_in_bin;
+
+    int runs = BENCH_BYTES / 16 / length > BENCH_MIN_RUNS ? BENCH_BYTES / 16 / length : BENCH_MIN_RUNS;
+    uint64_t start = now_ns();
+    for (int i = 0; i < runs; i++) {
+        Command *commands = parse_line_r(&context, line);
+        if (commands == NULL || commands == (Command *) -1) {
+            fprintf(stderr, "lex_bench: could not parse the %zu byte line\n", length);
+            exit(1);
+        }
+        free_command(commands);
+    }
+    uint64_t elapsed = now_ns() - start;
+    free_variable(context.variables, 1);
+    printf("  %-26s %8zu B  %10.1f us/line  %6.2f GB/s\n", "parse_line_r", length,
+           elapsed / 1000.0 / runs, (double) length * runs / elapsed);
+}
+
+int main(void) {
+    size_t lengths[] = {4096, 1 << 20};
+    char picked[64];
+    snprintf(picked, sizeof(picked), "classify_line (%s)", lexer_name());
+
+    printf("lexer:\n");
+    for (int i = 0; i < 2; i++) {
+        char *line = make_line(lengths[i]);
+        bench_classifier(picked, NULL, line, lengths[i]);
+        bench_classifier("scalar", classify_scalar, line, lengths[i]);
+        #if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2")) {
+            bench_classifier("sse2", classify_sse2, line, lengths[i]);
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            bench_classifier("avx2", classify_avx2, line, lengths[i]);
+        }
+        #endif
+        bench_parse(line, lengths[i]);
+        free(line);
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Long && chains against the same commands one per line: builtins, so the
+# cost of parsing and walking the list shows, then external commands,
+# then a chain that short-circuits after its first command.
+#
+# Usage: bench/lists.sh [SHELL]
+
+SHELL_BIN=${1:-./cscshell}
+. "$(dirname "$0")/common.sh"
+
+# chain LINES LENGTH FIRST REST: LINES lines of FIRST && REST && REST...
+chain() {
+    awk -v lines="$1" -v length_="$2" -v first="$3" -v rest="$4" 'BEGIN {
+        for (i = 0; i < lines; i++) {
+            line = first
+            for (j = 1; j < length_; j++) {
+                line = line " && " rest
+            }
+            print line
+        }
+    }'
+}
+
+chain 2000 50 "cd ." "cd ." > "$DIR/builtin_chain"
+chain 100000 1 "cd ." "" > "$DIR/builtin_lines"
+chain 20 50 "true" "true" > "$DIR/true_chain"
+chain 1000 1 "true" "" > "$DIR/true_lines"
+chain 20 50 "false" "true" > "$DIR/false_chain"
+
+echo "lists:"
+time_script "100k 'cd .', 2000 lines of 50-long && chains" "$DIR/builtin_chain" 100000 command
+time_script "100k 'cd .', one per line" "$DIR/builtin_lines" 100000 command
+time_script "1000 'true', 20 lines of 50-long && chains" "$DIR/true_chain" 1000 command
+time_script "1000 'true', one per line" "$DIR/true_lines" 1000 command
+time_script "20 lines of 'false && true && ...' (50 long)" "$DIR/false_chain"
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# The read builtin on a 1M-line input: from a regular file, where read
+# buffers and seeks back, then from a pipe, where it has to take one byte
+# at a time so as not to eat what follows the line.
+#
+# Usage: bench/read.sh [SHELL]
+
+SHELL_BIN=${1:-./cscshell}
+. "$(dirname "$0")/common.sh"
+
+awk 'BEGIN { for (i = 0; i < 1000000; i++) print "key" i " value " i " and the rest of the line" }' \
+    > "$DIR/input"
+{
+    echo "while read A B; do"
+    echo "C=\${A}"
+    echo "done"
+} > "$DIR/read_loop"
+
+echo "read:"
+BENCH_INPUT="$DIR/input"
+time_script "1M x 'read A B', from a file" "$DIR/read_loop" 1000000 line
+BENCH_PIPE=1
+time_script "1M x 'read A B', from a pipe" "$DIR/read_loop" 1000000 line
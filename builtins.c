@@ -0,0 +1,324 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <ctype.h>
+
+int builtin_cd(char **args, Variable **root);
+int builtin_parsecache(char **args, Variable **root);
+int builtin_read(char **args, Variable **root);
+
+static const Builtin builtins[] = {
+    {CD, builtin_cd},
+    {PARSECACHE, builtin_parsecache},
+    {READ, builtin_read},
+    {BATCH, builtin_batch},
+    {STATS, builtin_stats},
+    {EXEC, builtin_exec},
+    {NULL, NULL}
+};
+
+// The variables of the running shell, for builtins that need them
+static Variable **builtin_variables = NULL;
+
+// Bytes `read` took from a seekable stdin but has not used yet. They are
+// only valid while stdin is still at read_offset, which is the position
+// of read_buffer[read_start]: children share the offset, so it is always
+// moved back to just after the last line read.
+static char read_buffer[READ_BUFFER_SIZE];
+static size_t read_start = 0;
+static size_t read_end = 0;
+static off_t read_offset = -1;
+
+
+/**
+ * Change the working directory of the shell.
+ *
+ * @param args The arguments of the command, args[1] is the target directory.
+ * @param root Unused.
+ * @return The return value of cd_cscshell.
+ */
+int builtin_cd(char **args, Variable **root) {
+    return cd_cscshell(args[1]);
+}
+
+/**
+ * Print the hit and miss counters of the parse cache.
+ *
+ * @param args Unused.
+ * @param root Unused.
+ * @return 0.
+ */
+int builtin_parsecache(char **args, Variable **root) {
+    ParseCacheStats stats;
+    parse_cache_stats(&stats);
+    printf("hits: %lu\n", (unsigned long) stats.hits);
+    printf("misses: %lu\n", (unsigned long) stats.misses);
+    printf("entries: %u/%u\n", stats.entries, PARSE_CACHE_SIZE);
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Append bytes to a line being read, growing it as needed.
+ *
+ * @param line Pointer to the line, reallocated as needed.
+ * @param length Pointer to the length of the line.
+ * @param capacity Pointer to the allocated size of the line.
+ * @param bytes The bytes to append.
+ * @param count The number of bytes to append.
+ */
+void append_read_bytes(char **line, size_t *length, size_t *capacity, const char *bytes, size_t count) {
+    if (*length + count + 1 > *capacity) {
+        while (*length + count + 1 > *capacity) {
+            *capacity *= 2;
+        }
+        *line = realloc(*line, *capacity);
+    }
+    memcpy(*line + *length, bytes, count);
+    *length += count;
+    (*line)[*length] = '\0';
+}
+
+/**
+ * Read a line from a seekable stdin, READ_BUFFER_SIZE bytes at a time.
+ *
+ * Bytes past the line are kept for the next call, and stdin is moved back
+ * to just after the line, so commands run in between read from there.
+ *
+ * @param position The current offset of stdin.
+ * @param line Pointer to the line, reallocated as needed.
+ * @param length Pointer to the length of the line.
+ * @param capacity Pointer to the allocated size of the line.
+ * @return 1 if a whole line was read, 0 at EOF, -1 on error.
+ */
+int read_buffered_line(off_t position, char **line, size_t *length, size_t *capacity) {
+    // something else moved stdin since the last call
+    if (position != read_offset) {
+        read_start = read_end = 0;
+    }
+
+    int found = 0;
+    while (1) {
+        char *start = read_buffer + read_start;
+        char *newline = memchr(start, '\n', read_end - read_start);
+        size_t count = newline != NULL ? (size_t) (newline - start) : read_end - read_start;
+        append_read_bytes(line, length, capacity, start, count);
+        read_start += count + (newline != NULL);
+        position += count + (newline != NULL);
+        if (newline != NULL) {
+            found = 1;
+            break;
+        }
+
+        // pread leaves the offset alone, so it only has to be set once
+        ssize_t num_read = pread(STDIN_FILENO, read_buffer, READ_BUFFER_SIZE, position);
+        if (num_read < 0 && errno == EINTR) {
+            continue;
+        }
+        read_start = read_end = 0;
+        if (num_read <= 0) {
+            if (num_read < 0) {
+                perror("read");
+                read_offset = -1;
+                return -1;
+            }
+            break;
+        }
+        read_end = num_read;
+    }
+
+    read_offset = lseek(STDIN_FILENO, position, SEEK_SET);
+    return found;
+}
+
+/**
+ * Read a line from stdin one byte at a time, so that nothing past the
+ * line is consumed when stdin cannot be seeked back, as with pipes.
+ *
+ * @param line Pointer to the line, reallocated as needed.
+ * @param length Pointer to the length of the line.
+ * @param capacity Pointer to the allocated size of the line.
+ * @return 1 if a whole line was read, 0 at EOF, -1 on error.
+ */
+int read_unbuffered_line(char **line, size_t *length, size_t *capacity) {
+    char c;
+    while (1) {
+        ssize_t num_read = read(STDIN_FILENO, &c, 1);
+        if (num_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_read < 0) {
+            perror("read");
+            return -1;
+        }
+        if (num_read == 0) {
+            return 0;
+        }
+        if (c == '\n') {
+            return 1;
+        }
+        append_read_bytes(line, length, capacity, &c, 1);
+    }
+}
+
+/*
+** Drops the bytes `read` buffered from stdin, for when stdin is replaced:
+** the new one could be at the same offset as the old one was.
+*/
+void forget_read_buffer(void) {
+    read_start = read_end = 0;
+    read_offset = -1;
+}
+
+/**
+ * Split the next field off a line read by `read`, at the characters of IFS.
+ *
+ * Runs of IFS whitespace count as a single separator, and may surround
+ * one other IFS character. The field is NUL terminated in place.
+ *
+ * @param rest Pointer to the rest of the line, advanced past the field and its separator.
+ * @param ifs The separator characters.
+ * @return The field.
+ */
+char *split_read_field(char **rest, const char *ifs) {
+    char *field = *rest;
+    char *end = field + strcspn(field, ifs);
+    char *next = end;
+    while (*next != '\0' && strchr(ifs, *next) != NULL && isspace((unsigned char) *next)) {
+        next++;
+    }
+    if (*next != '\0' && strchr(ifs, *next) != NULL && !isspace((unsigned char) *next)) {
+        next++;
+        while (*next != '\0' && strchr(ifs, *next) != NULL && isspace((unsigned char) *next)) {
+            next++;
+        }
+    }
+    *end = '\0';
+    *rest = next;
+    return field;
+}
+
+/**
+ * Read a line from stdin into variables: `read NAME...`.
+ *
+ * The line is split into fields at the characters of IFS (DEFAULT_IFS if
+ * it is not set), one per name, and the last name gets the rest of the
+ * line. Leading and trailing IFS whitespace is dropped. With no names,
+ * the whole line goes to READ_DEFAULT_VAR. Names without a field are set
+ * to the empty string.
+ *
+ * @param args The arguments of the command, the names of the variables.
+ * @param root Pointer to the head of the linked list of variables.
+ * @return 0 if a line was read, 1 at EOF or on error; variables are
+ *         still set from a last line without a newline.
+ */
+int builtin_read(char **args, Variable **root) {
+    char *default_names[] = {READ, READ_DEFAULT_VAR, NULL};
+    if (args[1] == NULL) {
+        args = default_names;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        for (const char *c = args[i]; *c != '\0'; c++) {
+            if (!isalpha((unsigned char) *c) && *c != '_') {
+                ERR_PRINT(ERR_VAR_NAME, args[i]);
+                return 1;
+            }
+        }
+    }
+
+    size_t capacity = 128;
+    size_t length = 0;
+    char *line = malloc(capacity);
+    line[0] = '\0';
+
+    int result;
+    off_t position = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (position >= 0) {
+        result = read_buffered_line(position, &line, &length, &capacity);
+    } else {
+        read_offset = -1;
+        result = read_unbuffered_line(&line, &length, &capacity);
+    }
+    if (result < 0 || (result == 0 && length == 0)) {
+        free(line);
+        return 1;
+    }
+
+    const char *ifs = DEFAULT_IFS;
+    for (Variable *curr = *root; curr != NULL; curr = curr->next) {
+        if (strcmp(curr->name, IFS_VAR_NAME) == 0) {
+            ifs = curr->value;
+        }
+    }
+
+    // drop the IFS whitespace around the line
+    char *rest = line;
+    while (*rest != '\0' && strchr(ifs, *rest) != NULL && isspace((unsigned char) *rest)) {
+        rest++;
+    }
+    char *end = line + length;
+    while (end > rest && strchr(ifs, end[-1]) != NULL && isspace((unsigned char) end[-1])) {
+        *--end = '\0';
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        const char *value = args[i + 1] == NULL ? rest : split_read_field(&rest, ifs);
+        add_variable(args[i], value, root);
+    }
+
+    free(line);
+    return result == 1 ? 0 : 1;
+}
+
+/*
+** Looks up a builtin by name.
+**
+** Returns the builtin, or NULL if name is not a builtin.
+*/
+const Builtin *find_builtin(const char *name) {
+    for (int i = 0; builtins[i].name != NULL; i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+** Sets the variables list that builtins run against.
+*/
+void set_builtin_variables(Variable **root) {
+    builtin_variables = root;
+}
+
+/*
+** Returns the variables list set with set_builtin_variables, or NULL if
+** there is none yet.
+*/
+Variable *get_builtin_variables(void) {
+    return builtin_variables == NULL ? NULL : *builtin_variables;
+}
+
+/*
+** Returns the pointer set with set_builtin_variables, for code that may
+** add to the variables list, or NULL if there is none yet.
+*/
+Variable **get_builtin_root(void) {
+    return builtin_variables;
+}
+
+/*
+** Runs a builtin inside the shell process itself. The redirections of
+** an exec are applied to the shell first, see redirect_shell.
+**
+** Returns the exit status of the builtin.
+*/
+int run_builtin(const Builtin *builtin, Command *command) {
+    if (strcmp(builtin->name, EXEC) == 0 && redirect_shell(command) < 0) {
+        return 1;
+    }
+    return builtin->function(command->args, builtin_variables);
+}
@@ -0,0 +1,633 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+/*
+** A parse cache entry; entries are kept both in a hash bucket chain
+** (for lookups) and in a doubly-linked list from most to least
+** recently used (for eviction).
+*/
+typedef struct ParseCacheEntry {
+    char *line;
+    uint64_t hash;
+    uint64_t generation;
+    Command *commands;
+    struct ParseCacheEntry *prev;
+    struct ParseCacheEntry *next;
+    struct ParseCacheEntry *chain;
+} ParseCacheEntry;
+
+/*
+** A PATH lookup cache entry, in a hash bucket chain. A NULL exec_path
+** records that the command was not found, at the time in missed_at.
+*/
+typedef struct PathCacheEntry {
+    char *name;
+    char *exec_path;
+    time_t missed_at;
+    struct PathCacheEntry *chain;
+} PathCacheEntry;
+
+/*
+** The mtime of a PATH directory when the cached misses were recorded.
+*/
+typedef struct PathDirStamp {
+    char *dir;
+    struct timespec mtime;
+} PathDirStamp;
+
+static ParseCacheEntry *buckets[PARSE_CACHE_BUCKETS];
+static ParseCacheEntry *most_recent = NULL;
+static ParseCacheEntry *least_recent = NULL;
+static ParseCacheStats cache_stats;
+// commands of the last line that changed variables while it was parsed,
+// owned here like cached ones until the next call
+static Command *uncached_commands = NULL;
+
+static PathCacheEntry *path_buckets[PATH_CACHE_BUCKETS];
+// the PATH value every cached lookup was made against
+static char *cached_path_value = NULL;
+// the PATH directories the cached misses are valid for, NULL if not stamped
+static PathDirStamp *dir_stamps = NULL;
+static int num_dir_stamps = 0;
+// scripts are compiled ahead on another thread, see ahead.c
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+// counted under path_cache_lock, read without it
+static PathCacheStats path_stats;
+
+// inotify watches on every PATH directory, -1 if stat is used instead
+static int watch_fd = -1;
+// set by SIGIO once the watches have events to read
+static volatile sig_atomic_t watch_events = 0;
+static uint8_t watch_handlers_set = 0;
+
+
+/**
+ * Hash a line with 64-bit FNV-1a.
+ *
+ * @param line The line to hash.
+ * @return The hash of the line.
+ */
+uint64_t hash_line(const char *line) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *line != '\0'; line++) {
+        hash ^= (unsigned char) *line;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Remove an entry from the recently used list.
+ *
+ * @param entry The entry to unlink.
+ */
+void unlink_recent(ParseCacheEntry *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        most_recent = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        least_recent = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+/**
+ * Put an entry at the front of the recently used list.
+ *
+ * @param entry The entry to mark as most recently used.
+ */
+void push_recent(ParseCacheEntry *entry) {
+    entry->prev = NULL;
+    entry->next = most_recent;
+    if (most_recent != NULL) {
+        most_recent->prev = entry;
+    }
+    most_recent = entry;
+    if (least_recent == NULL) {
+        least_recent = entry;
+    }
+}
+
+/**
+ * Remove an entry from the cache entirely and free it, along with its commands.
+ *
+ * @param entry The entry to evict.
+ */
+void evict_entry(ParseCacheEntry *entry) {
+    ParseCacheEntry **link = &buckets[entry->hash % PARSE_CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+    unlink_recent(entry);
+
+    free_command(entry->commands);
+    free(entry->line);
+    free(entry);
+    cache_stats.entries--;
+}
+
+/*
+** Parses a line through the parse cache.
+**
+** Lines that produce commands are cached by their raw text and the
+** generation of the variables list, so running the same line again
+** skips parsing and PATH resolution entirely as long as no variable
+** changed in between. The least recently used entry is evicted once
+** PARSE_CACHE_SIZE lines are cached.
+**
+** Return values are those of parse_line, but the returned commands are
+** owned by the cache and must not be freed by the caller. They are only
+** valid until the next call.
+*/
+Command *parse_line_cached(char *line, Variable **variables) {
+    if (uncached_commands != NULL) {
+        free_command(uncached_commands);
+        uncached_commands = NULL;
+    }
+
+    uint64_t hash = hash_line(line);
+    uint64_t generation = variable_generation();
+
+    ParseCacheEntry *entry = buckets[hash % PARSE_CACHE_BUCKETS];
+    while (entry != NULL) {
+        if (entry->hash == hash && strcmp(entry->line, line) == 0) {
+            break;
+        }
+        entry = entry->chain;
+    }
+
+    if (entry != NULL && entry->generation == generation) {
+        cache_stats.hits++;
+        unlink_recent(entry);
+        push_recent(entry);
+        return entry->commands;
+    }
+    cache_stats.misses++;
+
+    // a stale entry for this line can never be hit again
+    if (entry != NULL) {
+        evict_entry(entry);
+    }
+
+    char *key = strdup(line);
+    Command *commands = parse_line(line, variables);
+    // assignments change the generation, so there is nothing worth keeping
+    if (commands == NULL || commands == (Command *) -1 ||
+        generation != variable_generation()) {
+        free(key);
+        if (commands != NULL && commands != (Command *) -1) {
+            uncached_commands = commands;
+        }
+        return commands;
+    }
+
+    if (cache_stats.entries >= PARSE_CACHE_SIZE) {
+        evict_entry(least_recent);
+    }
+
+    entry = malloc(sizeof(ParseCacheEntry));
+    entry->line = key;
+    entry->hash = hash;
+    entry->generation = generation;
+    entry->commands = commands;
+    entry->chain = buckets[hash % PARSE_CACHE_BUCKETS];
+    buckets[hash % PARSE_CACHE_BUCKETS] = entry;
+    push_recent(entry);
+    cache_stats.entries++;
+
+    return commands;
+}
+
+/*
+** Copies the parse cache counters into stats.
+*/
+void parse_cache_stats(ParseCacheStats *stats) {
+    *stats = cache_stats;
+}
+
+/*
+** Frees every entry of the parse cache.
+*/
+void clear_parse_cache(void) {
+    while (least_recent != NULL) {
+        evict_entry(least_recent);
+    }
+    free_command(uncached_commands);
+    uncached_commands = NULL;
+}
+
+/**
+ * Remove an entry from the PATH lookup cache and free it.
+ *
+ * @param link The link pointing at the entry to remove.
+ */
+void remove_path_entry(PathCacheEntry **link) {
+    PathCacheEntry *entry = *link;
+    *link = entry->chain;
+    free(entry->name);
+    free(entry->exec_path);
+    free(entry);
+}
+
+/**
+ * Forget the PATH directory mtimes the cached misses were recorded against.
+ */
+void clear_dir_stamps(void) {
+    for (int i = 0; i < num_dir_stamps; i++) {
+        free(dir_stamps[i].dir);
+    }
+    free(dir_stamps);
+    dir_stamps = NULL;
+    num_dir_stamps = 0;
+}
+
+/**
+ * Record the mtime of every directory of a PATH value.
+ *
+ * @param path_value The PATH value.
+ * @return 0 on success, -1 if any directory could not be stat'd. Misses are
+ *         not cached then, so resolve_executable keeps reporting the bad directory.
+ */
+int stamp_path_dirs(const char *path_value) {
+    clear_dir_stamps();
+    char *path_copy = strdup(path_value);
+    char *save_ptr;
+    for (char *dir = strtok_r(path_copy, ":", &save_ptr); dir != NULL;
+         dir = strtok_r(NULL, ":", &save_ptr)) {
+        struct stat dir_stat;
+        if (stat(dir, &dir_stat) < 0 || !S_ISDIR(dir_stat.st_mode)) {
+            free(path_copy);
+            clear_dir_stamps();
+            return -1;
+        }
+        dir_stamps = realloc(dir_stamps, sizeof(PathDirStamp) * (num_dir_stamps + 1));
+        dir_stamps[num_dir_stamps].dir = strdup(dir);
+        dir_stamps[num_dir_stamps].mtime = dir_stat.st_mtim;
+        num_dir_stamps++;
+    }
+    free(path_copy);
+    return 0;
+}
+
+/**
+ * Check that no PATH directory changed since the cached misses were recorded.
+ * Only stat is used, no directory is read.
+ *
+ * @return 1 if every directory still has its recorded mtime, 0 otherwise.
+ */
+int dir_stamps_valid(void) {
+    if (dir_stamps == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < num_dir_stamps; i++) {
+        struct stat dir_stat;
+        if (stat(dir_stamps[i].dir, &dir_stat) < 0 ||
+            dir_stat.st_mtim.tv_sec != dir_stamps[i].mtime.tv_sec ||
+            dir_stat.st_mtim.tv_nsec != dir_stamps[i].mtime.tv_nsec) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Drop every cached miss, keeping the commands that were found.
+ */
+void remove_missing_entries(void) {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        PathCacheEntry **link = &path_buckets[i];
+        while (*link != NULL) {
+            if ((*link)->exec_path == NULL) {
+                remove_path_entry(link);
+            } else {
+                link = &(*link)->chain;
+            }
+        }
+    }
+    clear_dir_stamps();
+}
+
+/**
+ * Get the current time for cached misses, which must not jump with the wall clock.
+ *
+ * @return The number of seconds on the monotonic clock.
+ */
+time_t miss_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/**
+ * Note that the PATH directory watches have events to read.
+ *
+ * @param sig The signal received.
+ */
+void path_dirs_changed(int sig) {
+    watch_events = 1;
+}
+
+/**
+ * Stop watching the PATH directories, so entries are validated with stat.
+ */
+void unwatch_path_dirs(void) {
+    if (watch_fd >= 0) {
+        close(watch_fd);
+        watch_fd = -1;
+    }
+    watch_events = 0;
+}
+
+/**
+ * Drop the PATH directory watches in a forked child, which must not read
+ * the events the shell itself is waiting for.
+ */
+void unwatch_in_child(void) {
+    unwatch_path_dirs();
+}
+
+/**
+ * Watch every directory of a PATH value with inotify, so cached entries
+ * are dropped when a directory changes instead of being checked with stat.
+ * Events raise SIGIO, and are only read once there are some.
+ *
+ * If any directory cannot be watched, for instance once the inotify watch
+ * limit is reached, nothing is watched and stat is used instead.
+ *
+ * @param path_value The PATH value.
+ */
+void watch_path_dirs(const char *path_value) {
+    unwatch_path_dirs();
+
+    if (!watch_handlers_set) {
+        struct sigaction changed_action = {0};
+        changed_action.sa_handler = path_dirs_changed;
+        changed_action.sa_flags = SA_RESTART;
+        sigaction(SIGIO, &changed_action, NULL);
+        pthread_atfork(NULL, NULL, unwatch_in_child);
+        watch_handlers_set = 1;
+    }
+
+    watch_fd = move_shell_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    if (watch_fd < 0) {
+        return;
+    }
+    if (fcntl(watch_fd, F_SETOWN, getpid()) < 0 ||
+        fcntl(watch_fd, F_SETFL, O_NONBLOCK | O_ASYNC) < 0) {
+        unwatch_path_dirs();
+        return;
+    }
+
+    char *path_copy = strdup(path_value);
+    char *save_ptr;
+    for (char *dir = strtok_r(path_copy, ":", &save_ptr); dir != NULL;
+         dir = strtok_r(NULL, ":", &save_ptr)) {
+        if (inotify_add_watch(watch_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                              IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF |
+                              IN_MOVE_SELF | IN_ONLYDIR) < 0) {
+            unwatch_path_dirs();
+            break;
+        }
+    }
+    free(path_copy);
+}
+
+/**
+ * Drop the cached entry of a command, whether it was found or not.
+ *
+ * @param name The name of the command.
+ */
+void remove_named_entry(const char *name) {
+    PathCacheEntry **link = &path_buckets[hash_line(name) % PATH_CACHE_BUCKETS];
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            remove_path_entry(link);
+            return;
+        }
+        link = &(*link)->chain;
+    }
+}
+
+/**
+ * Free every entry of the PATH lookup cache, with its lock held.
+ */
+void remove_path_entries(void) {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        while (path_buckets[i] != NULL) {
+            remove_path_entry(&path_buckets[i]);
+        }
+    }
+    clear_dir_stamps();
+    unwatch_path_dirs();
+    free(cached_path_value);
+    cached_path_value = NULL;
+}
+
+/**
+ * Read the events of the PATH directory watches, if SIGIO said there are
+ * any, and drop the entries of every command a PATH directory gained or
+ * lost. This costs no system call while nothing changes.
+ */
+void drain_path_watches(void) {
+    if (watch_fd < 0 || !watch_events) {
+        return;
+    }
+    watch_events = 0;
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t bytes_read;
+    while ((bytes_read = read(watch_fd, events, sizeof(events))) > 0) {
+        for (char *next = events; next < events + bytes_read;) {
+            struct inotify_event *event = (struct inotify_event *) next;
+            if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                // a directory itself went away, or events were lost
+                char *path_value = cached_path_value;
+                cached_path_value = NULL;
+                remove_path_entries();
+                cached_path_value = path_value;
+                return;
+            }
+            if (event->len > 0) {
+                remove_named_entry(event->name);
+            }
+            next += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/*
+** Looks up where a command was found the last time it was resolved
+** against the same PATH value. The location is checked with stat, so
+** an executable that has been removed is never returned. The PATH cache
+** may be used from several threads.
+**
+** Commands that were not found are remembered too, for PATH_MISS_TTL
+** seconds and as long as no PATH directory's mtime changes.
+**
+** While every PATH directory is watched with inotify, entries are dropped
+** as soon as their directory changes, and hits need no system call.
+**
+** Returns a heap copy of the cached path, (char *) -1 if the command is
+** known not to be on the PATH, or NULL if the cache cannot tell.
+*/
+char *path_cache_lookup(const char *name, const char *path_value) {
+    char *exec_path = NULL;
+    pthread_mutex_lock(&path_cache_lock);
+    drain_path_watches();
+    path_stats.lookups++;
+    if (cached_path_value == NULL || strcmp(cached_path_value, path_value) != 0) {
+        path_stats.misses++;
+        pthread_mutex_unlock(&path_cache_lock);
+        return NULL;
+    }
+
+    PathCacheEntry **link = &path_buckets[hash_line(name) % PATH_CACHE_BUCKETS];
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            struct stat exec_stat;
+            if ((*link)->exec_path == NULL) {
+                if (miss_clock() - (*link)->missed_at >= PATH_MISS_TTL) {
+                    remove_path_entry(link);
+                } else if (watch_fd < 0 && !dir_stamps_valid()) {
+                    remove_missing_entries();
+                } else {
+                    exec_path = (char *) -1;
+                }
+            } else if (watch_fd < 0 && stat((*link)->exec_path, &exec_stat) < 0) {
+                remove_path_entry(link);
+            } else {
+                exec_path = strdup((*link)->exec_path);
+            }
+            break;
+        }
+        link = &(*link)->chain;
+    }
+    if (exec_path == NULL) {
+        path_stats.misses++;
+    } else {
+        path_stats.hits++;
+    }
+    pthread_mutex_unlock(&path_cache_lock);
+    return exec_path;
+}
+
+/*
+** Copies the PATH lookup cache counters into stats. They are read
+** without taking the cache's lock, so this may be called from a signal
+** handler, and a lookup made meanwhile may be missing from them.
+*/
+void path_cache_stats(PathCacheStats *stats) {
+    *stats = path_stats;
+}
+
+/*
+** Remembers where a command was found for a PATH value, or that it was
+** not found if exec_path is NULL. Entries made against any other PATH
+** value are dropped.
+*/
+void path_cache_insert(const char *name, const char *exec_path, const char *path_value) {
+    pthread_mutex_lock(&path_cache_lock);
+    if (cached_path_value == NULL || strcmp(cached_path_value, path_value) != 0) {
+        remove_path_entries();
+        cached_path_value = strdup(path_value);
+        watch_path_dirs(path_value);
+    }
+
+    if (exec_path == NULL && watch_fd < 0 && !dir_stamps_valid()) {
+        // misses recorded against older directory contents are stale
+        remove_missing_entries();
+        if (stamp_path_dirs(path_value) < 0) {
+            pthread_mutex_unlock(&path_cache_lock);
+            return;
+        }
+    }
+
+    PathCacheEntry **link = &path_buckets[hash_line(name) % PATH_CACHE_BUCKETS];
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            free((*link)->exec_path);
+            (*link)->exec_path = exec_path == NULL ? NULL : strdup(exec_path);
+            (*link)->missed_at = miss_clock();
+            pthread_mutex_unlock(&path_cache_lock);
+            return;
+        }
+        link = &(*link)->chain;
+    }
+
+    PathCacheEntry *entry = malloc(sizeof(PathCacheEntry));
+    entry->name = strdup(name);
+    entry->exec_path = exec_path == NULL ? NULL : strdup(exec_path);
+    entry->missed_at = miss_clock();
+    entry->chain = NULL;
+    *link = entry;
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+/*
+** Calls visit on every command found in the PATH lookup cache, if its
+** lookups were made against path_value; on none of them otherwise.
+*/
+void path_cache_foreach(const char *path_value,
+                        void (*visit)(const char *name, const char *exec_path, void *data),
+                        void *data) {
+    pthread_mutex_lock(&path_cache_lock);
+    if (cached_path_value == NULL || strcmp(cached_path_value, path_value) != 0) {
+        pthread_mutex_unlock(&path_cache_lock);
+        return;
+    }
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        for (PathCacheEntry *entry = path_buckets[i]; entry != NULL; entry = entry->chain) {
+            if (entry->exec_path != NULL) {
+                visit(entry->name, entry->exec_path, data);
+            }
+        }
+    }
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+/*
+** Frees every entry of the PATH lookup cache.
+*/
+void clear_path_cache(void) {
+    pthread_mutex_lock(&path_cache_lock);
+    remove_path_entries();
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+/**
+ * Take the PATH lookup cache's lock, right before a fork.
+ */
+void lock_path_cache(void) {
+    pthread_mutex_lock(&path_cache_lock);
+}
+
+/**
+ * Release the PATH lookup cache's lock, right after a fork.
+ */
+void unlock_path_cache(void) {
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+/*
+** Makes the PATH lookup cache usable in a forked child that keeps running
+** the shell, like a ( ) group: its lock is held across fork, so that the
+** thread that compiles ahead, which the child does not get, can never
+** leave it locked there.
+*/
+void init_path_cache(void) {
+    pthread_atfork(lock_path_cache, unlock_path_cache, unlock_path_cache);
+}
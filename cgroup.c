@@ -0,0 +1,275 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <sys/syscall.h>
+#include <linux/sched.h>
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+/*
+** Resources a pipeline used, read from its cgroup once it is done.
+** Counters the kernel does not provide are left at -1.
+*/
+typedef struct CgroupUsage {
+    long long usage_usec;
+    long long user_usec;
+    long long system_usec;
+    long long memory_peak;
+    long long io_rbytes;
+    long long io_wbytes;
+} CgroupUsage;
+
+// Pipelines run in a cgroup so far, to name the next one
+static unsigned long num_line_cgroups = 0;
+
+// Set once the controllers of the parent cgroup have been enabled
+static char enabled_parent[MAX_PATH_STR] = "";
+
+// Cleared once clone3 turns out not to be usable, to stop trying it
+static uint8_t clone3_works = 1;
+
+
+/**
+ * Get the value of a shell variable.
+ *
+ * @param variables The head of the variables list.
+ * @param name The name of the variable.
+ * @return The value, or NULL if it is unset or empty.
+ */
+const char *cgroup_variable(Variable *variables, const char *name) {
+    for (Variable *curr = variables; curr != NULL; curr = curr->next) {
+        if (strcmp(curr->name, name) == 0) {
+            return *curr->value == '\0' ? NULL : curr->value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write a value to a control file of a cgroup.
+ *
+ * @param dir_fd The cgroup directory.
+ * @param file The control file.
+ * @param value The value to write.
+ * @return 0 on success, -1 on error, with errno set.
+ */
+int write_cgroup_file(int dir_fd, const char *file, const char *value) {
+    int fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t written = write(fd, value, strlen(value));
+    int write_errno = errno;
+    close(fd);
+    errno = write_errno;
+    return written < 0 ? -1 : 0;
+}
+
+/**
+ * Read a control file of a cgroup into a buffer, NUL terminated.
+ *
+ * @param dir_fd The cgroup directory.
+ * @param file The control file.
+ * @param buffer The buffer to read into.
+ * @param size The size of the buffer.
+ * @return 0 on success, -1 if the file could not be read.
+ */
+int read_cgroup_file(int dir_fd, const char *file, char *buffer, size_t size) {
+    int fd = openat(dir_fd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t num_read = read(fd, buffer, size - 1);
+    close(fd);
+    if (num_read < 0) {
+        return -1;
+    }
+    buffer[num_read] = '\0';
+    return 0;
+}
+
+/**
+ * Find a "key value" line of a flat-keyed control file like cpu.stat.
+ *
+ * @param contents The contents of the file.
+ * @param key The key to find.
+ * @return The value, or -1 if the key is not there.
+ */
+long long cgroup_stat_value(const char *contents, const char *key) {
+    size_t key_length = strlen(key);
+    for (const char *line = contents; line != NULL && *line != '\0'; ) {
+        if (strncmp(line, key, key_length) == 0 && line[key_length] == ' ') {
+            return strtoll(line + key_length + 1, NULL, 10);
+        }
+        line = strchr(line, '\n');
+        line = line == NULL ? NULL : line + 1;
+    }
+    return -1;
+}
+
+/**
+ * Add up one counter of io.stat over every device, whose lines look like
+ * "8:0 rbytes=1 wbytes=2 rios=3 wios=4 ...".
+ *
+ * @param contents The contents of io.stat.
+ * @param key The counter, with its '=', e.g. "rbytes=".
+ * @return The total, 0 if no device did any IO.
+ */
+long long cgroup_io_total(const char *contents, const char *key) {
+    long long total = 0;
+    for (const char *found = strstr(contents, key); found != NULL; found = strstr(found + 1, key)) {
+        if (found[-1] == ' ') {
+            total += strtoll(found + strlen(key), NULL, 10);
+        }
+    }
+    return total;
+}
+
+/**
+ * Read what a pipeline used from its cgroup.
+ *
+ * @param dir_fd The cgroup directory.
+ * @param usage The usage to fill in.
+ */
+void read_cgroup_usage(int dir_fd, CgroupUsage *usage) {
+    char contents[CGROUP_STAT_SIZE];
+    usage->usage_usec = usage->user_usec = usage->system_usec = -1;
+    usage->memory_peak = usage->io_rbytes = usage->io_wbytes = -1;
+
+    if (read_cgroup_file(dir_fd, "cpu.stat", contents, sizeof(contents)) == 0) {
+        usage->usage_usec = cgroup_stat_value(contents, "usage_usec");
+        usage->user_usec = cgroup_stat_value(contents, "user_usec");
+        usage->system_usec = cgroup_stat_value(contents, "system_usec");
+    }
+    if (read_cgroup_file(dir_fd, "memory.peak", contents, sizeof(contents)) == 0) {
+        usage->memory_peak = strtoll(contents, NULL, 10);
+    }
+    // the first line in contents is the '\n' sentinel, so found[-1] is always valid
+    contents[0] = '\n';
+    if (read_cgroup_file(dir_fd, "io.stat", contents + 1, sizeof(contents) - 1) == 0) {
+        usage->io_rbytes = cgroup_io_total(contents + 1, "rbytes=");
+        usage->io_wbytes = cgroup_io_total(contents + 1, "wbytes=");
+    }
+}
+
+/*
+** Creates a transient cgroup for a pipeline under the delegated cgroup
+** named by PIPELINE_CGROUP, with the limits of PIPELINE_CPU_MAX and
+** PIPELINE_MEMORY_MAX (in cpu.max and memory.max syntax), so that its
+** stages can be spawned straight into it with fork_into_cgroup.
+**
+** Nothing is done if PIPELINE_CGROUP is unset. A limit that cannot be
+** set is reported, and the pipeline runs without it.
+**
+** Returns the cgroup directory fd, with its path in path (MAX_PATH_STR
+** long), or -1 if the pipeline does not get a cgroup.
+*/
+int open_line_cgroup(Variable *variables, char *path) {
+    const char *parent = cgroup_variable(variables, CGROUP_VAR_NAME);
+    if (parent == NULL) {
+        return -1;
+    }
+
+    // the controllers are enabled on the parent once, failing if it is not delegated
+    if (strcmp(enabled_parent, parent) != 0) {
+        int parent_fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (parent_fd < 0) {
+            ERR_PRINT(ERR_CGROUP, parent, strerror(errno));
+            return -1;
+        }
+        write_cgroup_file(parent_fd, "cgroup.subtree_control", CGROUP_CONTROLLERS);
+        close(parent_fd);
+        strncpy(enabled_parent, parent, MAX_PATH_STR - 1);
+    }
+
+    snprintf(path, MAX_PATH_STR, "%s/" CGROUP_NAME_FORMAT, parent, (int) getpid(), num_line_cgroups++);
+    if (mkdir(path, 0755) < 0) {
+        ERR_PRINT(ERR_CGROUP, path, strerror(errno));
+        return -1;
+    }
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        ERR_PRINT(ERR_CGROUP, path, strerror(errno));
+        rmdir(path);
+        return -1;
+    }
+
+    const char *limits[][2] = {
+        {CGROUP_CPU_MAX_VAR_NAME, "cpu.max"},
+        {CGROUP_MEMORY_MAX_VAR_NAME, "memory.max"},
+    };
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        const char *limit = cgroup_variable(variables, limits[i][0]);
+        if (limit != NULL && write_cgroup_file(dir_fd, limits[i][1], limit) < 0) {
+            ERR_PRINT(ERR_CGROUP_LIMIT, limits[i][1], limit, strerror(errno));
+        }
+    }
+    return dir_fd;
+}
+
+/*
+** Appends what a pipeline used to the file named by PIPELINE_CGROUP_LOG,
+** if it is set, then removes the pipeline's cgroup and closes dir_fd.
+** The cgroup is left behind if a stage left processes running in it.
+*/
+void close_line_cgroup(int dir_fd, const char *path, Command *head, int status, Variable *variables) {
+    const char *log_path = cgroup_variable(variables, CGROUP_LOG_VAR_NAME);
+    if (log_path != NULL) {
+        CgroupUsage usage;
+        read_cgroup_usage(dir_fd, &usage);
+
+        FILE *log = fopen(log_path, "a");
+        if (log == NULL) {
+            ERR_PRINT(ERR_CGROUP, log_path, strerror(errno));
+        } else {
+            fprintf(log, "cgroup=%s status=%d usage_usec=%lld user_usec=%lld system_usec=%lld "
+                    "memory_peak=%lld io_rbytes=%lld io_wbytes=%lld line=",
+                    strrchr(path, '/') + 1, status, usage.usage_usec, usage.user_usec,
+                    usage.system_usec, usage.memory_peak, usage.io_rbytes, usage.io_wbytes);
+            for (Command *command = head; command != NULL; command = command->next) {
+                for (int i = 0; command->args[i] != NULL; i++) {
+                    fprintf(log, i == 0 ? "%s" : " %s", command->args[i]);
+                }
+                fprintf(log, command->next != NULL ? " | " : "\n");
+            }
+            fclose(log);
+        }
+    }
+
+    close(dir_fd);
+    rmdir(path);
+}
+
+/*
+** Forks a child straight into a cgroup with clone3(CLONE_INTO_CGROUP),
+** so that no instruction of it runs, and no memory is charged, outside
+** the cgroup. Falls back to a plain fork if the kernel cannot do that,
+** in which case the child simply stays in the shell's cgroup.
+**
+** Returns what fork returns.
+*/
+pid_t fork_into_cgroup(int cgroup_fd) {
+    #ifdef SYS_clone3
+    if (clone3_works) {
+        struct clone_args args;
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = cgroup_fd;
+        pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid >= 0) {
+            return pid;
+        }
+        if (errno != ENOSYS && errno != E2BIG && errno != EINVAL) {
+            return pid;
+        }
+        clone3_works = 0;
+    }
+    #endif
+    return fork();
+}
@@ -0,0 +1,527 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+typedef struct BlockReader {
+    FILE *stream;
+    const char *continuation;
+    Variable *variables;
+    char line[MAX_SINGLE_LINE];
+} BlockReader;
+
+/**
+ * Check whether a line starts with the given keyword as a whole word.
+ *
+ * @param line The trimmed line to check.
+ * @param keyword The keyword to look for.
+ * @return A pointer just past the keyword (and any following spaces),
+ *         or NULL if the line does not start with the keyword.
+ */
+char *starts_with_keyword(const char *line, const char *keyword) {
+    size_t length = strlen(keyword);
+    if (strncmp(line, keyword, length) != 0) {
+        return NULL;
+    }
+    if (line[length] != '\0' && line[length] != ' ' && line[length] != ';') {
+        return NULL;
+    }
+    char *rest = (char *) line + length;
+    trim_whitespace_leading(&rest);
+    return rest;
+}
+
+/**
+ * Strip a trailing "; keyword" from a condition or for word list.
+ *
+ * @param text The text to strip, modified in place.
+ * @param keyword The keyword expected after the ';'.
+ * @return 1 if the keyword was found and stripped, 0 otherwise.
+ */
+int strip_trailing_keyword(char *text, const char *keyword) {
+    char *semicolon = strrchr(text, ';');
+    if (semicolon == NULL) {
+        return 0;
+    }
+    char *rest = semicolon + 1;
+    trim_whitespace_leading(&rest);
+    if (strcmp(rest, keyword) != 0) {
+        return 0;
+    }
+    *semicolon = '\0';
+    trim_whitespace_ending(text);
+    return 1;
+}
+
+/**
+ * Read the next non-empty, non-comment line of a block.
+ *
+ * @param reader The reader to take the line from.
+ * @return The trimmed line (inside the reader's buffer), or NULL on EOF.
+ */
+char *next_block_line(BlockReader *reader) {
+    while (1) {
+        if (reader->continuation != NULL) {
+            printf("%s", reader->continuation);
+            fflush(stdout);
+        }
+        if (fgets(reader->line, MAX_SINGLE_LINE, reader->stream) == NULL) {
+            return NULL;
+        }
+        reader->line[strcspn(reader->line, "\n")] = '\0';
+        record_line(RECORD_CONTINUATION, reader->line, NULL);
+
+        char *line = reader->line;
+        trim_whitespace_leading(&line);
+        trim_whitespace_ending(line);
+        if (*line != '\0' && *line != '#') {
+            return line;
+        }
+    }
+}
+
+/**
+ * Expect a line holding only the given keyword (e.g. a "then" on its own line).
+ *
+ * @param reader The reader to take the line from.
+ * @param keyword The keyword that must follow.
+ * @return 0 if the keyword was found, -1 otherwise.
+ */
+int expect_keyword(BlockReader *reader, const char *keyword) {
+    char *line = next_block_line(reader);
+    if (line == NULL) {
+        ERR_PRINT(ERR_BLOCK_EOF, keyword);
+        return -1;
+    }
+    if (strcmp(line, keyword) != 0) {
+        ERR_PRINT(ERR_BLOCK_SYNTAX, line);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Get the PATH value of a variables list.
+ *
+ * @param variables The head of the linked list of variables.
+ * @return The value of PATH, or "" if the list does not start with it.
+ */
+const char *block_path_value(Variable *variables) {
+    return variables != NULL && strcmp(variables->name, PATH_VAR_NAME) == 0 ? variables->value : "";
+}
+
+/**
+ * Allocate a new block holding the given text, compiled as a command template.
+ *
+ * @param type The type of the new block.
+ * @param text The line, or condition, of the new block.
+ * @param variables Pointer to the head of the linked list of variables.
+ * @return The new block, or (Block *) -1 if the text could not be compiled.
+ */
+Block *new_block(BlockType type, const char *text, Variable *variables) {
+    Block *block = calloc(1, sizeof(Block));
+    block->type = type;
+    block->line = strdup(text);
+    if (type != BLOCK_FOR) {
+        block->template = compile_line(text, variables);
+        if (block->template == (Command *) -1) {
+            block->template = NULL;
+            free_block(block);
+            return (Block *) -1;
+        }
+        block->path_value = strdup(block_path_value(variables));
+    }
+    return block;
+}
+
+Block *compile_statement(const char *line, BlockReader *reader);
+
+/**
+ * Compile lines into a list of blocks until one of the terminating keywords is found.
+ *
+ * @param reader The reader to take the lines from.
+ * @param terminators NULL terminated list of keywords that end the list.
+ * @param end Set to the line (inside the reader's buffer) holding the terminator.
+ * @return The compiled list (NULL if empty), or (Block *) -1 on error.
+ */
+Block *compile_list(BlockReader *reader, const char **terminators, char **end) {
+    Block *head = NULL;
+    Block **tail = &head;
+
+    char *line;
+    while ((line = next_block_line(reader)) != NULL) {
+        for (int i = 0; terminators[i] != NULL; i++) {
+            if (starts_with_keyword(line, terminators[i])) {
+                *end = line;
+                return head;
+            }
+        }
+
+        Block *block = compile_statement(line, reader);
+        if (block == (Block *) -1) {
+            free_block(head);
+            return (Block *) -1;
+        }
+        *tail = block;
+        tail = &block->next;
+    }
+
+    ERR_PRINT(ERR_BLOCK_EOF, terminators[0]);
+    free_block(head);
+    return (Block *) -1;
+}
+
+/**
+ * Compile the remainder of an if statement, once its condition is known.
+ *
+ * elif branches are compiled as a nested if block in the alt branch, which
+ * shares the closing "fi".
+ *
+ * @param condition The condition, possibly followed by "; then".
+ * @param reader The reader to take the lines from.
+ * @return The compiled if block, or (Block *) -1 on error.
+ */
+Block *compile_if(const char *condition, BlockReader *reader) {
+    static const char *body_end[] = {KW_ELIF, KW_ELSE, KW_FI, NULL};
+    static const char *alt_end[] = {KW_FI, NULL};
+
+    char cond_buf[MAX_SINGLE_LINE];
+    strncpy(cond_buf, condition, MAX_SINGLE_LINE - 1);
+    cond_buf[MAX_SINGLE_LINE - 1] = '\0';
+    if (!strip_trailing_keyword(cond_buf, KW_THEN) && expect_keyword(reader, KW_THEN) < 0) {
+        return (Block *) -1;
+    }
+
+    Block *block = new_block(BLOCK_IF, cond_buf, reader->variables);
+    if (block == (Block *) -1) {
+        return block;
+    }
+
+    char *end;
+    block->body = compile_list(reader, body_end, &end);
+    if (block->body == (Block *) -1) {
+        block->body = NULL;
+        free_block(block);
+        return (Block *) -1;
+    }
+
+    char *rest;
+    if ((rest = starts_with_keyword(end, KW_ELIF)) != NULL) {
+        block->alt = compile_if(rest, reader);
+    } else if (starts_with_keyword(end, KW_ELSE) != NULL) {
+        block->alt = compile_list(reader, alt_end, &end);
+    }
+
+    if (block->alt == (Block *) -1) {
+        block->alt = NULL;
+        free_block(block);
+        return (Block *) -1;
+    }
+    return block;
+}
+
+/**
+ * Compile a while or for loop, once its header is known.
+ *
+ * @param type BLOCK_WHILE or BLOCK_FOR.
+ * @param header The loop condition, or "NAME in WORDS", possibly followed by "; do".
+ * @param reader The reader to take the lines from.
+ * @return The compiled loop block, or (Block *) -1 on error.
+ */
+Block *compile_loop(BlockType type, const char *header, BlockReader *reader) {
+    static const char *body_end[] = {KW_DONE, NULL};
+
+    char header_buf[MAX_SINGLE_LINE];
+    strncpy(header_buf, header, MAX_SINGLE_LINE - 1);
+    header_buf[MAX_SINGLE_LINE - 1] = '\0';
+    if (!strip_trailing_keyword(header_buf, KW_DO) && expect_keyword(reader, KW_DO) < 0) {
+        return (Block *) -1;
+    }
+
+    char *loop_var = NULL;
+    char *text = header_buf;
+    if (type == BLOCK_FOR) {
+        char *space_ptr = strchr(header_buf, ' ');
+        char *words = space_ptr == NULL ? NULL : starts_with_keyword(space_ptr + 1, KW_IN);
+        if (words == NULL) {
+            ERR_PRINT(ERR_BLOCK_SYNTAX, header);
+            return (Block *) -1;
+        }
+        *space_ptr = '\0';
+        loop_var = header_buf;
+        text = words;
+    }
+
+    Block *block = new_block(type, text, reader->variables);
+    if (block == (Block *) -1) {
+        return block;
+    }
+    if (loop_var != NULL) {
+        block->loop_var = strdup(loop_var);
+    }
+
+    char *end;
+    block->body = compile_list(reader, body_end, &end);
+    if (block->body == (Block *) -1) {
+        block->body = NULL;
+        free_block(block);
+        return (Block *) -1;
+    }
+    return block;
+}
+
+/**
+ * Compile a single statement: either a plain line or a whole if/while/for block.
+ *
+ * @param line The first (trimmed) line of the statement.
+ * @param reader The reader to take any further lines from.
+ * @return The compiled block, or (Block *) -1 on error.
+ */
+Block *compile_statement(const char *line, BlockReader *reader) {
+    char *rest;
+    if ((rest = starts_with_keyword(line, KW_IF)) != NULL) {
+        return compile_if(rest, reader);
+    }
+    if ((rest = starts_with_keyword(line, KW_WHILE)) != NULL) {
+        return compile_loop(BLOCK_WHILE, rest, reader);
+    }
+    if ((rest = starts_with_keyword(line, KW_FOR)) != NULL) {
+        return compile_loop(BLOCK_FOR, rest, reader);
+    }
+
+    const char *stray[] = {KW_THEN, KW_ELIF, KW_ELSE, KW_FI, KW_DO, KW_DONE, NULL};
+    for (int i = 0; stray[i] != NULL; i++) {
+        if (starts_with_keyword(line, stray[i])) {
+            ERR_PRINT(ERR_BLOCK_SYNTAX, line);
+            return (Block *) -1;
+        }
+    }
+    return new_block(BLOCK_LINE, line, reader->variables);
+}
+
+/*
+** Returns non-zero if the (trimmed) line starts an if, while or for block.
+*/
+int is_block_start(const char *line) {
+    return starts_with_keyword(line, KW_IF) != NULL ||
+           starts_with_keyword(line, KW_WHILE) != NULL ||
+           starts_with_keyword(line, KW_FOR) != NULL;
+}
+
+/*
+** Compiles a whole if/while/for statement starting at line, reading the
+** rest of its lines from stream. If continuation is not NULL, it is printed
+** before every extra line is read (interactive mode).
+**
+** Every nested line is compiled once with compile_line, so running the
+** block again does not lex it again.
+**
+** Returns the compiled block, or (Block *) -1 on a syntax error.
+*/
+Block *compile_block(const char *line, FILE *stream, const char *continuation,
+                     Variable *variables) {
+    BlockReader reader;
+    reader.stream = stream;
+    reader.continuation = continuation;
+    reader.variables = variables;
+
+    char first_line[MAX_SINGLE_LINE];
+    strncpy(first_line, line, MAX_SINGLE_LINE - 1);
+    first_line[MAX_SINGLE_LINE - 1] = '\0';
+    char *start = first_line;
+    trim_whitespace_leading(&start);
+    trim_whitespace_ending(start);
+
+    return compile_statement(start, &reader);
+}
+
+/*
+** Compiles a whole script into a list of blocks, so that it can be run
+** again and again without being read or lexed.
+**
+** Returns the compiled script (NULL if it has no lines), or (Block *) -1 if
+** the file cannot be read or has a syntax error.
+*/
+Block *compile_script(const char *file_path, Variable *variables) {
+    BlockReader reader;
+    reader.stream = fopen(file_path, "r");
+    reader.continuation = NULL;
+    reader.variables = variables;
+    if (reader.stream == NULL) {
+        perror("fopen");
+        return (Block *) -1;
+    }
+
+    Block *head = NULL;
+    Block **tail = &head;
+    char *line;
+    while ((line = next_block_line(&reader)) != NULL) {
+        Block *block = compile_statement(line, &reader);
+        if (block == (Block *) -1) {
+            free_block(head);
+            head = (Block *) -1;
+            break;
+        }
+        *tail = block;
+        tail = &block->next;
+    }
+
+    if (fclose(reader.stream) == EOF) {
+        perror("fclose");
+    }
+    return head;
+}
+
+/**
+ * Run the line of a block once, from its template if it has one.
+ *
+ * @param block The block whose line is run.
+ * @param root Pointer to the head of the linked list of variables.
+ * @return The exit status of the line, or -1 if the shell needs to stop.
+ */
+int run_block_line(Block *block, Variable **root) {
+    // executables were resolved at compile time, so a PATH assignment since makes the template stale
+    if (block->template != NULL && strcmp(block->path_value, block_path_value(*root)) != 0) {
+        free_command(block->template);
+        free(block->path_value);
+        block->template = compile_line(block->line, *root);
+        block->path_value = strdup(block_path_value(*root));
+        if (block->template == (Command *) -1) {
+            block->template = NULL;
+            ERR_PRINT(ERR_PARSING_LINE);
+            return 1;
+        }
+    }
+
+    Command *commands;
+    if (block->template != NULL) {
+        commands = instantiate_command(block->template, *root);
+    } else {
+        // assignments are cheap, and change the variables list, so parse them every time
+        char line[MAX_SINGLE_LINE];
+        strncpy(line, block->line, MAX_SINGLE_LINE - 1);
+        line[MAX_SINGLE_LINE - 1] = '\0';
+        commands = parse_line(line, root);
+    }
+
+    if (commands == (Command *) -1) {
+        ERR_PRINT(ERR_PARSING_LINE);
+        return 1;
+    }
+    if (commands == NULL) return 0;
+
+    int *last_ret_code_pt = execute_line(commands);
+    if (commands != block->template) {
+        free_command(commands);
+    }
+    if (last_ret_code_pt == (int *) -1) {
+        ERR_PRINT(ERR_EXECUTE_LINE);
+        return -1;
+    }
+
+    int status = *last_ret_code_pt;
+    free(last_ret_code_pt);
+    // abnormal terminations are reported as -1 by execute_line
+    return status < 0 ? 1 : status;
+}
+
+/**
+ * Run a for loop: the word list is expanded once, then the body is run
+ * with the loop variable set to each word in turn.
+ *
+ * @param block The for block to run.
+ * @param root Pointer to the head of the linked list of variables.
+ * @return The exit status of the last line run, or -1 if the shell needs to stop.
+ */
+int run_for_block(Block *block, Variable **root) {
+    char *words = replace_variables(block->line, root);
+    if (words == NULL) {
+        ERR_PRINT(ERR_PARSING_LINE);
+        return 1;
+    }
+    int status = 0;
+
+    char *word = words;
+    char *space_ptr;
+    do {
+        space_ptr = strchr(word, ' ');
+        if (space_ptr != NULL) {
+            *space_ptr = '\0';
+        }
+        if (*word != '\0') {
+            add_variable(block->loop_var, word, root);
+            if ((status = run_block(block->body, root)) < 0) {
+                break;
+            }
+        }
+        word = space_ptr + 1;
+    } while (space_ptr != NULL);
+
+    free(words);
+    return status;
+}
+
+/*
+** Runs a list of compiled blocks.
+**
+** Returns the exit status of the last line run (0 if none were run),
+** or -1 if a line could not be executed and the shell needs to stop.
+*/
+int run_block(Block *block, Variable **root) {
+    int status = 0;
+    int condition;
+
+    for (; block != NULL; block = block->next) {
+        switch (block->type) {
+        case BLOCK_LINE:
+            status = run_block_line(block, root);
+            break;
+        case BLOCK_IF:
+            if ((condition = run_block_line(block, root)) < 0) {
+                return -1;
+            }
+            status = run_block(condition == 0 ? block->body : block->alt, root);
+            break;
+        case BLOCK_WHILE:
+            status = 0;
+            while ((condition = run_block_line(block, root)) == 0) {
+                if ((status = run_block(block->body, root)) < 0) {
+                    break;
+                }
+            }
+            if (condition < 0) {
+                return -1;
+            }
+            break;
+        case BLOCK_FOR:
+            status = run_for_block(block, root);
+            break;
+        }
+
+        if (status < 0) {
+            return -1;
+        }
+    }
+    return status;
+}
+
+/*
+** Frees a list of compiled blocks and all their templates.
+*/
+void free_block(Block *block) {
+    while (block != NULL) {
+        Block *next_block = block->next;
+        free(block->line);
+        free(block->loop_var);
+        free(block->path_value);
+        if (block->template != NULL) {
+            free_command(block->template);
+        }
+        free_block(block->body);
+        free_block(block->alt);
+        free(block);
+        block = next_block;
+    }
+}
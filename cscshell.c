@@ -12,6 +12,18 @@ void print_help(){
     printf("Options:\n");
     printf("  -h, --help\t\t\tDisplay this help message\n");
     printf("  -i, --init-file=FILE\t\tUse a specific init file. Default is ~/.cscshell_init\n");
+    printf("  --daemon[=SOCKET]\t\tRun the init file once, then serve scripts over SOCKET\n");
+    printf("  --connect[=SOCKET]\t\tRun SCRIPT-FILE through a daemon listening on SOCKET\n");
+    printf("  --snapshot[=FILE]\t\tStart from a snapshot of the init file, saving one if needed.\n");
+    printf("\t\t\t\tDefault is the init file path with .snap appended\n");
+    printf("  --stats=FILE\t\t\tWrite the runtime counters to FILE as JSON on exit\n");
+    printf("  --record=FILE\t\t\tRecord every line run after the init file to FILE\n");
+    printf("  --replay=FILE\t\t\tRun the lines recorded in FILE as fast as possible\n");
+    printf("  --replay-paced=FILE\t\tRun the lines recorded in FILE at their recorded times\n");
+    printf("  --profile[=FILE]\t\tSample the shell's own stacks into FILE, as folded stacks.\n");
+    printf("\t\t\t\tDefault is " DEFAULT_PROFILE "\n", (int) getpid());
+    printf("SOCKET defaults to $" RUNTIME_DIR_VAR "/" SOCKET_NAME ", or "
+           SOCKET_FALLBACK_DIR "/" SOCKET_NAME " without it\n", (int) getuid());
     printf("If no script file is given, cscshell will run in interactive mode\n");
 }
 
@@ -45,8 +57,25 @@ int run_interactive(Variable **root){
     while ((error = (long) prompt(line, MAX_SINGLE_LINE)) > 0) {
         // kill the newline
         line[strlen(line) - 1] = '\0';
+        record_line(RECORD_LINE, line, *root);
 
-        Command *commands = parse_line(line, root);
+        char *start = line;
+        trim_whitespace_leading(&start);
+        if (is_block_start(start)) {
+            Block *block = compile_block(start, stdin, CONTINUATION_STR, *root);
+            if (block == (Block *) -1) {
+                ERR_PRINT(ERR_PARSING_LINE);
+                continue;
+            }
+            int status = run_block(block, root);
+            free_block(block);
+            if (status < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        Command *commands = parse_line_cached(line, root);
         if (commands == (Command *) -1){
             ERR_PRINT(ERR_PARSING_LINE);
             continue;
@@ -76,6 +105,18 @@ int main(int argc, char *argv[]){
 
     int num_args_parsed = 0;
     char *init_file = DEFAULT_INIT;
+    uint8_t daemon_mode = 0;
+    uint8_t connect_mode = 0;
+    char default_socket[MAX_PATH_STR];
+    char *socket_path = NULL;
+    uint8_t snapshot_mode = 0;
+    char *snapshot_path = NULL;
+    char *stats_path = NULL;
+    char *record_path = NULL;
+    char *replay_path = NULL;
+    uint8_t replay_paced = 0;
+    char default_profile[MAX_PATH_STR];
+    char *profile_path = NULL;
 
     for (int i=1; i < argc; i++){
         if (strcmp(argv[i], "-h") == 0 ||
@@ -96,21 +137,115 @@ int main(int argc, char *argv[]){
             }
         }
 
-        else if (strncmp(argv[1], LONG_INIT_ARG,
+        else if (strncmp(argv[i], LONG_INIT_ARG,
                          strlen(LONG_INIT_ARG)) == 0){
             num_args_parsed++;
-            init_file = strchr(argv[1], '=') + 1;
+            init_file = strchr(argv[i], '=') + 1;
+        }
+
+        else if (strncmp(argv[i], LONG_DAEMON_ARG,
+                         strlen(LONG_DAEMON_ARG)) == 0 ||
+                 strncmp(argv[i], LONG_CONNECT_ARG,
+                         strlen(LONG_CONNECT_ARG)) == 0){
+            num_args_parsed++;
+            if (argv[i][2] == 'd') daemon_mode = 1;
+            else connect_mode = 1;
+            if (strchr(argv[i], '=') != NULL){
+                socket_path = strchr(argv[i], '=') + 1;
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_SNAPSHOT_ARG,
+                         strlen(LONG_SNAPSHOT_ARG)) == 0){
+            num_args_parsed++;
+            snapshot_mode = 1;
+            if (strchr(argv[i], '=') != NULL){
+                snapshot_path = strchr(argv[i], '=') + 1;
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_STATS_ARG,
+                         strlen(LONG_STATS_ARG)) == 0){
+            num_args_parsed++;
+            stats_path = argv[i] + strlen(LONG_STATS_ARG);
+        }
+
+        else if (strncmp(argv[i], LONG_RECORD_ARG,
+                         strlen(LONG_RECORD_ARG)) == 0){
+            num_args_parsed++;
+            record_path = argv[i] + strlen(LONG_RECORD_ARG);
+        }
+
+        else if (strncmp(argv[i], LONG_REPLAY_ARG,
+                         strlen(LONG_REPLAY_ARG)) == 0 ||
+                 strncmp(argv[i], LONG_REPLAY_PACED_ARG,
+                         strlen(LONG_REPLAY_PACED_ARG)) == 0){
+            num_args_parsed++;
+            replay_paced = strncmp(argv[i], LONG_REPLAY_PACED_ARG,
+                                   strlen(LONG_REPLAY_PACED_ARG)) == 0;
+            replay_path = strchr(argv[i], '=') + 1;
+        }
+
+        else if (strncmp(argv[i], LONG_PROFILE_ARG,
+                         strlen(LONG_PROFILE_ARG)) == 0){
+            num_args_parsed++;
+            snprintf(default_profile, MAX_PATH_STR, DEFAULT_PROFILE, (int) getpid());
+            profile_path = default_profile;
+            if (strchr(argv[i], '=') != NULL){
+                profile_path = strchr(argv[i], '=') + 1;
+            }
         }
     }
 
+    if ((daemon_mode || connect_mode) && socket_path == NULL){
+        if (default_socket_path(default_socket) < 0){
+            return -1;
+        }
+        socket_path = default_socket;
+    }
+
+    // the daemon already ran the init file, so the client never does
+    if (connect_mode){
+        if (num_args_parsed >= argc-1){
+            fprintf(stderr, ERR_CONNECT_SCRIPT);
+            return -1;
+        }
+        return run_client(socket_path, argv[argc-1]);
+    }
+
+    init_lexer();
+    init_stats();
+    init_path_cache();
+    if (profile_path != NULL && start_profile(profile_path) < 0){
+        return -1;
+    }
+
     #ifdef DEBUG
     printf("Using init file at: %s\n", init_file);
+    printf("Using %s lexer\n", lexer_name());
     #endif
 
+    char default_snapshot[MAX_PATH_STR];
+    if (snapshot_mode && snapshot_path == NULL){
+        snprintf(default_snapshot, MAX_PATH_STR, "%s" SNAPSHOT_SUFFIX, init_file);
+        snapshot_path = default_snapshot;
+    }
+
     Variable *start_of_vars = NULL;
-    if (run_script(init_file, &start_of_vars) < 0){
-        ERR_PRINT(ERR_INIT_SCRIPT, init_file);
-        return -1;
+    set_builtin_variables(&start_of_vars);
+    if (snapshot_mode &&
+        load_snapshot(snapshot_path, init_file, &start_of_vars) == 0){
+        // same output as having run the init file
+        printf("\n");
+    }
+    else{
+        if (run_script(init_file, &start_of_vars) < 0){
+            ERR_PRINT(ERR_INIT_SCRIPT, init_file);
+            return -1;
+        }
+        if (snapshot_mode){
+            save_snapshot(snapshot_path, init_file, start_of_vars);
+        }
     }
 
     if ((start_of_vars == NULL) ||
@@ -118,14 +253,39 @@ int main(int argc, char *argv[]){
         ERR_PRINT(ERR_PATH_INIT, init_file);
     }
 
+    // the init file is not recorded, a replay runs it again itself
+    if (record_path != NULL &&
+        start_recording(record_path, start_of_vars) < 0){
+        return -1;
+    }
+
     int ret_code;
-    if (num_args_parsed < argc-1){
+    if (daemon_mode){
+        ret_code = run_daemon(socket_path, &start_of_vars);
+    }
+    else if (replay_path != NULL){
+        ret_code = run_replay(replay_path, replay_paced, &start_of_vars);
+    }
+    else if (num_args_parsed < argc-1){
         ret_code = run_script(argv[argc-1], &start_of_vars);
     }
     else{
         ret_code = run_interactive(&start_of_vars);
     }
 
+    stop_recording(start_of_vars);
+
+    // the lookups of this run make the next start faster still
+    if (snapshot_mode){
+        update_snapshot_paths(snapshot_path);
+    }
+    if (stats_path != NULL){
+        write_stats_json(stats_path);
+    }
+    stop_profile();
+
+    clear_parse_cache();
+    clear_path_cache();
     free_variable(start_of_vars, NON_ZERO_BYTE);
     return ret_code;
 }
@@ -9,6 +9,10 @@
 #ifndef CSCSHELL_H
 #define CSCSHELL_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,11 +32,83 @@
 #define LONG_HELP_ARG "--help"
 #define LONG_INIT_ARG "--init-file="
 #define DEFAULT_INIT "~/.cscshell_init"
+#define LONG_DAEMON_ARG "--daemon"
+#define LONG_CONNECT_ARG "--connect"
+#define SOCKET_NAME "cscshell.sock"
+#define RUNTIME_DIR_VAR "XDG_RUNTIME_DIR"
+#define SOCKET_FALLBACK_DIR "/tmp/cscshell-%d"
+#define LONG_SNAPSHOT_ARG "--snapshot"
+#define LONG_STATS_ARG "--stats="
+#define LONG_RECORD_ARG "--record="
+#define LONG_REPLAY_ARG "--replay="
+#define LONG_REPLAY_PACED_ARG "--replay-paced="
+#define LONG_PROFILE_ARG "--profile"
+#define DEFAULT_PROFILE "cscshell-%d.folded"
+#define SNAPSHOT_SUFFIX ".snap"
+#define SNAPSHOT_MAGIC "CSCSNAP2"
+
+// Session records, see record.c
+#define RECORD_MAGIC "# cscshell record 1"
+#define RECORD_LINE 'L'
+#define RECORD_CONTINUATION 'C'
+#define RECORD_VARIABLE 'V'
 
 // Buffer sizes
 #define MAX_USER_BUF 128
 #define MAX_PATH_STR 4096
 #define MAX_SINGLE_LINE 4096
+#define READ_BUFFER_SIZE 65536
+
+// Batch config; BATCH_MAX_ARG_LENGTH is Linux's MAX_ARG_STRLEN, and the
+// headroom is what xargs keeps
+#define BATCH_DEFAULT_ARG_MAX 131072
+#define BATCH_ARG_HEADROOM 2048
+#define BATCH_MAX_ARG_LENGTH (32 * 4096)
+
+// Pipeline affinity config
+#define AFFINITY_MAX_CPUS 1024
+#define CPU_SYSFS_DIR "/sys/devices/system/cpu"
+
+// Pipeline cgroup config; every pipeline gets line-<shell pid>-<n>
+#define CGROUP_NAME_FORMAT "line-%d-%lu"
+#define CGROUP_CONTROLLERS "+cpu +memory +io"
+#define CGROUP_STAT_SIZE 4096
+
+// Shell fd config; as in sh, fds 0-9 are left to redirections and exec,
+// and the files the shell itself keeps open are moved at or above this
+#define SHELL_FD_MIN 10
+
+// Fan-out config; pipes are grown to the default pipe-max-size, which
+// cuts the number of tee calls per byte, and the size is a hint only
+#define FANOUT_PIPE_SIZE (1024 * 1024)
+
+// Stats config; latencies are binned in quarter powers of two
+#define LATENCY_BUCKETS 256
+#define STATS_NUM_VALUES 11
+#define STATS_BUFFER_SIZE 1024
+
+// Profiler config; the skipped frames are the SIGPROF handler and the
+// signal trampoline
+#define PROFILE_INTERVAL_USEC 1000
+#define PROFILE_MAX_SAMPLES 65536
+#define PROFILE_MAX_DEPTH 48
+#define PROFILE_SKIPPED_FRAMES 2
+
+// Lexer config; everything but SPECIAL_CHARS is a plain word character
+#define SPECIAL_CHARS "$|<>#={};& \t\r\n"
+#define LINE_MASK_INLINE_WORDS (MAX_SINGLE_LINE / 64)
+
+// Parse cache config
+#define PARSE_CACHE_SIZE 64
+#define PARSE_CACHE_BUCKETS 128
+#define PATH_CACHE_BUCKETS 256
+#define PATH_MISS_TTL 10
+#define PARSE_AHEAD_SIZE 16
+
+// Daemon config
+#define DAEMON_BACKLOG 64
+#define DAEMON_SCRIPT_CACHE 32
+#define DAEMON_RECV_TIMEOUT_MS 1000
 
 // Prompt config
 #define PROMPT_STR "<:"
@@ -40,13 +116,60 @@
 // other strings and values
 #define PATH_VAR_NAME "PATH"
 #define CD "cd"
+#define PARSECACHE "parsecache"
+#define READ "read"
+#define BATCH "batch"
+#define STATS "stats"
+#define EXEC "exec"
+#define FD_CLOSE -2
+#define AFFINITY_VAR_NAME "PIPELINE_AFFINITY"
+#define AFFINITY_NONE_STR "none"
+#define AFFINITY_COMPACT_STR "compact"
+#define AFFINITY_SPREAD_STR "spread"
+#define CGROUP_VAR_NAME "PIPELINE_CGROUP"
+#define CGROUP_CPU_MAX_VAR_NAME "PIPELINE_CPU_MAX"
+#define CGROUP_MEMORY_MAX_VAR_NAME "PIPELINE_MEMORY_MAX"
+#define CGROUP_LOG_VAR_NAME "PIPELINE_CGROUP_LOG"
+#define READ_DEFAULT_VAR "REPLY"
+#define IFS_VAR_NAME "IFS"
+#define DEFAULT_IFS " \t\n"
 #define VARIABLE_PARSE_MARKER '$'
+#define ARITH_START "$(("
+#define FANOUT_OPERATOR "|&"
+#define FANOUT_START '{'
+#define FANOUT_END '}'
+#define FANOUT_SEPARATOR ","
+#define GROUP_START '{'
+#define GROUP_END '}'
+#define SUBSHELL_START '('
+#define SUBSHELL_END ')'
 #define PARSING_START_MARKER '<'
 #define PARSING_END_MARKER '>'
 #define NON_ZERO_BYTE 0x42
 
+// Exit statuses and results of starting commands
+#define EXIT_CANNOT_EXEC 126
+#define EXIT_NOT_FOUND 127
+#define EXEC_FAILED -2
+#define BATCH_FAILED 123
+#define BATCH_KILLED 125
+
+// Control flow keywords
+#define KW_IF "if"
+#define KW_THEN "then"
+#define KW_ELIF "elif"
+#define KW_ELSE "else"
+#define KW_FI "fi"
+#define KW_WHILE "while"
+#define KW_FOR "for"
+#define KW_IN "in"
+#define KW_DO "do"
+#define KW_DONE "done"
+#define CONTINUATION_STR "> "
+
 // Error Strings
 #define ERR_ARGS_MISSING "Missing init file path after argument: '-i'\n"
+#define ERR_CONNECT_SCRIPT "Missing script file for argument: '--connect'\n"
 #define ERR_PATH_INIT "PATH not defined in init file %s, or not at the head \
 of the variable list."
 #define ERR_PARSING_LINE "Could not parse line into commands.\n"
@@ -60,12 +183,44 @@ of the variable list."
 #define ERR_NO_EXECU "Could not resolve executable [%s]\n"
 #define ERR_VAR_USAGE "Variable could not be parsed from %s\n"
 #define ERR_VAR_NOT_FOUND "Could not find variable: <%s>\n"
+#define ERR_ARITH "Bad arithmetic expression: %s\n"
+#define ERR_ARITH_ZERO "Division by zero in: %s\n"
+#define ERR_ARITH_VALUE "Variable %s is not a number: %s\n"
+#define ERR_BAD_SUBST "Bad substitution: ${%.*s}\n"
+#define ERR_SUBST_EOF "Missing '}' after: %.*s\n"
+#define ERR_REDIR "Could not open %s: %s\n"
+#define ERR_EXEC_FAILED "Could not execute %s: %s\n"
+#define ERR_FD_REDIR "Bad redirection: %s\n"
+#define ERR_BAD_FD "Bad file descriptor %d: %s\n"
+#define ERR_SOCKET_PATH "Socket path too long: %s\n"
+#define ERR_DAEMON_REQUEST "Malformed request for the daemon.\n"
+#define ERR_DAEMON_LOST "Lost connection to the daemon.\n"
+#define ERR_SOCKET_DIR "Not using %s for the socket, it is not a private directory of this user.\n"
+#define ERR_SOCKET_OWNER "Not replacing %s, it is not a socket of this user.\n"
+#define ERR_PEER_UID "Refusing a connection from uid %d.\n"
+#define ERR_DAEMON_UID "The daemon on %s runs as uid %d, not this user.\n"
+#define ERR_SNAPSHOT_COMMANDS "Not saving a snapshot of %s, it runs commands.\n"
+#define ERR_BLOCK_SYNTAX "Syntax error near: %s\n"
+#define ERR_BLOCK_EOF "Unexpected end of input, expected '%s'\n"
+#define ERR_LIST_SYNTAX "Syntax error near unexpected '%s'\n"
+#define ERR_FANOUT_SYNTAX "Bad fan-out, expected 'COMMAND |& { COMMAND, COMMAND... }': %s\n"
+#define ERR_GROUP_SYNTAX "Bad group, expected '{ LIST; } [REDIRECTIONS]' or '( LIST ) [REDIRECTIONS]': %s\n"
+#define ERR_AFFINITY "Bad " AFFINITY_VAR_NAME ", expected none, compact, spread or a cpu list: %s\n"
+#define ERR_CGROUP "Cannot use cgroup %s: %s\n"
+#define ERR_CGROUP_LIMIT "Cannot set %s to %s: %s\n"
+#define ERR_STATS "Cannot write stats to %s: %s\n"
+#define ERR_PROFILE "Cannot write profile to %s: %s\n"
+#define ERR_RECORD "Cannot record to %s: %s\n"
+#define ERR_REPLAY "Cannot replay %s: %s\n"
+#define ERR_REPLAY_FORMAT "Not a session record: %s\n"
+#define ERR_BATCH_USAGE "Usage: batch [-P N] [-k] [-n MAX] [-a FILE] COMMAND [ARG...] [-- ITEM...]\n"
+#define ERR_BATCH_TOO_LONG "Argument too long to pass to a command: %.64s...\n"
 
 #define ERR_PRINT(...) fprintf(stderr, "ERROR: ");\
     fprintf(stderr, __VA_ARGS__);
 
 /*
-** Two structures for maintaining a singly-linked list of:
+** Three structures for maintaining a singly-linked list of:
 **
 ** 1. Shell Variables; including PATH, which is the
 **    first item of main variable list. Consider using
@@ -73,7 +228,15 @@ of the variable list."
 **    in a shell command as well.
 ** 2. Commands to execute; A single line may have only a
 **    single command, or may consist of multiple commands
-**    connected by pipes.
+**    connected by pipes. A late_bound command is a template
+**    whose args still hold variable usages. The pipelines of a
+**    `;`, `&&` or `||` list are chained by next_pipeline, and so
+**    are the consumer pipelines of a `|& { ... }` fan-out. A
+**    `{ ...; }` or `( ... )` group is a single command whose
+**    group is the list it runs, with the group's redirections.
+** 3. Blocks of a compiled script; either a single line or an
+**    if/while/for statement, with its nested blocks compiled
+**    once and run as many times as needed.
 */
 typedef struct Variable{
     char *name;
@@ -81,6 +244,21 @@ typedef struct Variable{
     struct Variable *next;
 } Variable;
 
+/*
+** A numbered redirection of a command, "N<path", "N>path", "N>>path",
+** "N>&M" or "N>&-", with N and M single digits. Its path is opened by the
+** shell into opened_fd, like the stdin and stdout ones; source_fd is M,
+** or FD_CLOSE to close N.
+*/
+typedef struct FdRedirection {
+    int32_t fd;
+    int32_t source_fd;      // -1 if path is opened instead
+    char *path;
+    int32_t flags;          // how path is opened
+    int32_t opened_fd;      // -1 until open_redirections opens path
+    struct FdRedirection *next;
+} FdRedirection;
+
 typedef struct Command {
     char *exec_path;
     char **args;
@@ -90,8 +268,114 @@ typedef struct Command {
     char *redir_in_path;
     char *redir_out_path;
     uint8_t redir_append;
+    uint8_t late_bound;
+    int32_t cpu;            // pinned to by run_command, -1 for none
+    int32_t cgroup_fd;      // spawned into by run_command, -1 for none
+    struct Command *next_pipeline;  // first stage only, the next pipeline of its list
+    uint8_t list_op;        // first stage only, how next_pipeline runs, see ListOperator
+    uint8_t deferred;       // a list element parsed when it is reached, args[0] is its text
+    struct Command *fanout; // last stage only, the consumers its output is copied to
+    struct Command *group;  // the list a { } or ( ) group runs, NULL for a plain command
+    uint8_t subshell;       // a ( ) group, run in a child of its own
+    FdRedirection *fd_redirections; // applied in order, after stdin and stdout
+    char *path_value;       // first pipeline of a list only, the PATH it was built against
 } Command;
 
+/*
+** How the next pipeline of a command list runs after one is done:
+** always (;), only if it succeeded (&&) or only if it failed (||).
+** Lines that are a single pipeline are LIST_END.
+*/
+typedef enum ListOperator {
+    LIST_END,
+    LIST_SEQ,
+    LIST_AND,
+    LIST_OR
+} ListOperator;
+
+/*
+** The policies of PIPELINE_AFFINITY, see place_pipeline.
+*/
+typedef enum AffinityPolicy {
+    AFFINITY_NONE,
+    AFFINITY_COMPACT,
+    AFFINITY_SPREAD,
+    AFFINITY_LIST
+} AffinityPolicy;
+
+typedef enum BlockType {
+    BLOCK_LINE,
+    BLOCK_IF,
+    BLOCK_WHILE,
+    BLOCK_FOR
+} BlockType;
+
+typedef struct Block {
+    BlockType type;
+    char *line;             // the line, the condition, or the for word list
+    Command *template;      // NULL if line must be parsed every time
+    char *path_value;       // the PATH value template was compiled against
+    char *loop_var;         // BLOCK_FOR only
+    struct Block *body;
+    struct Block *alt;      // BLOCK_IF only; else branch (or elif chain)
+    struct Block *next;
+} Block;
+
+
+/*
+** Builtins run inside the shell process instead of being forked.
+*/
+typedef int (*BuiltinFunction)(char **args, Variable **root);
+
+typedef struct Builtin {
+    const char *name;
+    BuiltinFunction function;
+} Builtin;
+
+/*
+** Everything the parser needs besides the line itself; the parser keeps
+** no state of its own, so threads can parse at the same time as long as
+** each has its own context. The hooks are optional (NULL in libcscparse):
+** is_builtin names commands that need no executable, path_lookup and
+** path_insert cache PATH lookups, as path_cache_lookup and
+** path_cache_insert do for the shell.
+*/
+typedef struct ParserContext {
+    Variable *variables;    // PATH first
+    uint64_t generation;    // bumped by every assignment
+    int (*is_builtin)(const char *name);
+    char *(*path_lookup)(const char *name, const char *path_value);
+    void (*path_insert)(const char *name, const char *exec_path, const char *path_value);
+} ParserContext;
+
+/*
+** Bitmask of the special characters of a line, see classify_line.
+*/
+typedef struct LineMask {
+    const char *line;
+    size_t length;
+    size_t words;
+    uint64_t *bits;
+    uint64_t inline_bits[LINE_MASK_INLINE_WORDS];
+} LineMask;
+
+/*
+** Lines of a script read and compiled ahead on another thread, see ahead.c.
+*/
+typedef struct ParseAhead ParseAhead;
+
+typedef struct ParseCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint32_t entries;
+} ParseCacheStats;
+
+typedef struct PathCacheStats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t misses;
+} PathCacheStats;
+
 
 /*
 ** The following functions are provided for you in _shell.c
@@ -118,9 +402,514 @@ typedef struct Command {
 **       -- or updated if the variable already exists
 **
 ** 3. If there is an error, returns -1 cast as a (Command *)
+**
+** A line of several pipelines separated by `;`, `&&` or `||` is parsed
+** once into a command list chained by next_pipeline. Its pipelines are
+** templates, and the ones that assign, or must be expanded before they
+** are split, are deferred: they are parsed by execute_line when reached.
+** A `{ LIST; }` or `( LIST )` group, followed by nothing but redirections,
+** is parsed the same way into the group of a single command.
 */
 Command *parse_line(char *line, Variable **variables);
 
+/*
+** Compiles a single line into a reusable Command template.
+**
+** Unlike parse_line, variable usages are *not* replaced: the stages that
+** hold them, or whose executable cannot be found yet, are marked late_bound
+** and are filled in by instantiate_command.
+** Assignments are not compiled, since they have no commands, and neither
+** are lines with $((...)) or ${...} operators, which must be expanded
+** before they are split.
+**
+** Returns NULL for empty lines, comments, assignments and expansions, (Command *) -1
+** on error, otherwise the first command of the template.
+*/
+Command *compile_line(const char *line, Variable *variables);
+
+/*
+** Creates a runnable list of commands from a template built by compile_line.
+**
+** Only late_bound stages are touched: their variable usages are replaced with
+** the current values and their executable is resolved if its name was a
+** variable. If no stage is late_bound, the template itself is returned and
+** must not be freed by the caller.
+**
+** Returns (Command *) -1 if an executable could not be resolved.
+*/
+Command *instantiate_command(Command *template, Variable *variables);
+
+/*
+** Leaves every stage of a template unresolved, for instantiate_command to
+** resolve again: the template was built before a PATH assignment.
+*/
+void unbind_command(Command *template);
+
+/*
+** The reentrant parser, which is also built as libcscparse. The functions
+** above are the same calls made against the shell's own context, with its
+** builtins and PATH cache.
+**
+** init_parser_context sets up a context with no hooks. parse_line_r does
+** not modify its line, and adds assignments to the context's variables.
+*/
+void init_parser_context(ParserContext *context, Variable *variables);
+Command *parse_line_r(ParserContext *context, const char *line);
+Command *compile_line_r(const ParserContext *context, const char *line);
+Command *instantiate_command_r(const ParserContext *context, Command *template);
+void add_variable_r(ParserContext *context, const char *name, const char *value);
+
+/*
+** Picks the fastest classifier the CPU supports: AVX2, then SSE2, then
+** a scalar lookup table. Only the first call does anything, even when
+** made from several threads at once; classify_line calls it itself.
+*/
+void init_lexer(void);
+
+/*
+** Returns the name of the classifier picked by init_lexer.
+*/
+const char *lexer_name(void);
+
+/*
+** Builds the bitmask of special characters (SPECIAL_CHARS) of a whole
+** line in a single pass: bit i of the mask is set if line[i] is special.
+** Lines up to MAX_SINGLE_LINE bytes use the mask's own storage, longer
+** ones allocate; free_line_mask releases it.
+*/
+void classify_line(const char *line, size_t length, LineMask *mask);
+
+/*
+** Frees anything classify_line or init_line_mask allocated for mask.
+*/
+void free_line_mask(LineMask *mask);
+
+/*
+** Builds an empty mask for a line of a given length, with every bit
+** clear, for line_mask_copy to fill in.
+*/
+void init_line_mask(const char *line, size_t length, LineMask *mask);
+
+/*
+** Copies the bits of count characters of one mask into another, for a
+** line made of pieces of classified lines: from in src goes to to in dst.
+** The bits at to in dst must still be clear.
+*/
+void line_mask_copy(LineMask *dst, size_t to, const LineMask *src, size_t from, size_t count);
+
+/*
+** Builds the mask of a copy of part of a classified line from the mask of
+** the line, without classifying the copy again.
+*/
+void line_mask_slice(const LineMask *mask, size_t from, size_t length, const char *line, LineMask *slice);
+
+/*
+** Removes count characters at from from a mask, for when the same ones
+** are cut out of its line: the bits after them move down.
+*/
+void line_mask_erase(LineMask *mask, size_t from, size_t count);
+
+/*
+** Returns the index of the first character at or after from that is not
+** c, or mask->length if there is none. c must be one of SPECIAL_CHARS.
+*/
+size_t line_mask_skip(const LineMask *mask, size_t from, char c);
+
+/*
+** Returns the index just past the last character before end that is not
+** c, or 0 if there is none. c must be one of SPECIAL_CHARS.
+*/
+size_t line_mask_skip_back(const LineMask *mask, size_t end, char c);
+
+/*
+** Returns the index of the first c at or after from, looking only at
+** the special characters of the mask, or mask->length if there is none.
+** c must be one of SPECIAL_CHARS.
+*/
+size_t line_mask_find(const LineMask *mask, size_t from, char c);
+
+/*
+** Returns the index of the first special character at or after from,
+** or mask->length if there is none.
+*/
+size_t line_mask_next(const LineMask *mask, size_t from);
+
+/*
+** Returns the number of times c appears in the line of the mask.
+** c must be one of SPECIAL_CHARS.
+*/
+size_t line_mask_count(const LineMask *mask, char c);
+
+/*
+** Returns the generation of the variables list, which changes every time
+** a variable is added or updated.
+*/
+uint64_t variable_generation(void);
+
+/*
+** Parses a line through the parse cache.
+**
+** Lines that produce commands are cached by their raw text and the
+** generation of the variables list, so running the same line again
+** skips parsing and PATH resolution entirely as long as no variable
+** changed in between. The least recently used entry is evicted once
+** PARSE_CACHE_SIZE lines are cached.
+**
+** Return values are those of parse_line, but the returned commands are
+** owned by the cache and must not be freed by the caller. They are only
+** valid until the next call.
+*/
+Command *parse_line_cached(char *line, Variable **variables);
+
+/*
+** Copies the parse cache counters into stats.
+*/
+void parse_cache_stats(ParseCacheStats *stats);
+
+/*
+** Frees every entry of the parse cache.
+*/
+void clear_parse_cache(void);
+
+/*
+** Starts reading and compiling the lines of stream ahead of the shell,
+** on a thread of its own, with PARSE_AHEAD_SIZE lines of look-ahead.
+** With a single CPU, or if the thread cannot be started, lines are
+** simply read as they are asked for.
+*/
+ParseAhead *start_parse_ahead(FILE *stream, Variable *variables);
+
+/*
+** Takes the next line of the script, in order, copying it into line.
+**
+** *template is set to the commands compiled for the line, or NULL if
+** the line must be parsed as usual. A template is only handed out if it
+** was compiled against the current PATH, and is owned by the caller.
+** If the line starts a control flow block, the caller may read the
+** rest of the block from the stream until it asks for the next line.
+**
+** Returns 1 if a line was taken, 0 at EOF.
+*/
+int next_parsed_line(ParseAhead *ahead, char *line, Command **template, Variable *variables);
+
+/*
+** Stops the reader thread and frees everything it read that was not
+** taken. The stream is left open.
+*/
+void stop_parse_ahead(ParseAhead *ahead);
+
+/*
+** Looks up where a command was found the last time it was resolved
+** against the same PATH value. The location is checked with stat, so
+** an executable that has been removed is never returned. The PATH cache
+** may be used from several threads.
+**
+** Commands that were not found are remembered too, for PATH_MISS_TTL
+** seconds and as long as no PATH directory's mtime changes.
+**
+** While every PATH directory is watched with inotify, entries are dropped
+** as soon as their directory changes, and hits need no system call.
+**
+** Returns a heap copy of the cached path, (char *) -1 if the command is
+** known not to be on the PATH, or NULL if the cache cannot tell.
+*/
+char *path_cache_lookup(const char *name, const char *path_value);
+
+/*
+** Remembers where a command was found for a PATH value, or that it was
+** not found if exec_path is NULL. Entries made against any other PATH
+** value are dropped.
+*/
+void path_cache_insert(const char *name, const char *exec_path, const char *path_value);
+
+/*
+** Calls visit on every command found in the PATH lookup cache, if its
+** lookups were made against path_value; on none of them otherwise.
+*/
+void path_cache_foreach(const char *path_value,
+                        void (*visit)(const char *name, const char *exec_path, void *data),
+                        void *data);
+
+/*
+** Copies the PATH lookup cache counters into stats. They are read
+** without taking the cache's lock, so this may be called from a signal
+** handler, and a lookup made meanwhile may be missing from them.
+*/
+void path_cache_stats(PathCacheStats *stats);
+
+/*
+** Frees every entry of the PATH lookup cache.
+*/
+void clear_path_cache(void);
+
+/*
+** Makes the PATH lookup cache usable in a forked child that keeps running
+** the shell, like a ( ) group: its lock is held across fork, so that the
+** thread that compiles ahead, which the child does not get, can never
+** leave it locked there.
+*/
+void init_path_cache(void);
+
+/*
+** Loads the variables and PATH lookups saved by save_snapshot into root,
+** instead of running the init file. The snapshot is mmap'd and only used
+** if it was made from this exact init file, so its size, mtime and inode
+** must match; if the init file changed in the second the snapshot was
+** made, its content hash is checked as well.
+**
+** Returns 0 if the snapshot was loaded, -1 if it is missing or stale.
+*/
+int load_snapshot(const char *snapshot_path, const char *init_file, Variable **root);
+
+/*
+** Saves the variables in root, and the PATH lookups made so far, as a
+** snapshot of init_file for load_snapshot. Init files that run commands
+** are not snapshotted, since skipping them would skip those commands.
+**
+** Returns 0 on success, -1 if no snapshot was written.
+*/
+int save_snapshot(const char *snapshot_path, const char *init_file, Variable *root);
+
+/*
+** Rewrites the PATH lookups of an existing snapshot with the ones made
+** since, keeping its variables as they were right after the init file.
+** Nothing is written if no lookups were added.
+**
+** Returns 0 on success or if nothing changed, -1 on error.
+*/
+int update_snapshot_paths(const char *snapshot_path);
+
+/*
+** Looks up a builtin by name.
+**
+** Returns the builtin, or NULL if name is not a builtin.
+*/
+const Builtin *find_builtin(const char *name);
+
+/*
+** Sets the variables list that builtins run against.
+*/
+void set_builtin_variables(Variable **root);
+
+/*
+** Returns the variables list set with set_builtin_variables, or NULL if
+** there is none yet.
+*/
+Variable *get_builtin_variables(void);
+
+/*
+** Returns the pointer set with set_builtin_variables, for code that may
+** add to the variables list, or NULL if there is none yet.
+*/
+Variable **get_builtin_root(void);
+
+/*
+** Runs a builtin inside the shell process itself. The redirections of
+** an exec are applied to the shell first, see redirect_shell.
+**
+** Returns the exit status of the builtin.
+*/
+int run_builtin(const Builtin *builtin, Command *command);
+
+/*
+** Drops the bytes `read` buffered from stdin, for when stdin is replaced:
+** the new one could be at the same offset as the old one was.
+*/
+void forget_read_buffer(void);
+
+/*
+** Runs a command on a list of items, split into batches that each fit
+** in ARG_MAX, like xargs: `batch [-P N] [-k] [-n MAX] [-a FILE] COMMAND
+** [ARG...] [-- ITEM...]`.
+**
+** The items are the arguments after "--", then the lines of FILE. With
+** -P, up to N batches run at once (0 for one per CPU); with -k, the
+** output of every batch is held back until the batches before it are
+** done, so it comes out in order. -n caps the number of items per batch.
+**
+** Returns 0 if every batch succeeded, BATCH_FAILED if any exited with a
+** non-zero status, BATCH_KILLED if any was killed or could not be
+** started, and EXIT_NOT_FOUND or EXIT_CANNOT_EXEC if COMMAND could not
+** be run at all.
+*/
+int builtin_batch(char **args, Variable **root);
+
+/*
+** Prints the runtime counters of the shell, see print_stats: `stats`.
+**
+** Returns 0.
+*/
+int builtin_stats(char **args, Variable **root);
+
+/*
+** Replaces the shell with a command, without a fork: `exec COMMAND
+** [ARG...]`. With no command, does nothing; the redirections of an exec
+** are applied to the shell itself by redirect_shell, before this runs.
+**
+** Does not return if the command starts. Returns 0 with no command, or
+** EXIT_NOT_FOUND or EXIT_CANNOT_EXEC if it could not be run.
+*/
+int builtin_exec(char **args, Variable **root);
+
+/*
+** Applies the redirections of an exec to the shell itself, for good:
+** `exec >log`, `exec 3<file`, `exec 2>&1` or `exec 3>&-`. Every command
+** the shell runs afterwards inherits them.
+**
+** Returns 0 on success, -1 if any redirection failed; the ones before it
+** stay applied.
+*/
+int redirect_shell(Command *command);
+
+/*
+** Returns 1 if fd is open for the user, 0 if it is closed or is one the
+** shell uses for itself, all of which are close-on-exec: "3>&4" must not
+** hand out a pipe of the shell just because 4 happens to be one.
+*/
+int is_user_fd(int fd);
+
+/*
+** Moves a file the shell itself keeps open, like a script being read, to
+** SHELL_FD_MIN or above, close-on-exec, out of the way of exec and the
+** numbered redirections.
+**
+** Returns the new fd, or fd itself if it could not be moved.
+*/
+int move_shell_fd(int fd);
+
+/*
+** fopen for the files the shell itself keeps open, see move_shell_fd.
+*/
+FILE *open_shell_stream(const char *file_path, const char *mode);
+
+/*
+** Counters the shell keeps from start to exit, cheap enough to be always
+** on. Only the shell's own thread counts, except for the PATH lookups,
+** which path_cache_stats keeps.
+*/
+void count_parse(uint64_t ns);
+void count_fork(void);
+void count_exec_failure(void);
+void count_pipe(void);
+
+/*
+** Recounts the variables and the bytes they take, after the list changed.
+*/
+void count_variables(Variable *variables);
+
+/*
+** Makes SIGUSR1 dump the counters to stderr, see print_stats.
+*/
+void init_stats(void);
+
+/*
+** Writes every counter to fd as "name: value" lines. Only uses write,
+** so it may be called from a signal handler.
+*/
+void print_stats(int fd);
+
+/*
+** Writes every counter to a file as a JSON object, for --stats=FILE.
+**
+** Returns 0 on success, -1 if the file could not be written.
+*/
+int write_stats_json(const char *file_path);
+
+/*
+** Latency histograms bin durations in quarter powers of two, over
+** LATENCY_BUCKETS buckets. Returns the bucket of a duration in ns.
+*/
+int latency_bucket(uint64_t ns);
+
+/*
+** Returns the longest duration, in ns, that falls in a latency bucket.
+*/
+uint64_t latency_bucket_limit(int bucket);
+
+/*
+** Returns a percentile of a latency histogram of count durations, to the
+** precision of the buckets: the upper bound of the bucket it falls in,
+** 0 if the histogram is empty.
+*/
+uint64_t latency_percentile(const uint64_t *buckets, uint64_t count, int percent);
+
+/*
+** Starts recording the session to a file, for --record=FILE: every
+** input line from then on, and what each one changed in the variables.
+**
+** Returns 0 on success, -1 if the file could not be created.
+*/
+int start_recording(const char *file_path, Variable *variables);
+
+/*
+** Records a raw input line, if recording: a RECORD_LINE is a line the
+** shell runs, with the time since recording started and the working
+** directory; a RECORD_CONTINUATION is a further line of an if, while or
+** for block. Before a RECORD_LINE, the variables the previous line set
+** are recorded, so variables is only needed for those.
+*/
+void record_line(char kind, const char *line, Variable *variables);
+
+/*
+** Records what the last line set, and closes the record.
+*/
+void stop_recording(Variable *variables);
+
+/*
+** Runs the lines of a record made with --record, for --replay=FILE and
+** --replay-paced=FILE: as fast as possible, or if paced, each at the
+** time it was recorded at. Every line runs in the working directory it
+** was recorded in.
+**
+** A latency histogram of the lines, and the lines whose variables ended
+** up different from the recording, are reported on stderr.
+**
+** Returns 0 on success, -1 if the record could not be read.
+*/
+int run_replay(const char *file_path, uint8_t paced, Variable **root);
+
+/*
+** Starts sampling the shell's own stack every PROFILE_INTERVAL_USEC of
+** the CPU time it uses, for --profile. Time spent waiting for children
+** is not sampled, only what the shell itself runs.
+**
+** Returns 0 on success, -1 if the profile file could not be created.
+*/
+int start_profile(const char *file_path);
+
+/*
+** Stops sampling and writes the samples in the folded stack format of
+** flamegraph tools, "main;run_script;parse_line 42" with the root frame
+** first, one line per distinct stack. A summary of the samples, and of
+** the CPU time of the shell against that of its children, goes to stderr.
+*/
+void stop_profile(void);
+
+/*
+** Whitespace trimmers shared by the parsers: the first advances *line past
+** leading spaces, the second cuts trailing spaces off in place.
+*/
+void trim_whitespace_leading(char **line);
+void trim_whitespace_ending(char *line);
+
+/*
+** Returns 1 if the (trimmed) line is a variable assignment rather than a
+** command, that is if the text before its first '=' is a single word.
+*/
+int is_assignment(const char *line);
+
+/*
+** Returns 1 if the (trimmed) line is a list of pipelines separated by
+** `;`, `&&` or `||`, 0 otherwise.
+*/
+int is_command_list(const char *line);
+
+/*
+** Adds a variable to the list, or updates it if it already exists.
+** PATH is always kept at the head of the list.
+*/
+void add_variable(const char *name, const char *value, Variable **variables);
+
 /*
 ** WARNING: this is a challenging string parsing task.
 **
@@ -133,6 +922,77 @@ Command *parse_line(char *line, Variable **variables);
 char *replace_variables_mk_line(const char *line,
                                 Variable *variables);
 
+/*
+** Reentrant replace_variables_mk_line, against the variables of a
+** context: ${VAR:=word} assigns to them and bumps the generation of the
+** context, where replace_variables_mk_line only substitutes word.
+*/
+char *replace_variables_r(ParserContext *context, const char *line);
+
+/*
+** replace_variables_mk_line for the shell's own variables list, which
+** ${VAR:=word} may add to.
+*/
+char *replace_variables(const char *line, Variable **variables);
+
+/*
+** Expands the expression of a "${expression}", without its braces, into
+** dest, which has room for capacity characters, and NUL terminates it:
+**
+**   ${VAR}          the value of VAR
+**   ${#VAR}         the number of characters of VAR
+**   ${VAR:-word}    word if VAR is unset or empty, ${VAR-word} if unset
+**   ${VAR:=word}    the same, also assigning word to VAR through context
+**   ${VAR#pat}      VAR without the shortest prefix matching pat, ## the longest
+**   ${VAR%pat}      VAR without the shortest suffix matching pat, %% the longest
+**   ${VAR/pat/rep}  VAR with the first longest match of pat replaced, // every one
+**   ${VAR:off:len}  len characters of VAR from off; negatives count from the end,
+**                   and both are arithmetic expressions
+**
+** Patterns are globs, see glob_match. Words, patterns and replacements
+** may use variables themselves. If context is NULL, ${VAR:=word} does
+** not assign. The result is truncated to fit dest.
+**
+** Returns the length of the result, or -1 on a bad substitution.
+*/
+ssize_t expand_parameter(const char *expression, size_t length, Variable *variables,
+                         ParserContext *context, char *dest, size_t capacity);
+
+/*
+** Matches a whole text against a glob pattern, with * ? [...] and '\'
+** escapes. Neither needs to be NUL terminated.
+**
+** Returns 1 if the text matches, 0 otherwise.
+*/
+int glob_match(const char *pattern, size_t pattern_length, const char *text, size_t text_length);
+
+/*
+** Tells whether a line uses ${...} with anything more than a name, which
+** must be expanded before the line is split into commands.
+*/
+int has_parameter_operators(const char *line);
+
+/*
+** Evaluates an integer expression, as found between "$((" and "))".
+**
+** Supports decimal, octal and hex numbers, variables (with or without
+** '$'), parentheses, unary - + ~ !, and the binary operators
+** * / % + - << >> < <= > >= == != & ^ | with C precedence.
+**
+** Returns 0 and sets *result on success, -1 on a syntax error or a
+** division by zero.
+*/
+int evaluate_arithmetic(const char *expression, Variable *variables, long *result);
+
+/*
+** Creates a new line on the heap with every "$((expression))" of line
+** replaced by its value, in decimal. replace_variables_mk_line does this
+** before replacing variables.
+**
+** Returns NULL if an expression is unterminated or could not be evaluated.
+*/
+char *expand_arithmetic(const char *line, Variable *variables);
+
 /*
 ** This function is provided for you and should not be modified.
 **
@@ -166,21 +1026,102 @@ char *resolve_executable(const char *command_name, Variable *path);
 ** The error code from the last command is returned through a pointer
 ** to a heap integer on success. If the line is a `cd` command, the
 ** return value of `cd_cscshell` is stored by the heap int.
+** If a command cannot be exec'd, the stages after it are never started
+** and the error code is EXIT_NOT_FOUND or EXIT_CANNOT_EXEC.
 ** -- If there are no commands to execute, returns NULL
 ** -- If there were any errors starting any commands,
 **    returns (pointer value) -1
+**
+** A command list is run one pipeline at a time, skipping the pipeline
+** after a && that failed or after a || that succeeded; its error code is
+** that of the last pipeline run.
+**
+** A group opens its redirections once, for every pipeline of its list to
+** inherit: a { } group runs its list in the shell itself, and a ( )
+** group in a forked child, so that its assignments and cd do not stick.
 */
 int *execute_line(Command *head);
 
 /*
 ** Forks a new process and execs the command
 ** making sure all file descriptors are set up correctly.
+** A builtin is run in the new process instead of exec'd.
+**
+** The child reports a failed execv through a close-on-exec status pipe,
+** so the parent knows whether the command started before returning.
 **
-** Parent process returns -1 on error.
+** Parent process returns -1 on error, or EXEC_FAILED (with errno set to
+** the error of execv) if the child could not exec. In both cases no child
+** is left to wait for.
 ** Any child processes should not return.
 */
 int run_command(Command *command);
 
+/*
+** Picks the CPU every stage of a pipeline is pinned to, following the
+** PIPELINE_AFFINITY variable, and stores it in the cpu of each command:
+**
+**   none     (or unset) stages go wherever the scheduler puts them
+**   compact  adjacent stages go on neighbouring cores, sharing L2/L3,
+**            starting from the CPU the shell runs on
+**   spread   stages are spread evenly over the CPUs the shell may use
+**   0-3,8    stage i goes on the i-th CPU of the list, wrapping around
+**
+** Single commands are never pinned. run_command applies the choice in
+** the child, before it execs.
+*/
+void place_pipeline(Command *head, Variable *variables);
+
+/*
+** Pins the calling process to a single CPU. Meant for a child of the
+** shell right before it execs, so a failure only costs the placement.
+*/
+void pin_to_cpu(int cpu);
+
+/*
+** Creates a transient cgroup for a pipeline under the delegated cgroup
+** named by PIPELINE_CGROUP, with the limits of PIPELINE_CPU_MAX and
+** PIPELINE_MEMORY_MAX (in cpu.max and memory.max syntax), so that its
+** stages can be spawned straight into it with fork_into_cgroup.
+**
+** Nothing is done if PIPELINE_CGROUP is unset. A limit that cannot be
+** set is reported, and the pipeline runs without it.
+**
+** Returns the cgroup directory fd, with its path in path (MAX_PATH_STR
+** long), or -1 if the pipeline does not get a cgroup.
+*/
+int open_line_cgroup(Variable *variables, char *path);
+
+/*
+** Appends what a pipeline used to the file named by PIPELINE_CGROUP_LOG,
+** if it is set, then removes the pipeline's cgroup and closes dir_fd.
+** The cgroup is left behind if a stage left processes running in it.
+*/
+void close_line_cgroup(int dir_fd, const char *path, Command *head, int status, Variable *variables);
+
+/*
+** Forks a child straight into a cgroup with clone3(CLONE_INTO_CGROUP),
+** so that no instruction of it runs, and no memory is charged, outside
+** the cgroup. Falls back to a plain fork if the kernel cannot do that,
+** in which case the child simply stays in the shell's cgroup.
+**
+** Returns what fork returns.
+*/
+pid_t fork_into_cgroup(int cgroup_fd);
+
+/*
+** Copies everything the producer of a fan-out writes to input_fd to each
+** of the count output_fds, without the data ever passing through the
+** shell: tee(2) duplicates the pipe buffers of input_fd into every output
+** pipe, and once they all have a copy splice(2) drops them into
+** /dev/null. Runs until the producer is done; a consumer that goes away
+** is dropped, and when none is left the producer gets EPIPE.
+**
+** Every fd given is closed, -1 ones are skipped. Returns 0 on success,
+** -1 on error.
+*/
+int copy_fanout(int input_fd, int *output_fds, int count);
+
 /*
 ** Executes an entire script line-by-line.
 ** Stops and indicates an error as soon as any line fails.
@@ -189,9 +1130,86 @@ int run_command(Command *command);
 */
 int run_script(char *file_path, Variable **root);
 
+/*
+** Returns non-zero if the (trimmed) line starts an if, while or for block.
+*/
+int is_block_start(const char *line);
+
+/*
+** Compiles a whole if/while/for statement starting at line, reading the
+** rest of its lines from stream. If continuation is not NULL, it is printed
+** before every extra line is read (interactive mode).
+**
+** Every nested line is compiled once with compile_line, so running the
+** block again does not lex it again.
+**
+** Returns the compiled block, or (Block *) -1 on a syntax error.
+*/
+Block *compile_block(const char *line, FILE *stream, const char *continuation,
+                     Variable *variables);
+
+/*
+** Compiles a whole script into a list of blocks, so that it can be run
+** again and again without being read or lexed.
+**
+** Returns the compiled script (NULL if it has no lines), or (Block *) -1 if
+** the file cannot be read or has a syntax error.
+*/
+Block *compile_script(const char *file_path, Variable *variables);
+
+/*
+** Runs a list of compiled blocks.
+**
+** Returns the exit status of the last line run (0 if none were run),
+** or -1 if a line could not be executed and the shell needs to stop.
+*/
+int run_block(Block *block, Variable **root);
+
+/*
+** Frees a list of compiled blocks and all their templates.
+*/
+void free_block(Block *block);
+
+/*
+** Fills in the socket run_daemon and run_client use when none is given:
+** SOCKET_NAME in $XDG_RUNTIME_DIR, or else in SOCKET_FALLBACK_DIR, which
+** is created private to this user if it does not exist yet.
+**
+** socket_path must hold MAX_PATH_STR bytes. Returns 0 on success, -1 if
+** the fallback directory exists but is not private to this user.
+*/
+int default_socket_path(char *socket_path);
+
+/*
+** Serves scripts submitted with run_client over a unix socket, after the
+** init file has been run once into root.
+**
+** Scripts are compiled once and kept until they change on disk, and every
+** request runs in its own child with the client's stdio, so requests
+** cannot change the daemon's state or each other's. Only this user can
+** submit scripts, and an existing socket_path is only replaced if it is a
+** socket of this user.
+**
+** Returns 0 once stopped by SIGINT or SIGTERM, -1 on error.
+*/
+int run_daemon(const char *socket_path, Variable **root);
+
+/*
+** Submits a script to a daemon started with run_daemon, handing it this
+** process's stdin, stdout and stderr, and waits for it to finish.
+**
+** The stdio is only handed over once the daemon is known to run as this
+** user.
+**
+** Returns what run_script would have returned for the script, or -1 if
+** the daemon could not be reached.
+*/
+int run_client(const char *socket_path, const char *script_path);
+
 /*
 ** Implement the following function that frees all the
 ** heap memory associated with a particular command.
+** The pipelines after it in a command list are freed too.
  */
 void free_command(Command *command);
 
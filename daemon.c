@@ -0,0 +1,587 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/*
+** Sent by the client, along with its stdin, stdout and stderr as
+** SCM_RIGHTS, and followed by the script path and working directory.
+*/
+typedef struct DaemonRequest {
+    uint32_t path_len;
+    uint32_t cwd_len;
+} DaemonRequest;
+
+/*
+** A script compiled by the daemon, reused for as long as the file
+** keeps the same modification time and size.
+*/
+typedef struct CompiledScript {
+    char *path;
+    struct timespec mtime;
+    off_t size;
+    Block *blocks;
+    struct CompiledScript *next;
+} CompiledScript;
+
+static CompiledScript *compiled_scripts = NULL;
+static int num_compiled_scripts = 0;
+static volatile sig_atomic_t daemon_stopping = 0;
+
+
+/**
+ * Write a whole buffer, retrying on short writes.
+ *
+ * @param fd The file descriptor to write to.
+ * @param buf The bytes to write.
+ * @param length The number of bytes to write.
+ * @return 0 on success, -1 on error.
+ */
+int write_all(int fd, const void *buf, size_t length) {
+    const char *bytes = buf;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * Read a whole buffer, retrying on short reads.
+ *
+ * @param fd The file descriptor to read from.
+ * @param buf Where to store the bytes.
+ * @param length The number of bytes to read.
+ * @return 0 on success, -1 on error or if EOF came first.
+ */
+int read_all(int fd, void *buf, size_t length) {
+    char *bytes = buf;
+    while (length > 0) {
+        ssize_t bytes_read = read(fd, bytes, length);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (bytes_read == 0) {
+            return -1;
+        }
+        bytes += bytes_read;
+        length -= bytes_read;
+    }
+    return 0;
+}
+
+/**
+ * Fill in the address of a unix socket.
+ *
+ * @param addr The address to fill in.
+ * @param socket_path The path of the socket.
+ * @return 0 on success, -1 if the path is too long.
+ */
+int socket_address(struct sockaddr_un *addr, const char *socket_path) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        ERR_PRINT(ERR_SOCKET_PATH, socket_path);
+        return -1;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return 0;
+}
+
+/**
+ * Check that a directory belongs to this user and no one else can use it.
+ *
+ * @param dir_path The path of the directory.
+ * @return 1 if it is private to this user, 0 otherwise.
+ */
+int is_private_dir(const char *dir_path) {
+    struct stat dir_stat;
+    // lstat, so a symlink planted in its place is not followed
+    return lstat(dir_path, &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode) &&
+           dir_stat.st_uid == getuid() && (dir_stat.st_mode & 0077) == 0;
+}
+
+/*
+** Fills in the socket run_daemon and run_client use when none is given:
+** SOCKET_NAME in $XDG_RUNTIME_DIR, or else in SOCKET_FALLBACK_DIR, which
+** is created private to this user if it does not exist yet.
+**
+** socket_path must hold MAX_PATH_STR bytes. Returns 0 on success, -1 if
+** the fallback directory exists but is not private to this user.
+*/
+int default_socket_path(char *socket_path) {
+    const char *runtime_dir = getenv(RUNTIME_DIR_VAR);
+    if (runtime_dir != NULL && runtime_dir[0] == '/') {
+        int max_dir_length = MAX_PATH_STR - sizeof("/" SOCKET_NAME);
+        if (strlen(runtime_dir) > max_dir_length) {
+            ERR_PRINT(ERR_SOCKET_PATH, runtime_dir);
+            return -1;
+        }
+        snprintf(socket_path, MAX_PATH_STR, "%.*s/" SOCKET_NAME,
+                 max_dir_length, runtime_dir);
+        return 0;
+    }
+
+    char dir_path[sizeof(SOCKET_FALLBACK_DIR) + 16];
+    snprintf(dir_path, sizeof(dir_path), SOCKET_FALLBACK_DIR, (int) getuid());
+    if (mkdir(dir_path, 0700) < 0 && errno != EEXIST) {
+        perror("default_socket_path");
+        return -1;
+    }
+    // anyone can create it first in /tmp, so it is checked even when just made
+    if (!is_private_dir(dir_path)) {
+        ERR_PRINT(ERR_SOCKET_DIR, dir_path);
+        return -1;
+    }
+    snprintf(socket_path, MAX_PATH_STR, "%s/" SOCKET_NAME, dir_path);
+    return 0;
+}
+
+/**
+ * Find the user at the other end of a unix socket connection.
+ *
+ * @param conn The connection.
+ * @param uid Set to the uid of the peer.
+ * @return 0 on success, -1 on error.
+ */
+int peer_uid(int conn, uid_t *uid) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0) {
+        perror("getsockopt");
+        return -1;
+    }
+    *uid = credentials.uid;
+    return 0;
+}
+
+/**
+ * Remove a socket left behind by an earlier daemon, so it can be bound
+ * again. Anything else at that path is left alone.
+ *
+ * @param socket_path The path of the socket.
+ * @return 0 if the path is free now, -1 otherwise.
+ */
+int remove_stale_socket(const char *socket_path) {
+    struct stat socket_stat;
+    if (lstat(socket_path, &socket_stat) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISSOCK(socket_stat.st_mode) || socket_stat.st_uid != getuid()) {
+        ERR_PRINT(ERR_SOCKET_OWNER, socket_path);
+        return -1;
+    }
+    if (unlink(socket_path) < 0) {
+        perror("unlink");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Find the compiled version of a script, compiling it if it is new or changed.
+ *
+ * @param path The absolute path of the script.
+ * @param variables Pointer to the head of the linked list of variables.
+ * @return The compiled script, or (Block *) -1 if it could not be compiled.
+ */
+Block *find_compiled_script(const char *path, Variable *variables) {
+    struct stat script_stat;
+    if (stat(path, &script_stat) < 0) {
+        return (Block *) -1;
+    }
+
+    CompiledScript **link = &compiled_scripts;
+    while (*link != NULL) {
+        CompiledScript *script = *link;
+        if (strcmp(script->path, path) == 0) {
+            if (script->size == script_stat.st_size &&
+                script->mtime.tv_sec == script_stat.st_mtim.tv_sec &&
+                script->mtime.tv_nsec == script_stat.st_mtim.tv_nsec) {
+                return script->blocks;
+            }
+            // stale, compile it again below
+            *link = script->next;
+            free_block(script->blocks);
+            free(script->path);
+            free(script);
+            num_compiled_scripts--;
+            break;
+        }
+        link = &script->next;
+    }
+
+    Block *blocks = compile_script(path, variables);
+    if (blocks == (Block *) -1) {
+        return blocks;
+    }
+
+    // keep the newest scripts at the head, and drop the oldest when full
+    if (num_compiled_scripts >= DAEMON_SCRIPT_CACHE) {
+        link = &compiled_scripts;
+        while ((*link)->next != NULL) {
+            link = &(*link)->next;
+        }
+        free_block((*link)->blocks);
+        free((*link)->path);
+        free(*link);
+        *link = NULL;
+        num_compiled_scripts--;
+    }
+
+    CompiledScript *script = malloc(sizeof(CompiledScript));
+    script->path = strdup(path);
+    script->mtime = script_stat.st_mtim;
+    script->size = script_stat.st_size;
+    script->blocks = blocks;
+    script->next = compiled_scripts;
+    compiled_scripts = script;
+    num_compiled_scripts++;
+    return blocks;
+}
+
+/**
+ * Close every file descriptor a message carried as SCM_RIGHTS.
+ *
+ * @param msg The message, as recvmsg filled it in.
+ */
+void close_received_fds(struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < num_fds; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            close(fd);
+        }
+    }
+}
+
+/**
+ * Receive a request from a client.
+ *
+ * @param conn The connection to the client.
+ * @param fds Set to the client's stdin, stdout and stderr.
+ * @param path Set to the script path, MAX_PATH_STR bytes.
+ * @param cwd Set to the client's working directory, MAX_PATH_STR bytes.
+ * @return 0 on success, -1 if the request is malformed.
+ */
+int receive_request(int conn, int fds[3], char *path, char *cwd) {
+    DaemonRequest request;
+    struct iovec iov = {.iov_base = &request, .iov_len = sizeof(DaemonRequest)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read < 0) {
+        return -1;
+    }
+
+    // anything but exactly three descriptors is refused, and whatever
+    // did arrive is closed rather than left open in the daemon
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (bytes_read != sizeof(DaemonRequest) || (msg.msg_flags & MSG_CTRUNC) ||
+        cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3) ||
+        CMSG_NXTHDR(&msg, cmsg) != NULL) {
+        close_received_fds(&msg);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+
+    if (request.path_len == 0 || request.path_len >= MAX_PATH_STR ||
+        request.cwd_len == 0 || request.cwd_len >= MAX_PATH_STR ||
+        read_all(conn, path, request.path_len) < 0 ||
+        read_all(conn, cwd, request.cwd_len) < 0) {
+        for (int i = 0; i < 3; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    path[request.path_len] = '\0';
+    cwd[request.cwd_len] = '\0';
+    return 0;
+}
+
+/**
+ * Run one request in a child of the daemon, which never returns.
+ *
+ * The child takes over the client's stdio and working directory, runs the
+ * script against a copy of the daemon's warm state and writes the result
+ * back to the client.
+ *
+ * @param conn The connection to the client.
+ * @param fds The client's stdin, stdout and stderr.
+ * @param path The script path, relative to cwd.
+ * @param cwd The client's working directory.
+ * @param blocks The compiled script, or (Block *) -1 to read it line by line.
+ * @param root Pointer to the head of the linked list of variables.
+ */
+void serve_request(int conn, int fds[3], char *path, char *cwd,
+                   Block *blocks, Variable **root) {
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        close(fds[i]);
+    }
+
+    int32_t status;
+    if (chdir(cwd) < 0) {
+        perror("chdir");
+        status = -1;
+    } else if (blocks == (Block *) -1) {
+        status = run_script(path, root);
+    } else {
+        // same result and trailing newline as run_script
+        status = run_block(blocks, root) < 0 ? -1 : 0;
+        printf("\n");
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    if (write_all(conn, &status, sizeof(int32_t)) < 0) {
+        _exit(EXIT_FAILURE);
+    }
+    _exit(0);
+}
+
+/**
+ * Stop accepting requests once the daemon is asked to terminate.
+ *
+ * @param sig The signal received.
+ */
+void stop_daemon(int sig) {
+    daemon_stopping = 1;
+}
+
+/*
+** Serves scripts submitted with run_client over a unix socket, after the
+** init file has been run once into root.
+**
+** Scripts are compiled once and kept until they change on disk, and every
+** request runs in its own child with the client's stdio, so requests
+** cannot change the daemon's state or each other's.
+**
+** Returns 0 once stopped by SIGINT or SIGTERM, -1 on error.
+*/
+int run_daemon(const char *socket_path, Variable **root) {
+    struct sockaddr_un addr;
+    if (socket_address(&addr, socket_path) < 0) {
+        return -1;
+    }
+
+    if (remove_stale_socket(socket_path) < 0) {
+        return -1;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    // only this user can connect, whatever directory the socket is in
+    mode_t old_umask = umask(0077);
+    int bound = bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(old_umask);
+    if (bound < 0 || listen(listen_fd, DAEMON_BACKLOG) < 0) {
+        perror("run_daemon");
+        close(listen_fd);
+        return -1;
+    }
+
+    // children are never waited on by the daemon itself
+    signal(SIGCHLD, SIG_IGN);
+    struct sigaction stop_action = {0};
+    stop_action.sa_handler = stop_daemon;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+
+    #ifdef DEBUG
+    printf("CSCSHELL daemon listening on %s\n", socket_path);
+    #endif
+
+    while (!daemon_stopping) {
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+
+        // the client's stdio is never taken from another user
+        uid_t uid;
+        if (peer_uid(conn, &uid) < 0) {
+            close(conn);
+            continue;
+        }
+        if (uid != getuid()) {
+            ERR_PRINT(ERR_PEER_UID, (int) uid);
+            close(conn);
+            continue;
+        }
+
+        // a client that stalls mid-request must not hold up the others
+        struct timeval timeout = {.tv_sec = DAEMON_RECV_TIMEOUT_MS / 1000,
+                                  .tv_usec = DAEMON_RECV_TIMEOUT_MS % 1000 * 1000};
+        if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+            perror("setsockopt");
+            close(conn);
+            continue;
+        }
+
+        int fds[3];
+        char path[MAX_PATH_STR];
+        char cwd[MAX_PATH_STR];
+        if (receive_request(conn, fds, path, cwd) < 0) {
+            ERR_PRINT(ERR_DAEMON_REQUEST);
+            close(conn);
+            continue;
+        }
+
+        char full_path[MAX_PATH_STR * 2 + 1];
+        if (path[0] == '/') {
+            strcpy(full_path, path);
+        } else {
+            snprintf(full_path, sizeof(full_path), "%s/%s", cwd, path);
+        }
+        Block *blocks = find_compiled_script(full_path, *root);
+
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+        } else if (pid == 0) {
+            close(listen_fd);
+            serve_request(conn, fds, path, cwd, blocks, root);
+        }
+
+        for (int i = 0; i < 3; i++) {
+            close(fds[i]);
+        }
+        close(conn);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    while (compiled_scripts != NULL) {
+        CompiledScript *next_script = compiled_scripts->next;
+        free_block(compiled_scripts->blocks);
+        free(compiled_scripts->path);
+        free(compiled_scripts);
+        compiled_scripts = next_script;
+    }
+    num_compiled_scripts = 0;
+    return daemon_stopping ? 0 : -1;
+}
+
+/*
+** Submits a script to a daemon started with run_daemon, handing it this
+** process's stdin, stdout and stderr, and waits for it to finish.
+**
+** Returns what run_script would have returned for the script, or -1 if
+** the daemon could not be reached.
+*/
+int run_client(const char *socket_path, const char *script_path) {
+    struct sockaddr_un addr;
+    if (socket_address(&addr, socket_path) < 0) {
+        return -1;
+    }
+
+    char cwd[MAX_PATH_STR];
+    if (getcwd(cwd, MAX_PATH_STR) == NULL) {
+        perror("run_client");
+        return -1;
+    }
+    if (strlen(script_path) >= MAX_PATH_STR) {
+        ERR_PRINT(ERR_DAEMON_REQUEST);
+        return -1;
+    }
+
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(conn, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("run_client");
+        close(conn);
+        return -1;
+    }
+
+    // this process's stdio is only handed to a daemon of the same user
+    uid_t uid;
+    if (peer_uid(conn, &uid) < 0) {
+        close(conn);
+        return -1;
+    }
+    if (uid != getuid()) {
+        ERR_PRINT(ERR_DAEMON_UID, socket_path, (int) uid);
+        close(conn);
+        return -1;
+    }
+
+    DaemonRequest request;
+    request.path_len = strlen(script_path);
+    request.cwd_len = strlen(cwd);
+    struct iovec iov = {.iov_base = &request, .iov_len = sizeof(DaemonRequest)};
+
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * 3);
+
+    int32_t status = -1;
+    if (sendmsg(conn, &msg, 0) != sizeof(DaemonRequest) ||
+        write_all(conn, script_path, request.path_len) < 0 ||
+        write_all(conn, cwd, request.cwd_len) < 0 ||
+        read_all(conn, &status, sizeof(int32_t)) < 0) {
+        ERR_PRINT(ERR_DAEMON_LOST);
+        status = -1;
+    }
+
+    close(conn);
+    return status;
+}
@@ -0,0 +1,173 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+
+
+/*
+** Replaces the shell with a command, without a fork: `exec COMMAND
+** [ARG...]`. With no command, does nothing; the redirections of an exec
+** are applied to the shell itself by redirect_shell, before this runs.
+**
+** Does not return if the command starts. Returns 0 with no command, or
+** EXIT_NOT_FOUND or EXIT_CANNOT_EXEC if it could not be run.
+*/
+int builtin_exec(char **args, Variable **root) {
+    if (args[1] == NULL) {
+        return 0;
+    }
+    char *exec_path = resolve_executable(args[1], *root);
+    if (exec_path == NULL) {
+        ERR_PRINT(ERR_NO_EXECU, args[1]);
+        return EXIT_NOT_FOUND;
+    }
+
+    // nothing of the shell runs after a successful execv, so it is wrapped up now
+    stop_profile();
+    fflush(stdout);
+    execv(exec_path, args + 1);
+
+    int exec_errno = errno;
+    ERR_PRINT(ERR_EXEC_FAILED, exec_path, strerror(exec_errno));
+    free(exec_path);
+    return exec_errno == ENOENT ? EXIT_NOT_FOUND : EXIT_CANNOT_EXEC;
+}
+
+/*
+** Returns 1 if fd is open for the user, 0 if it is closed or is one the
+** shell uses for itself, all of which are close-on-exec: "3>&4" must not
+** hand out a pipe of the shell just because 4 happens to be one.
+*/
+int is_user_fd(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    return flags >= 0 && (flags & FD_CLOEXEC) == 0;
+}
+
+/**
+ * Put a file descriptor in place of one of the shell's, for good. Unlike
+ * the ones the shell opens for its children, it is inherited by them.
+ *
+ * @param source_fd The file descriptor to put in place.
+ * @param fd The shell's file descriptor to replace.
+ * @return 0 on success, -1 on error.
+ */
+int replace_shell_fd(int source_fd, int fd) {
+    if (source_fd == fd) {
+        return fcntl(fd, F_SETFD, 0);
+    }
+    if (dup2(source_fd, fd) < 0) {
+        ERR_PRINT(ERR_BAD_FD, source_fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Open a file and put it in place of one of the shell's, see replace_shell_fd.
+ *
+ * @param path The path of the file.
+ * @param flags How to open it.
+ * @param fd The shell's file descriptor to replace.
+ * @return 0 on success, -1 on error.
+ */
+int redirect_shell_fd(const char *path, int flags, int fd) {
+    int opened = open(path, flags, 0666);
+    if (opened < 0) {
+        ERR_PRINT(ERR_REDIR, path, strerror(errno));
+        return -1;
+    }
+    int result = replace_shell_fd(opened, fd);
+    if (opened != fd) {
+        close(opened);
+    }
+    return result;
+}
+
+/*
+** Applies the redirections of an exec to the shell itself, for good:
+** `exec >log`, `exec 3<file`, `exec 2>&1` or `exec 3>&-`. Every command
+** the shell runs afterwards inherits them.
+**
+** Returns 0 on success, -1 if any redirection failed; the ones before it
+** stay applied.
+*/
+int redirect_shell(Command *command) {
+    // what the shell printed so far goes where stdout pointed when it did
+    fflush(stdout);
+
+    // `read` must not go on with what it buffered from the old stdin
+    forget_read_buffer();
+
+    if (command->redir_in_path != NULL &&
+        redirect_shell_fd(command->redir_in_path, O_RDONLY, STDIN_FILENO) < 0) {
+        return -1;
+    }
+    if (command->redir_out_path != NULL) {
+        int flags = O_WRONLY | O_CREAT | (command->redir_append ? O_APPEND : O_TRUNC);
+        if (redirect_shell_fd(command->redir_out_path, flags, STDOUT_FILENO) < 0) {
+            return -1;
+        }
+    }
+
+    for (FdRedirection *redirection = command->fd_redirections; redirection != NULL;
+         redirection = redirection->next) {
+        int result;
+        if (redirection->source_fd == FD_CLOSE) {
+            // closing a descriptor that is not open is not an error, as in sh
+            close(redirection->fd);
+            result = 0;
+        } else if (redirection->source_fd >= 0 && !is_user_fd(redirection->source_fd)) {
+            ERR_PRINT(ERR_BAD_FD, redirection->source_fd, strerror(EBADF));
+            result = -1;
+        } else if (redirection->source_fd >= 0) {
+            result = replace_shell_fd(redirection->source_fd, redirection->fd);
+        } else {
+            result = redirect_shell_fd(redirection->path, redirection->flags, redirection->fd);
+        }
+        if (result < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+** Moves a file the shell itself keeps open, like a script being read, to
+** SHELL_FD_MIN or above, close-on-exec, out of the way of exec and the
+** numbered redirections.
+**
+** Returns the new fd, or fd itself if it could not be moved.
+*/
+int move_shell_fd(int fd) {
+    if (fd < 0 || fd >= SHELL_FD_MIN) {
+        return fd;
+    }
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+    if (moved < 0) {
+        return fd;
+    }
+    close(fd);
+    return moved;
+}
+
+/*
+** fopen for the files the shell itself keeps open, see move_shell_fd.
+*/
+FILE *open_shell_stream(const char *file_path, const char *mode) {
+    FILE *stream = fopen(file_path, mode);
+    if (stream == NULL || fileno(stream) >= SHELL_FD_MIN) {
+        return stream;
+    }
+    int moved = fcntl(fileno(stream), F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+    FILE *moved_stream = moved < 0 ? NULL : fdopen(moved, mode);
+    if (moved_stream == NULL) {
+        if (moved >= 0) {
+            close(moved);
+        }
+        return stream;
+    }
+    fclose(stream);
+    return moved_stream;
+}
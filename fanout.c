@@ -0,0 +1,128 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+
+
+/**
+ * Drop a consumer of a fan-out, once it no longer reads its pipe.
+ *
+ * @param output_fd Pointer to the write end of the consumer's pipe, set to -1.
+ * @param alive Pointer to the number of consumers left, decremented.
+ */
+void drop_consumer(int *output_fd, int *alive) {
+    close(*output_fd);
+    *output_fd = -1;
+    (*alive)--;
+}
+
+/*
+** Copies everything the producer of a fan-out writes to input_fd to each
+** of the count output_fds, without the data ever passing through the
+** shell: tee(2) duplicates the pipe buffers of input_fd into every output
+** pipe, and once they all have a copy splice(2) drops them into
+** /dev/null. Runs until the producer is done; a consumer that goes away
+** is dropped, and when none is left the producer gets EPIPE.
+**
+** Every fd given is closed, -1 ones are skipped. Returns 0 on success,
+** -1 on error.
+*/
+int copy_fanout(int input_fd, int *output_fds, int count) {
+    // tee always copies from the head of the input, so a consumer that
+    // already has a copy of the head must wait until it is dropped
+    size_t copied[count];
+    int alive = 0;
+    for (int i = 0; i < count; i++) {
+        copied[i] = 0;
+        alive += output_fds[i] >= 0;
+    }
+
+    // a consumer that exits must not take the shell with it
+    struct sigaction ignore = {0};
+    struct sigaction saved;
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &saved);
+
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int result = null_fd < 0 ? -1 : 0;
+    struct pollfd waiting[count];
+    while (input_fd >= 0 && null_fd >= 0 && alive > 0) {
+        uint8_t done = 0;
+        size_t least = SIZE_MAX;
+        for (int i = 0; i < count; i++) {
+            if (output_fds[i] < 0) {
+                continue;
+            }
+            if (copied[i] == 0) {
+                ssize_t teed = tee(input_fd, output_fds[i], FANOUT_PIPE_SIZE, SPLICE_F_NONBLOCK);
+                if (teed > 0) {
+                    copied[i] = teed;
+                } else if (teed == 0) {
+                    // the producer is done, and everything it wrote was dropped
+                    done = 1;
+                } else if (errno == EPIPE) {
+                    drop_consumer(&output_fds[i], &alive);
+                    continue;
+                } else if (errno != EAGAIN && errno != EINTR) {
+                    result = -1;
+                    done = 1;
+                }
+            }
+            least = copied[i] < least ? copied[i] : least;
+        }
+        if (done || alive == 0) {
+            break;
+        }
+
+        if (least > 0) {
+            ssize_t dropped = splice(input_fd, NULL, null_fd, NULL, least, 0);
+            if (dropped <= 0) {
+                result = -1;
+                break;
+            }
+            for (int i = 0; i < count; i++) {
+                copied[i] -= output_fds[i] >= 0 ? dropped : 0;
+            }
+            continue;
+        }
+
+        // wait for the producer to write more, or for full consumers to read
+        int num_waiting = 0;
+        int available = 0;
+        if (ioctl(input_fd, FIONREAD, &available) < 0 || available == 0) {
+            waiting[num_waiting++] = (struct pollfd) {input_fd, POLLIN, 0};
+        } else {
+            for (int i = 0; i < count; i++) {
+                if (output_fds[i] >= 0 && copied[i] == 0) {
+                    waiting[num_waiting++] = (struct pollfd) {output_fds[i], POLLOUT, 0};
+                }
+            }
+        }
+        if (poll(waiting, num_waiting, -1) < 0 && errno != EINTR) {
+            result = -1;
+            break;
+        }
+    }
+    if (result < 0) {
+        perror("copy_fanout");
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (output_fds[i] >= 0) {
+            close(output_fds[i]);
+        }
+    }
+    if (input_fd >= 0) {
+        close(input_fd);
+    }
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+    sigaction(SIGPIPE, &saved, NULL);
+    return result;
+}
@@ -0,0 +1,374 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LEX_X86 1
+#define SPECIAL_VECTOR(c) ((const void *) special_vectors[(unsigned char) (c)])
+#endif
+
+
+static void (*classify_impl)(const char *line, size_t start, size_t length, uint64_t *bits) = NULL;
+static const char *classify_impl_name = NULL;
+static uint8_t special_table[256];
+// Each special character repeated over a whole vector, indexed by the
+// character: loading these is far cheaper than building them with set1
+// on every call in an unoptimised build
+static uint8_t special_vectors[256][32] __attribute__((aligned(32)));
+static pthread_once_t lexer_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Classify a line one byte at a time, using a lookup table.
+ *
+ * @param line The line to classify.
+ * @param start The index to start at.
+ * @param length The length of the line.
+ * @param bits The bitmask to set bits in, already zeroed.
+ */
+void classify_scalar(const char *line, size_t start, size_t length, uint64_t *bits) {
+    for (size_t i = start; i < length; i++) {
+        if (special_table[(unsigned char) line[i]]) {
+            bits[i / 64] |= (uint64_t) 1 << (i % 64);
+        }
+    }
+}
+
+#ifdef LEX_X86
+/**
+ * Classify a line 16 bytes at a time with SSE2, the x86-64 baseline.
+ *
+ * @param line The line to classify.
+ * @param start The index to start at, a multiple of 16.
+ * @param length The length of the line.
+ * @param bits The bitmask to set bits in, already zeroed.
+ */
+__attribute__((target("sse2")))
+void classify_sse2(const char *line, size_t start, size_t length, uint64_t *bits) {
+    const __m128i dollar = _mm_load_si128(SPECIAL_VECTOR('$'));
+    const __m128i pipe = _mm_load_si128(SPECIAL_VECTOR('|'));
+    const __m128i less = _mm_load_si128(SPECIAL_VECTOR('<'));
+    const __m128i greater = _mm_load_si128(SPECIAL_VECTOR('>'));
+    const __m128i hash = _mm_load_si128(SPECIAL_VECTOR('#'));
+    const __m128i equals = _mm_load_si128(SPECIAL_VECTOR('='));
+    const __m128i brace_open = _mm_load_si128(SPECIAL_VECTOR('{'));
+    const __m128i brace_close = _mm_load_si128(SPECIAL_VECTOR('}'));
+    const __m128i space = _mm_load_si128(SPECIAL_VECTOR(' '));
+    const __m128i tab = _mm_load_si128(SPECIAL_VECTOR('\t'));
+    const __m128i newline = _mm_load_si128(SPECIAL_VECTOR('\n'));
+    const __m128i carriage = _mm_load_si128(SPECIAL_VECTOR('\r'));
+    const __m128i semicolon = _mm_load_si128(SPECIAL_VECTOR(';'));
+    const __m128i ampersand = _mm_load_si128(SPECIAL_VECTOR('&'));
+
+    size_t i = start;
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (line + i));
+        __m128i found = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, dollar), _mm_cmpeq_epi8(chunk, pipe)),
+                         _mm_or_si128(_mm_cmpeq_epi8(chunk, less), _mm_cmpeq_epi8(chunk, greater))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, hash), _mm_cmpeq_epi8(chunk, equals)),
+                         _mm_or_si128(_mm_cmpeq_epi8(chunk, brace_open), _mm_cmpeq_epi8(chunk, brace_close))));
+        found = _mm_or_si128(found,
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                         _mm_or_si128(_mm_cmpeq_epi8(chunk, newline), _mm_cmpeq_epi8(chunk, carriage))));
+        found = _mm_or_si128(found, _mm_or_si128(_mm_cmpeq_epi8(chunk, semicolon), _mm_cmpeq_epi8(chunk, ampersand)));
+
+        uint64_t found_bits = (uint32_t) _mm_movemask_epi8(found);
+        bits[i / 64] |= found_bits << (i % 64);
+    }
+
+    classify_scalar(line, i, length, bits);
+}
+
+/**
+ * Classify a line 32 bytes at a time with AVX2.
+ *
+ * @param line The line to classify.
+ * @param start The index to start at, a multiple of 32.
+ * @param length The length of the line.
+ * @param bits The bitmask to set bits in, already zeroed.
+ */
+__attribute__((target("avx2")))
+void classify_avx2(const char *line, size_t start, size_t length, uint64_t *bits) {
+    const __m256i dollar = _mm256_load_si256(SPECIAL_VECTOR('$'));
+    const __m256i pipe = _mm256_load_si256(SPECIAL_VECTOR('|'));
+    const __m256i less = _mm256_load_si256(SPECIAL_VECTOR('<'));
+    const __m256i greater = _mm256_load_si256(SPECIAL_VECTOR('>'));
+    const __m256i hash = _mm256_load_si256(SPECIAL_VECTOR('#'));
+    const __m256i equals = _mm256_load_si256(SPECIAL_VECTOR('='));
+    const __m256i brace_open = _mm256_load_si256(SPECIAL_VECTOR('{'));
+    const __m256i brace_close = _mm256_load_si256(SPECIAL_VECTOR('}'));
+    const __m256i space = _mm256_load_si256(SPECIAL_VECTOR(' '));
+    const __m256i tab = _mm256_load_si256(SPECIAL_VECTOR('\t'));
+    const __m256i newline = _mm256_load_si256(SPECIAL_VECTOR('\n'));
+    const __m256i carriage = _mm256_load_si256(SPECIAL_VECTOR('\r'));
+    const __m256i semicolon = _mm256_load_si256(SPECIAL_VECTOR(';'));
+    const __m256i ampersand = _mm256_load_si256(SPECIAL_VECTOR('&'));
+
+    size_t i = start;
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (line + i));
+        __m256i found = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, dollar), _mm256_cmpeq_epi8(chunk, pipe)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, less), _mm256_cmpeq_epi8(chunk, greater))),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, hash), _mm256_cmpeq_epi8(chunk, equals)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, brace_open), _mm256_cmpeq_epi8(chunk, brace_close))));
+        found = _mm256_or_si256(found,
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, tab)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline), _mm256_cmpeq_epi8(chunk, carriage))));
+        found = _mm256_or_si256(found,
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, semicolon), _mm256_cmpeq_epi8(chunk, ampersand)));
+
+        uint64_t found_bits = (uint32_t) _mm256_movemask_epi8(found);
+        bits[i / 64] |= found_bits << (i % 64);
+    }
+
+    // not classify_sse2: mixing in its legacy SSE code right after AVX
+    // costs more than the tail of at most 31 bytes
+    classify_scalar(line, i, length, bits);
+}
+#endif
+
+/**
+ * Fill in the lookup table and pick the classifier, see init_lexer.
+ */
+void pick_classifier(void) {
+    memset(special_table, 0, sizeof(special_table));
+    for (const char *c = SPECIAL_CHARS; *c != '\0'; c++) {
+        special_table[(unsigned char) *c] = 1;
+        memset(special_vectors[(unsigned char) *c], *c, sizeof(special_vectors[0]));
+    }
+
+    classify_impl = classify_scalar;
+    classify_impl_name = "scalar";
+    #ifdef LEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        classify_impl = classify_avx2;
+        classify_impl_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        classify_impl = classify_sse2;
+        classify_impl_name = "sse2";
+    }
+    #endif
+}
+
+/*
+** Picks the fastest classifier the CPU supports: AVX2, then SSE2, then
+** a scalar lookup table. Only the first call does anything, even when
+** made from several threads at once; classify_line calls it itself.
+*/
+void init_lexer(void) {
+    pthread_once(&lexer_once, pick_classifier);
+}
+
+/*
+** Returns the name of the classifier picked by init_lexer.
+*/
+const char *lexer_name(void) {
+    init_lexer();
+    return classify_impl_name;
+}
+
+/*
+** Builds the bitmask of special characters (SPECIAL_CHARS) of a whole
+** line in a single pass: bit i of the mask is set if line[i] is special.
+** Lines up to MAX_SINGLE_LINE bytes use the mask's own storage, longer
+** ones allocate; free_line_mask releases it.
+*/
+void classify_line(const char *line, size_t length, LineMask *mask) {
+    init_lexer();
+    init_line_mask(line, length, mask);
+    classify_impl(line, 0, length, mask->bits);
+}
+
+/*
+** Frees anything classify_line or init_line_mask allocated for mask.
+*/
+void free_line_mask(LineMask *mask) {
+    if (mask->bits != mask->inline_bits) {
+        free(mask->bits);
+    }
+    mask->bits = NULL;
+}
+
+/*
+** Builds an empty mask for a line of a given length, with every bit
+** clear, for line_mask_copy to fill in.
+*/
+void init_line_mask(const char *line, size_t length, LineMask *mask) {
+    mask->line = line;
+    mask->length = length;
+    mask->words = (length + 63) / 64;
+    if (mask->words <= LINE_MASK_INLINE_WORDS) {
+        mask->bits = mask->inline_bits;
+    } else {
+        mask->bits = malloc(mask->words * sizeof(uint64_t));
+    }
+    memset(mask->bits, 0, mask->words * sizeof(uint64_t));
+}
+
+/**
+ * Read 64 bits of a bitmask starting at any bit, with the bits past its
+ * last word read as 0.
+ *
+ * @param bits The bitmask.
+ * @param words The number of words in the bitmask.
+ * @param from The index of the first bit.
+ * @return The bits, from in the lowest one.
+ */
+uint64_t read_mask_bits(const uint64_t *bits, size_t words, size_t from) {
+    size_t word = from / 64;
+    size_t shift = from % 64;
+    if (word >= words) {
+        return 0;
+    }
+    uint64_t value = bits[word] >> shift;
+    if (shift != 0 && word + 1 < words) {
+        value |= bits[word + 1] << (64 - shift);
+    }
+    return value;
+}
+
+/*
+** Copies the bits of count characters of one mask into another, for a
+** line made of pieces of classified lines: from in src goes to to in dst.
+** The bits at to in dst must still be clear.
+*/
+void line_mask_copy(LineMask *dst, size_t to, const LineMask *src, size_t from, size_t count) {
+    size_t copied = 0;
+    while (copied < count) {
+        size_t shift = (to + copied) % 64;
+        size_t chunk = 64 - shift < count - copied ? 64 - shift : count - copied;
+        uint64_t value = read_mask_bits(src->bits, src->words, from + copied);
+        if (chunk < 64) {
+            value &= ((uint64_t) 1 << chunk) - 1;
+        }
+        dst->bits[(to + copied) / 64] |= value << shift;
+        copied += chunk;
+    }
+}
+
+/*
+** Builds the mask of a copy of part of a classified line from the mask of
+** the line, without classifying the copy again.
+*/
+void line_mask_slice(const LineMask *mask, size_t from, size_t length, const char *line, LineMask *slice) {
+    init_line_mask(line, length, slice);
+    line_mask_copy(slice, 0, mask, from, length);
+}
+
+/*
+** Removes count characters at from from a mask, for when the same ones
+** are cut out of its line: the bits after them move down.
+*/
+void line_mask_erase(LineMask *mask, size_t from, size_t count) {
+    size_t length = mask->length - count;
+    // every word is written after the bits it takes were read
+    for (size_t to = from; to < length; to += 64 - to % 64) {
+        size_t shift = to % 64;
+        uint64_t kept = mask->bits[to / 64] & (((uint64_t) 1 << shift) - 1);
+        mask->bits[to / 64] = kept | read_mask_bits(mask->bits, mask->words, to + count) << shift;
+    }
+    mask->length = length;
+    mask->words = (length + 63) / 64;
+    if (length % 64 != 0) {
+        mask->bits[length / 64] &= ((uint64_t) 1 << (length % 64)) - 1;
+    }
+}
+
+/*
+** Returns the index of the first character at or after from that is not
+** c, or mask->length if there is none. c must be one of SPECIAL_CHARS.
+*/
+size_t line_mask_skip(const LineMask *mask, size_t from, char c) {
+    for (size_t i = from; i < mask->length; i++) {
+        // a plain character ends the run without looking at the line
+        if (!(mask->bits[i / 64] >> (i % 64) & 1) || mask->line[i] != c) {
+            return i;
+        }
+    }
+    return mask->length;
+}
+
+/*
+** Returns the index just past the last character before end that is not
+** c, or 0 if there is none. c must be one of SPECIAL_CHARS.
+*/
+size_t line_mask_skip_back(const LineMask *mask, size_t end, char c) {
+    for (size_t i = end; i > 0; i--) {
+        if (!(mask->bits[(i - 1) / 64] >> ((i - 1) % 64) & 1) || mask->line[i - 1] != c) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/*
+** Returns the index of the first c at or after from, looking only at
+** the special characters of the mask, or mask->length if there is none.
+** c must be one of SPECIAL_CHARS.
+*/
+size_t line_mask_find(const LineMask *mask, size_t from, char c) {
+    size_t word = from / 64;
+    if (word >= mask->words) {
+        return mask->length;
+    }
+    uint64_t bits = mask->bits[word] & ((uint64_t) -1 << (from % 64));
+
+    while (1) {
+        while (bits != 0) {
+            size_t i = word * 64 + __builtin_ctzll(bits);
+            if (mask->line[i] == c) {
+                return i;
+            }
+            bits &= bits - 1;
+        }
+        if (++word >= mask->words) {
+            return mask->length;
+        }
+        bits = mask->bits[word];
+    }
+}
+
+/*
+** Returns the index of the first special character at or after from,
+** or mask->length if there is none.
+*/
+size_t line_mask_next(const LineMask *mask, size_t from) {
+    size_t word = from / 64;
+    if (word >= mask->words) {
+        return mask->length;
+    }
+    uint64_t bits = mask->bits[word] & ((uint64_t) -1 << (from % 64));
+    while (bits == 0) {
+        if (++word >= mask->words) {
+            return mask->length;
+        }
+        bits = mask->bits[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+/*
+** Returns the number of times c appears in the line of the mask.
+** c must be one of SPECIAL_CHARS.
+*/
+size_t line_mask_count(const LineMask *mask, char c) {
+    size_t count = 0;
+    for (size_t word = 0; word < mask->words; word++) {
+        uint64_t bits = mask->bits[word];
+        while (bits != 0) {
+            if (mask->line[word * 64 + __builtin_ctzll(bits)] == c) {
+                count++;
+            }
+            bits &= bits - 1;
+        }
+    }
+    return count;
+}
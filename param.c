@@ -0,0 +1,523 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <ctype.h>
+
+/*
+** Parameter expansion works on slices of the expression and of the
+** variable's value: the result is written straight into the caller's
+** buffer, and nothing is copied along the way unless a pattern or a
+** replacement itself uses variables.
+*/
+typedef struct ParameterWriter {
+    char *dest;
+    size_t length;
+    size_t capacity;
+    Variable *variables;
+    ParserContext *context;     // where ${VAR:=word} assigns, or NULL
+} ParameterWriter;
+
+
+/**
+ * Append text to the result of an expansion, truncated to its capacity.
+ *
+ * @param writer The writer of the result.
+ * @param text The text to append.
+ * @param length The number of characters of text.
+ */
+void append_parameter_text(ParameterWriter *writer, const char *text, size_t length) {
+    size_t room = writer->capacity - 1 - writer->length;
+    if (length > room) {
+        length = room;
+    }
+    memcpy(writer->dest + writer->length, text, length);
+    writer->length += length;
+    writer->dest[writer->length] = '\0';
+}
+
+/**
+ * Get the variables to look names up in, which change when ${VAR:=word} assigns.
+ *
+ * @param writer The writer of the result.
+ * @return The head of the variables list.
+ */
+Variable *parameter_variables(const ParameterWriter *writer) {
+    return writer->context != NULL ? writer->context->variables : writer->variables;
+}
+
+/**
+ * Find a variable by a name that is not NUL terminated.
+ *
+ * @param variables The head of the variables list.
+ * @param name The name of the variable.
+ * @param length The number of characters of name.
+ * @return The variable, or NULL if it is not set.
+ */
+Variable *find_parameter(Variable *variables, const char *name, size_t length) {
+    for (Variable *curr = variables; curr != NULL; curr = curr->next) {
+        if (strncmp(curr->name, name, length) == 0 && curr->name[length] == '\0') {
+            return curr;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get the length of the variable name at the start of text.
+ *
+ * @param text The text to read the name from.
+ * @param length The number of characters of text.
+ * @return The number of characters of the name, 0 if there is none.
+ */
+size_t parameter_name_length(const char *text, size_t length) {
+    size_t i = 0;
+    while (i < length && (isalpha((unsigned char) text[i]) || text[i] == '_')) {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Find the '}' that closes a "${", skipping nested ones.
+ *
+ * @param text The text just after the "${".
+ * @param length The number of characters of text.
+ * @return The index of the closing '}', or length if it is missing.
+ */
+size_t closing_brace(const char *text, size_t length) {
+    int depth = 1;
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '{') {
+            depth++;
+        } else if (text[i] == '}' && --depth == 0) {
+            return i;
+        }
+    }
+    return length;
+}
+
+/**
+ * Match one character against a bracket expression like [abc], [a-z] or [!x].
+ *
+ * @param pattern The pattern, at the '['.
+ * @param length The number of characters left in the pattern.
+ * @param c The character to match.
+ * @param matched Set to 1 if c matched, 0 otherwise.
+ * @return The number of characters of the bracket expression, or 0 if it
+ *         is unterminated, in which case '[' is an ordinary character.
+ */
+size_t match_bracket(const char *pattern, size_t length, char c, int *matched) {
+    size_t i = 1;
+    int negated = i < length && (pattern[i] == '!' || pattern[i] == '^');
+    if (negated) {
+        i++;
+    }
+    *matched = 0;
+    // a ']' right after the '[' is part of the set
+    size_t first = i;
+    while (i < length && (pattern[i] != ']' || i == first)) {
+        if (i + 2 < length && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+            if ((unsigned char) pattern[i] <= (unsigned char) c &&
+                (unsigned char) c <= (unsigned char) pattern[i + 2]) {
+                *matched = 1;
+            }
+            i += 3;
+        } else {
+            if (pattern[i] == c) {
+                *matched = 1;
+            }
+            i++;
+        }
+    }
+    if (i >= length) {
+        return 0;
+    }
+    *matched ^= negated;
+    return i + 1;
+}
+
+/*
+** Matches a whole text against a glob pattern, with * ? [...] and '\'
+** escapes. Neither needs to be NUL terminated.
+**
+** Returns 1 if the text matches, 0 otherwise.
+*/
+int glob_match(const char *pattern, size_t pattern_length, const char *text, size_t text_length) {
+    size_t p = 0;
+    size_t t = 0;
+    // where to resume after the last '*', if what follows it fails to match
+    int has_star = 0;
+    size_t star = 0;
+    size_t star_text = 0;
+
+    while (t < text_length) {
+        if (p < pattern_length && pattern[p] == '*') {
+            has_star = 1;
+            star = ++p;
+            star_text = t;
+            continue;
+        }
+        if (p < pattern_length) {
+            int matched;
+            size_t width = 1;
+            if (pattern[p] == '?') {
+                matched = 1;
+            } else if (pattern[p] != '[' ||
+                       (width = match_bracket(pattern + p, pattern_length - p, text[t], &matched)) == 0) {
+                width = 1;
+                if (pattern[p] == '\\' && p + 1 < pattern_length) {
+                    p++;
+                }
+                matched = pattern[p] == text[t];
+            }
+            if (matched) {
+                p += width;
+                t++;
+                continue;
+            }
+        }
+        if (!has_star) {
+            return 0;
+        }
+        // let the last '*' swallow one more character
+        p = star;
+        t = ++star_text;
+    }
+
+    while (p < pattern_length && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern_length;
+}
+
+/**
+ * Expand the variable usages of a word of an expression, such as the
+ * default of ${VAR:-word}, appending the result.
+ *
+ * @param writer The writer to append to.
+ * @param word The word.
+ * @param length The number of characters of word.
+ * @return 0 on success, -1 on a bad substitution, which is reported.
+ */
+int append_parameter_word(ParameterWriter *writer, const char *word, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        const char *dollar = memchr(word + i, VARIABLE_PARSE_MARKER, length - i);
+        size_t literal = dollar == NULL ? length - i : (size_t) (dollar - (word + i));
+        append_parameter_text(writer, word + i, literal);
+        i += literal;
+        if (dollar == NULL) {
+            break;
+        }
+
+        i++;
+        if (i < length && word[i] == '{') {
+            size_t end = i + 1 + closing_brace(word + i + 1, length - i - 1);
+            if (end >= length) {
+                ERR_PRINT(ERR_SUBST_EOF, (int) (length - i + 1), word + i - 1);
+                return -1;
+            }
+            // nested expansions write straight after what is already there
+            ssize_t nested = expand_parameter(word + i + 1, end - i - 1, writer->variables, writer->context,
+                                              writer->dest + writer->length, writer->capacity - writer->length);
+            if (nested < 0) {
+                return -1;
+            }
+            writer->length += nested;
+            i = end + 1;
+        } else {
+            size_t name_length = parameter_name_length(word + i, length - i);
+            Variable *var = find_parameter(parameter_variables(writer), word + i, name_length);
+            if (var != NULL) {
+                append_parameter_text(writer, var->value, strlen(var->value));
+            } else if (name_length == 0) {
+                append_parameter_text(writer, dollar, 1);
+            } else {
+                char name[name_length + 1];
+                memcpy(name, word + i, name_length);
+                name[name_length] = '\0';
+                ERR_PRINT(ERR_VAR_NOT_FOUND, name);
+            }
+            i += name_length;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Get a pattern or a replacement of an expression as a slice, expanding
+ * its variable usages into scratch if it has any.
+ *
+ * @param writer The writer of the result, for the variables.
+ * @param word The word.
+ * @param length The number of characters of word, updated to the expanded length.
+ * @param scratch A buffer of MAX_SINGLE_LINE characters, used only if needed.
+ * @return The start of the slice, or NULL on a bad substitution, which is reported.
+ */
+const char *parameter_slice(const ParameterWriter *writer, const char *word, size_t *length, char *scratch) {
+    if (memchr(word, VARIABLE_PARSE_MARKER, *length) == NULL) {
+        return word;
+    }
+    ParameterWriter expanded = {scratch, 0, MAX_SINGLE_LINE, writer->variables, writer->context};
+    scratch[0] = '\0';
+    if (append_parameter_word(&expanded, word, *length) < 0) {
+        return NULL;
+    }
+    *length = expanded.length;
+    return scratch;
+}
+
+/**
+ * Evaluate an offset or a length of ${VAR:offset:length}, which are
+ * arithmetic expressions.
+ *
+ * @param writer The writer of the result, for the variables.
+ * @param text The text of the expression.
+ * @param length The number of characters of text.
+ * @param value Set to the value of the expression.
+ * @return 0 on success, -1 if the expression is bad, which is reported.
+ */
+int parameter_number(const ParameterWriter *writer, const char *text, size_t length, long *value) {
+    char expression[length + 1];
+    memcpy(expression, text, length);
+    expression[length] = '\0';
+    return evaluate_arithmetic(expression, parameter_variables(writer), value);
+}
+
+/**
+ * Find the first occurrence of a character that is not escaped with '\'.
+ *
+ * @param text The text to search.
+ * @param length The number of characters of text.
+ * @param c The character to find.
+ * @return The occurrence of c, or NULL if there is none.
+ */
+const char *find_unescaped(const char *text, size_t length, char c) {
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '\\') {
+            i++;
+        } else if (text[i] == c) {
+            return text + i;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the shortest or longest prefix or suffix of a value matching a pattern.
+ *
+ * @param pattern The pattern.
+ * @param pattern_length The number of characters of pattern.
+ * @param value The value.
+ * @param value_length The number of characters of value.
+ * @param suffix 1 to match a suffix, 0 to match a prefix.
+ * @param longest 1 for the longest match, 0 for the shortest.
+ * @return The number of characters matched, 0 if there is no match.
+ */
+size_t match_affix(const char *pattern, size_t pattern_length, const char *value, size_t value_length,
+                   int suffix, int longest) {
+    for (size_t i = 0; i <= value_length; i++) {
+        size_t size = longest ? value_length - i : i;
+        const char *start = suffix ? value + value_length - size : value;
+        if (glob_match(pattern, pattern_length, start, size)) {
+            return size;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Append a value with the first, or every, longest match of a pattern replaced.
+ *
+ * @param writer The writer to append to.
+ * @param value The value.
+ * @param value_length The number of characters of value.
+ * @param pattern The pattern; empty matches are never replaced.
+ * @param pattern_length The number of characters of pattern.
+ * @param replacement The replacement.
+ * @param replacement_length The number of characters of replacement.
+ * @param every 1 to replace every match, 0 for the first only.
+ */
+void append_replaced(ParameterWriter *writer, const char *value, size_t value_length,
+                     const char *pattern, size_t pattern_length,
+                     const char *replacement, size_t replacement_length, int every) {
+    size_t copied = 0;
+    size_t i = 0;
+    while (i < value_length) {
+        size_t end = value_length;
+        while (end > i && !glob_match(pattern, pattern_length, value + i, end - i)) {
+            end--;
+        }
+        if (end == i) {
+            i++;
+            continue;
+        }
+        append_parameter_text(writer, value + copied, i - copied);
+        append_parameter_text(writer, replacement, replacement_length);
+        copied = i = end;
+        if (!every) {
+            break;
+        }
+    }
+    append_parameter_text(writer, value + copied, value_length - copied);
+}
+
+/*
+** Expands the expression of a "${expression}", without its braces, into
+** dest, which has room for capacity characters, and NUL terminates it:
+**
+**   ${VAR}          the value of VAR
+**   ${#VAR}         the number of characters of VAR
+**   ${VAR:-word}    word if VAR is unset or empty, ${VAR-word} if unset
+**   ${VAR:=word}    the same, also assigning word to VAR through context
+**   ${VAR#pat}      VAR without the shortest prefix matching pat, ## the longest
+**   ${VAR%pat}      VAR without the shortest suffix matching pat, %% the longest
+**   ${VAR/pat/rep}  VAR with the first longest match of pat replaced, // every one
+**   ${VAR:off:len}  len characters of VAR from off; negatives count from the end,
+**                   and both are arithmetic expressions
+**
+** Patterns are globs, see glob_match. Words, patterns and replacements
+** may use variables themselves. If context is NULL, ${VAR:=word} does
+** not assign. The result is truncated to fit dest.
+**
+** Returns the length of the result, or -1 on a bad substitution.
+*/
+ssize_t expand_parameter(const char *expression, size_t length, Variable *variables,
+                         ParserContext *context, char *dest, size_t capacity) {
+    ParameterWriter writer = {dest, 0, capacity, variables, context};
+    dest[0] = '\0';
+
+    uint8_t count = length > 1 && expression[0] == '#';
+    const char *name = expression + count;
+    size_t name_length = parameter_name_length(name, length - count);
+    if (name_length == 0) {
+        ERR_PRINT(ERR_BAD_SUBST, (int) length, expression);
+        return -1;
+    }
+    const char *op = name + name_length;
+    size_t op_length = expression + length - op;
+    Variable *var = find_parameter(parameter_variables(&writer), name, name_length);
+    const char *value = var != NULL ? var->value : "";
+    size_t value_length = strlen(value);
+
+    // ${VAR:-word} and ${VAR:=word}, also without the ':'
+    uint8_t colon = op_length > 0 && op[0] == ':';
+    if (!count && op_length > colon && (op[colon] == '-' || op[colon] == '=')) {
+        if (var != NULL && (!colon || value_length > 0)) {
+            append_parameter_text(&writer, value, value_length);
+            return writer.length;
+        }
+        if (append_parameter_word(&writer, op + colon + 1, op_length - colon - 1) < 0) {
+            return -1;
+        }
+        if (op[colon] == '=' && context != NULL) {
+            char var_name[name_length + 1];
+            memcpy(var_name, name, name_length);
+            var_name[name_length] = '\0';
+            add_variable_r(context, var_name, dest);
+        }
+        return writer.length;
+    }
+
+    if (count ? op_length > 0 : op_length > 0 && strchr(":#%/", op[0]) == NULL) {
+        ERR_PRINT(ERR_BAD_SUBST, (int) length, expression);
+        return -1;
+    }
+    if (var == NULL) {
+        char var_name[name_length + 1];
+        memcpy(var_name, name, name_length);
+        var_name[name_length] = '\0';
+        ERR_PRINT(ERR_VAR_NOT_FOUND, var_name);
+    }
+
+    if (count) {
+        char digits[32];
+        append_parameter_text(&writer, digits, snprintf(digits, sizeof(digits), "%zu", value_length));
+        return writer.length;
+    }
+    if (op_length == 0) {
+        append_parameter_text(&writer, value, value_length);
+        return writer.length;
+    }
+
+    char pattern_scratch[MAX_SINGLE_LINE];
+    if (op[0] == '#' || op[0] == '%') {
+        uint8_t longest = op_length > 1 && op[1] == op[0];
+        size_t pattern_length = op_length - 1 - longest;
+        const char *pattern = parameter_slice(&writer, op + 1 + longest, &pattern_length, pattern_scratch);
+        if (pattern == NULL) {
+            return -1;
+        }
+        size_t matched = match_affix(pattern, pattern_length, value, value_length, op[0] == '%', longest);
+        append_parameter_text(&writer, op[0] == '#' ? value + matched : value, value_length - matched);
+        return writer.length;
+    }
+
+    if (op[0] == '/') {
+        uint8_t every = op_length > 1 && op[1] == '/';
+        const char *pattern_start = op + 1 + every;
+        const char *slash = find_unescaped(pattern_start, op + op_length - pattern_start, '/');
+        size_t pattern_length = (slash != NULL ? slash : op + op_length) - pattern_start;
+        size_t replacement_length = slash != NULL ? (size_t) (op + op_length - slash - 1) : 0;
+
+        char replacement_scratch[MAX_SINGLE_LINE];
+        const char *pattern = parameter_slice(&writer, pattern_start, &pattern_length, pattern_scratch);
+        const char *replacement = slash == NULL ? "" :
+            parameter_slice(&writer, slash + 1, &replacement_length, replacement_scratch);
+        if (pattern == NULL || replacement == NULL) {
+            return -1;
+        }
+        if (pattern_length == 0) {
+            append_parameter_text(&writer, value, value_length);
+        } else {
+            append_replaced(&writer, value, value_length, pattern, pattern_length,
+                            replacement, replacement_length, every);
+        }
+        return writer.length;
+    }
+
+    // ${VAR:off} and ${VAR:off:len}
+    const char *offset_end = memchr(op + 1, ':', op_length - 1);
+    long offset;
+    long size = value_length;
+    if (parameter_number(&writer, op + 1, (offset_end != NULL ? offset_end : op + op_length) - (op + 1),
+                         &offset) < 0 ||
+        (offset_end != NULL &&
+         parameter_number(&writer, offset_end + 1, op + op_length - offset_end - 1, &size) < 0)) {
+        return -1;
+    }
+    if (offset < 0) {
+        offset += value_length;
+    }
+    if (offset < 0 || offset > (long) value_length) {
+        return writer.length;
+    }
+    long end = size < 0 ? (long) value_length + size : offset + size;
+    if (end > (long) value_length) {
+        end = value_length;
+    }
+    if (end > offset) {
+        append_parameter_text(&writer, value + offset, end - offset);
+    }
+    return writer.length;
+}
+
+/*
+** Tells whether a line uses ${...} with anything more than a name, which
+** must be expanded before the line is split into commands.
+*/
+int has_parameter_operators(const char *line) {
+    const char *start = line;
+    while ((start = strstr(start, "${")) != NULL) {
+        start += 2;
+        size_t name_length = parameter_name_length(start, strlen(start));
+        if (start[name_length] != '}') {
+            return 1;
+        }
+        start += name_length;
+    }
+    return 0;
+}
@@ -8,6 +8,9 @@
 
 #define CONTINUE_SEARCH NULL
 
+// Nothing in this file keeps state between calls: everything a parse needs
+// comes in through its ParserContext, so it is built into libcscparse too.
+
 // TODO: ADD ERRORS FOR FAILING MALLOCS ETC.
 // TODO: FIX SEG FAULTS
 
@@ -18,10 +21,6 @@ char *resolve_executable(const char *command_name, Variable *path){
         return NULL;
     }
 
-    if (strcmp(command_name, CD) == 0){
-        return strdup(CD);
-    }
-
     if (strcmp(path->name, PATH_VAR_NAME) != 0){
         ERR_PRINT(ERR_NOT_PATH);
         return NULL;
@@ -44,7 +43,8 @@ char *resolve_executable(const char *command_name, Variable *path){
         perror("resolve_executable");
         return NULL;
     }
-    char *current_path = strtok(path_to_toke, ":");
+    char *save_ptr;
+    char *current_path = strtok_r(path_to_toke, ":", &save_ptr);
 
     do {
         DIR *dir = opendir(current_path);
@@ -88,13 +88,50 @@ char *resolve_executable(const char *command_name, Variable *path){
         // if this isn't null, stop checking paths
         if (possible_file) break;
 
-    } while ((current_path = strtok(CONTINUE_SEARCH, ":")));
+    } while ((current_path = strtok_r(CONTINUE_SEARCH, ":", &save_ptr)));
 
     res_ex_cleanup:
     free(path_to_toke);
     return exec_path;
 }
 
+/**
+ * Resolve the executable of a command through the hooks of a parser context.
+ *
+ * Builtins resolve to their own name, and PATH lookups go through the
+ * context's cache, if it has one, before resolve_executable is called.
+ * Misses are cached as well as hits.
+ *
+ * @param context The parser context, whose variables start with PATH.
+ * @param command_name The name of the command to resolve.
+ * @return A heap string with the path of the executable, or NULL if none was found.
+ */
+char *resolve_command(const ParserContext *context, const char *command_name) {
+    Variable *path = context->variables;
+    if (command_name == NULL || path == NULL) {
+        return NULL;
+    }
+
+    if (context->is_builtin != NULL && context->is_builtin(command_name)){
+        return strdup(command_name);
+    }
+
+    int cacheable = strchr(command_name, '/') == NULL &&
+                    strcmp(path->name, PATH_VAR_NAME) == 0;
+    char *exec_path;
+    if (cacheable && context->path_lookup != NULL &&
+        (exec_path = context->path_lookup(command_name, path->value)) != NULL){
+        // (char *) -1 if the command is known not to be on the PATH
+        return exec_path == (char *) -1 ? NULL : exec_path;
+    }
+
+    exec_path = resolve_executable(command_name, path);
+    if (cacheable && context->path_insert != NULL){
+        context->path_insert(command_name, exec_path, path->value);
+    }
+    return exec_path;
+}
+
 
 // Whitespace trimmer functions
 /**
@@ -123,7 +160,7 @@ void trim_whitespace_leading(char **line) {
  */
 void trim_whitespace_ending(char *line) {
     int i = strlen(line) - 1;
-    while (line[i] == ' ') {
+    while (i >= 0 && line[i] == ' ') {
         i--;
     }
     line[i + 1] = '\0';
@@ -131,18 +168,15 @@ void trim_whitespace_ending(char *line) {
 
 
 // HELPERS FOR VARIABLE ASSIGNMENT
-/**
- * Add or update a variable in a linked list of variables.
- *
- * If the variable with the given name already exists in the list, its value will be updated.
- * If the variable does not exist, a new variable will be added to the list of variables **variables.
- *
- * @param name The name of the variable to add or update.
- * @param value The value of the variable.
- * @param variables Pointer to a pointer to the head of the linked list of variables.
- *                  This pointer will be updated if a new variable is added to the list.
- */
-void add_variable(const char *name, const char *value, Variable **variables) {
+/*
+** Adds a variable to the variables of a parser context, or updates it if
+** it already exists, and bumps the generation of the context.
+** PATH is always kept at the head of the list.
+*/
+void add_variable_r(ParserContext *context, const char *name, const char *value) {
+    Variable **variables = &context->variables;
+    context->generation++;
+
     // IF we encounter a variable name which already exists
     Variable *curr_var = variables[0];
     while (curr_var != NULL) {
@@ -188,84 +222,126 @@ void add_variable(const char *name, const char *value, Variable **variables) {
     }
 }
 
+/*
+** Sets up a parser context for a variables list, with no builtins and
+** no PATH cache.
+*/
+void init_parser_context(ParserContext *context, Variable *variables) {
+    context->variables = variables;
+    context->generation = 0;
+    context->is_builtin = NULL;
+    context->path_lookup = NULL;
+    context->path_insert = NULL;
+}
+
 // HELPERS FOR COMMANDS
 /**
- * Return the number of pipe characters '|' in the given string.
+ * Return the number of pipe characters '|' in a classified line.
  *
- * @param line The string to search for pipe characters.
- * @return The number of pipe characters '|' found in the string.
+ * @param mask The special characters of the line, see classify_line.
+ * @return The number of pipe characters '|' found in the line.
  */
-int num_pipes(const char *line) {
-    int length = strlen(line);
-    int num_pipes = 0;
+int num_pipes(const LineMask *mask) {
+    return line_mask_count(mask, '|');
+}
 
-    for (int i = 0; i < length; i++) {
-        if (line[i] == '|') {
-            num_pipes++;
-        }
+/**
+ * Copy part of a classified line into a buffer, without its leading and
+ * trailing spaces, which are found through the mask.
+ *
+ * @param dest The buffer to copy into, MAX_SINGLE_LINE bytes long.
+ * @param mask The special characters of the line, see classify_line.
+ * @param from The index of the part to copy.
+ * @param length The length of the part to copy.
+ * @return The index in the line of the first character copied.
+ */
+size_t copy_trimmed(char *dest, const LineMask *mask, size_t from, size_t length) {
+    size_t end = from + length;
+    size_t start = line_mask_skip(mask, from, ' ');
+    start = start < end ? start : end;
+    end = line_mask_skip_back(mask, end, ' ');
+    end = end > start ? end : start;
+    if (end - start >= MAX_SINGLE_LINE) {
+        end = start + MAX_SINGLE_LINE - 1;
     }
-    return num_pipes;
+    memcpy(dest, mask->line + start, end - start);
+    dest[end - start] = '\0';
+    return start;
+}
+
+/**
+ * Copy part of a classified line as copy_trimmed does, along with the mask
+ * of the copy.
+ *
+ * @param dest The buffer to copy into, MAX_SINGLE_LINE bytes long.
+ * @param mask The special characters of the line, see classify_line.
+ * @param from The index of the part to copy.
+ * @param length The length of the part to copy.
+ * @param slice Set to the special characters of dest, see line_mask_slice.
+ */
+void copy_trimmed_mask(char *dest, const LineMask *mask, size_t from, size_t length, LineMask *slice) {
+    size_t start = copy_trimmed(dest, mask, from, length);
+    line_mask_slice(mask, start, strlen(dest), dest, slice);
+}
+
+/**
+ * Classify a line without its leading and trailing spaces, which are found
+ * through the mask of the whole line rather than by scanning it again.
+ *
+ * @param line The line, cut short in place after its last non-space.
+ * @param mask Set to the special characters of the trimmed line.
+ * @return The first non-space character of the line.
+ */
+char *classify_trimmed(char *line, LineMask *mask) {
+    classify_line(line, strlen(line), mask);
+    size_t start = line_mask_skip(mask, 0, ' ');
+    size_t end = line_mask_skip_back(mask, mask->length, ' ');
+    end = end > start ? end : start;
+    line[end] = '\0';
+    line_mask_erase(mask, end, mask->length - end);
+    line_mask_erase(mask, 0, start);
+    mask->line = line + start;
+    return line + start;
 }
 
 /**
  * Split a command line into separate subcommands separated by pipe ('|') characters.
  *
- * This function parses a command line `line`, separating it into individual subcommands
+ * This function parses a classified command line, separating it into individual subcommands
  * based on the number of pipe characters (`|`) present. It allocates memory dynamically
  * for an array of strings to store each subcommand.
  *
- * @param line The line to be split into subcommands.
+ * @param mask The special characters of the line to be split, see classify_line.
  * @param num_pipes The number of pipe characters ('|') in the command line, which indicates
  *                  the number of subcommands.
+ * @param offsets Filled with the index in the line of each subcommand, for its mask.
  * @return An array of strings, each containing a separate subcommand from the command line.
  *         The caller is responsible for freeing the memory allocated for the array and its elements.
  */
-char **return_pipe_subcommands(char *line, int num_pipes) {
+char **return_pipe_subcommands(const LineMask *mask, int num_pipes, size_t *offsets) {
     int num_subcommands = num_pipes + 1;
     char **subcommands = malloc( num_subcommands * sizeof(char *));
-    for (int i = 0; i < num_subcommands; i++) {
-        subcommands[i] = malloc(MAX_SINGLE_LINE * sizeof(char));
-    }
+    // subcommands only ever shrink, so each is kept in just the space it needs
+    char subcommand[MAX_SINGLE_LINE];
 
-    char *line_copy = strdup(line);
-    char *line_begin = line_copy;
+    // Only the pipes of the mask are visited, a trailing pipe is kept in the last subcommand
+    size_t start = 0;
+    size_t pipe_index;
     int i = 0;
-    int length;
-    while((line_copy = strchr(line_copy, '|')) != NULL && strlen(line_copy) > 1) {
-        length = line_copy - line_begin;
-        char subcommand[length + 1];
-        memcpy(subcommand, line_begin, length);
-        subcommand[length] = '\0';
-
-        char *subcommand_ptr = malloc(sizeof(char) * (length + 1));
-        char *subcommand_ptr_beginning = subcommand_ptr;
-        memset(subcommand_ptr, '\0', sizeof(char) * (length + 1));
-        strcpy(subcommand_ptr, subcommand);
-        trim_whitespace_leading(&subcommand_ptr);
-        trim_whitespace_ending(subcommand_ptr);
-
-        strcpy(subcommands[i], subcommand_ptr);
-
-        free(subcommand_ptr_beginning);
+    while ((pipe_index = line_mask_find(mask, start, '|')) + 1 < mask->length) {
+        offsets[i] = copy_trimmed(subcommand, mask, start, pipe_index - start);
+        subcommands[i] = strdup(subcommand);
         i++;
-        line_copy++;
-        line_begin = line_copy;
+        start = pipe_index + 1;
+    }
+    offsets[i] = copy_trimmed(subcommand, mask, start, mask->length - start);
+    subcommands[i] = strdup(subcommand);
+    // the subcommand after a trailing pipe is empty
+    while (++i < num_subcommands) {
+        offsets[i] = mask->length;
+        subcommands[i] = strdup("");
     }
 
-    length = strlen(line_begin);
-    char subcommand[length + 1];
-    memcpy(subcommand, line_begin, length);
-    subcommand[length] = '\0';
-
-    char *subcommand_ptr = malloc(sizeof(char) * (length + 1));
-    char *subcommand_ptr_beginning = subcommand_ptr;
-    memset(subcommand_ptr, '\0', sizeof(char) * (length + 1));
-    strcpy(subcommand_ptr, subcommand);
-    trim_whitespace_leading(&subcommand_ptr);
-    trim_whitespace_ending(subcommand_ptr);
-
-    strcpy(subcommands[i], subcommand_ptr);
-    free(subcommand_ptr_beginning);
     return subcommands;
 }
 
@@ -276,238 +352,207 @@ typedef struct RedirectionCommand {
     uint8_t redir_append;
 }RedirectionCommand;
 
+/**
+ * Copy part of a classified pipe subcommand, without the spaces at either
+ * end that are asked to be left out.
+ *
+ * @param mask The special characters of the pipe subcommand.
+ * @param from The index of the part to copy.
+ * @param end The index just past the part to copy.
+ * @param trim_leading Non-zero to leave out its leading spaces.
+ * @param trim_ending Non-zero to leave out its trailing spaces.
+ * @return The copy, to be freed by the caller.
+ */
+char *copy_redirection_part(const LineMask *mask, size_t from, size_t end, int trim_leading, int trim_ending) {
+    if (trim_leading) {
+        from = line_mask_skip(mask, from, ' ');
+        from = from < end ? from : end;
+    }
+    if (trim_ending) {
+        end = line_mask_skip_back(mask, end, ' ');
+        end = end > from ? end : from;
+    }
+    return strndup(mask->line + from, end - from);
+}
+
+/**
+ * Find the first ">>" in a classified pipe subcommand.
+ *
+ * @param mask The special characters of the pipe subcommand.
+ * @return The index of the first '>' of the first ">>", or mask->length.
+ */
+size_t find_append(const LineMask *mask) {
+    for (size_t i = line_mask_find(mask, 0, '>'); i < mask->length; i = line_mask_find(mask, i + 1, '>')) {
+        if (mask->line[i + 1] == '>') {
+            return i;
+        }
+    }
+    return mask->length;
+}
+
 /**
  * Parse a pipe subcommand string and return a RedirectionCommand struct.
  *
  * This function parses a pipe subcommand string to extract command with arguments,
- * input and output redirection paths, and append flag if present.
+ * input and output redirection paths, and append flag if present. The first '<'
+ * and '>' are the redirections, but when there are both a ">>" anywhere wins
+ * over an earlier '>'.
  *
- * @param pipe_subcommand The pipe subcommand string to parse.
+ * @param mask The special characters of the pipe subcommand, see classify_line.
  * @return A pointer to a RedirectionCommand structure containing parsed information.
  *         Memory is allocated dynamically for the structure and its members.
  *         Returns NULL if memory allocation fails or if the input is invalid.
  */
-RedirectionCommand *return_redirection_command(char *pipe_subcommand) {
-    char *pipe_subcommand_copy = strdup(pipe_subcommand);
+RedirectionCommand *return_redirection_command(const LineMask *mask) {
     RedirectionCommand *command = malloc(sizeof(RedirectionCommand));
+    size_t length = mask->length;
+    size_t in = line_mask_find(mask, 0, '<');
+    size_t out = line_mask_find(mask, 0, '>');
+    command->redir_in_path = NULL;
+    command->redir_out_path = NULL;
+    command->redir_append = 0;
+
+    if (in == length && out == length) {
+        command->command_with_args = strndup(mask->line, length);
+        return command;
+    }
+    if (in < length && out < length) {
+        size_t append = find_append(mask);
+        out = append < length ? append : out;
+    }
+    size_t out_path = out;
+    if (out < length) {
+        command->redir_append = mask->line[out + 1] == '>';
+        out_path = out + 1 + command->redir_append;
+    }
 
-    if (strchr(pipe_subcommand_copy, '>') == NULL && strchr(pipe_subcommand_copy, '<') == NULL) {
-        command->command_with_args = strdup(pipe_subcommand_copy);
-        command->redir_in_path = NULL;
-        command->redir_out_path = NULL;
-        command->redir_append = 0;
-    } else if (strchr(pipe_subcommand_copy, '<') == NULL && strchr(pipe_subcommand_copy, '>') != NULL) {
-        char *redir_out_ptr = strchr(pipe_subcommand_copy, '>');
-        if (*(redir_out_ptr + 1) == '>') {
-            // Append to OUT Path Redirection
-
-            // Handling Command with Args
-            char *redir_append = strstr(pipe_subcommand_copy, ">>");
-            int length_command_with_args = redir_append - pipe_subcommand_copy;
-            char *command_with_args = malloc(sizeof(char) * (length_command_with_args + 1));
-            char *command_with_args_beginning = command_with_args;
-            memcpy(command_with_args, pipe_subcommand_copy, length_command_with_args);
-            command_with_args[length_command_with_args] = '\0';
-            trim_whitespace_ending(command_with_args);
-            redir_append += 2;
-            command->command_with_args = strdup(command_with_args);
-            free(command_with_args_beginning);
-
-            // Handling Path
-            char *redir_out_path = malloc(sizeof(char) * (strlen(redir_append) + 1));
-            char *original_redir_out_path = redir_out_path;
-            int length = strlen(redir_append);
-            memcpy(redir_out_path, redir_append, length);
-            redir_out_path[length] = '\0';
-            trim_whitespace_leading(&redir_out_path);
-            command->redir_out_path = strdup(redir_out_path);
-            free(original_redir_out_path);
-
-            // Complete Command
-            command->redir_in_path = NULL;
-            command->redir_append = 1;
-        } else {
-            // Write OUT to New Path Redirection
-
-            // Handling Command With Args
-            int length_command_with_args = redir_out_ptr - pipe_subcommand_copy;
-            char *command_with_args = malloc(sizeof(char) * (length_command_with_args + 1));
-            char *command_with_args_beginning = command_with_args;
-            memcpy(command_with_args, pipe_subcommand_copy, length_command_with_args);
-            command_with_args[length_command_with_args] = '\0';
-            trim_whitespace_ending(command_with_args);
-            redir_out_ptr++;
-            command->command_with_args = strdup(command_with_args);
-            free(command_with_args_beginning);
-
-            // Handling Path
-            char *redir_out_path = malloc(sizeof(char) * (strlen(redir_out_ptr) + 1));
-            char *redir_out_path_beginning = redir_out_path;
-            int length = strlen(redir_out_ptr);
-            memcpy(redir_out_path, redir_out_ptr, length);
-            redir_out_path[length] = '\0';
-            trim_whitespace_leading(&redir_out_path);
-            command->redir_out_path = strdup(redir_out_path);
-            free(redir_out_path_beginning);
-
-            // Complete Command
-            command->redir_in_path = NULL;
-            command->redir_append = 0;
-        }
-    } else if (strchr(pipe_subcommand_copy, '<') != NULL && strchr(pipe_subcommand_copy, '>') == NULL) {
-        char *redir_in_ptr = strchr(pipe_subcommand_copy, '<');
-        // Read IN From Path
-
-        // Handling Command With Args
-        int length_command_with_args = redir_in_ptr - pipe_subcommand_copy;
-        char *command_with_args = malloc(sizeof(char) * (length_command_with_args + 1));
-        char *command_with_args_beginning = command_with_args;
-        memcpy(command_with_args, pipe_subcommand_copy, length_command_with_args);
-        command_with_args[length_command_with_args] = '\0';
-        trim_whitespace_ending(command_with_args);
-        redir_in_ptr++;
-        command->command_with_args = strdup(command_with_args);
-        free(command_with_args_beginning);
-
-        // Handling Path
-        char *redir_in_path = malloc(sizeof(char) * (strlen(redir_in_ptr) + 1));
-        char *redir_in_path_beginning = redir_in_path;
-        int length = strlen(redir_in_ptr);
-        memcpy(redir_in_path, redir_in_ptr, length);
-        redir_in_path[length] = '\0';
-        trim_whitespace_leading(&redir_in_path);
-        command->redir_in_path = strdup(redir_in_path);
-        free(redir_in_path_beginning);
-
-        // Complete Command
-        command->redir_out_path = NULL;
-        command->redir_append = 0;
+    command->command_with_args = copy_redirection_part(mask, 0, in < out ? in : out, 0, 1);
+    if (out == length) {
+        command->redir_in_path = copy_redirection_part(mask, in + 1, length, 1, 0);
+    } else if (in == length) {
+        command->redir_out_path = copy_redirection_part(mask, out_path, length, 1, 0);
+    } else if (in < out) {
+        command->redir_in_path = copy_redirection_part(mask, in + 1, out, 1, 1);
+        command->redir_out_path = copy_redirection_part(mask, out_path, length, 1, 0);
     } else {
-        int append_out_flag = 0;
-        if (strstr(pipe_subcommand_copy, ">>") != NULL) {
-            // Accounts for appending out redirection + inward redirection
-            append_out_flag = 1;
+        command->redir_out_path = copy_redirection_part(mask, out_path, in, 1, 1);
+        command->redir_in_path = copy_redirection_part(mask, in + 1, length, 1, 0);
+    }
+    return command;
+}
+
+/**
+ * Parse a numbered redirection at the start of a word: "N<path", "N>path",
+ * "N>>path", "N>&M" or "N>&-", where the path may also be the next word.
+ * ">&M" and "<&M" are the same as "1>&M" and "0<&M".
+ *
+ * @param word The word.
+ * @param redirection The redirection to fill in.
+ * @return Pointer just past the redirection, NULL if the word is not a numbered
+ *         redirection, or (char *) -1 if it has no path or a bad descriptor.
+ */
+char *parse_fd_redirection(char *word, FdRedirection *redirection) {
+    char *op = word;
+    if (isdigit((unsigned char) word[0]) && (word[1] == '<' || word[1] == '>')) {
+        redirection->fd = word[0] - '0';
+        op = word + 1;
+    } else if ((word[0] == '<' || word[0] == '>') && word[1] == '&') {
+        redirection->fd = word[0] == '<' ? STDIN_FILENO : STDOUT_FILENO;
+    } else {
+        return NULL;
+    }
+
+    uint8_t append = op[0] == '>' && op[1] == '>';
+    redirection->flags = op[0] == '<' ? O_RDONLY : O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+    redirection->source_fd = -1;
+    redirection->path = NULL;
+    redirection->opened_fd = -1;
+    redirection->next = NULL;
+    char *rest = op + 1 + append;
+
+    if (*rest == '&') {
+        if (rest[1] == '-') {
+            redirection->source_fd = FD_CLOSE;
+        } else if (isdigit((unsigned char) rest[1])) {
+            redirection->source_fd = rest[1] - '0';
+        }
+        if (redirection->source_fd == -1 || (rest[2] != ' ' && rest[2] != '\0')) {
+            return (char *) -1;
         }
+        return rest + 2;
+    }
 
-        char *redir_out_ptr;
-        if (append_out_flag == 1) {
-            redir_out_ptr = strstr(pipe_subcommand_copy, ">>");
-            command->redir_append = 1;
-        } else {
-            // append_out_flag == 0
-            redir_out_ptr = strchr(pipe_subcommand_copy, '>');
-            command->redir_append = 0;
-        }
-
-        char *redir_in_ptr = strchr(pipe_subcommand_copy, '<');
-
-        if (redir_in_ptr < redir_out_ptr) {
-            // First Split on redir_in_ptr (Handling Command With Args)
-            int length_command_with_args = redir_in_ptr - pipe_subcommand_copy;
-            char *command_with_args = malloc(sizeof(char) * (length_command_with_args + 1));
-            char *command_with_args_beginning = command_with_args;
-            memcpy(command_with_args, pipe_subcommand_copy, length_command_with_args);
-            command_with_args[length_command_with_args] = '\0';
-            trim_whitespace_ending(command_with_args);
-            redir_in_ptr++;
-            command->command_with_args = strdup(command_with_args);
-            free(command_with_args_beginning);
-
-            // Handling remaining command
-            char *redir_in_path = malloc(sizeof(char) * (strlen(redir_in_ptr) + 1));
-            char *redir_in_path_beginning = redir_in_path;
-            int length = strlen(redir_in_ptr);
-            memcpy(redir_in_path, redir_in_ptr, length);
-            redir_in_path[length] = '\0';
-            trim_whitespace_leading(&redir_in_path);
-
-            // Second Split on redir_out_ptr (Handling redir_in_path)
-            char *redir_out_path_in_substr;
-            if (append_out_flag == 1) {
-                redir_out_path_in_substr = strstr(redir_in_path, ">>");
-                command->redir_append = 1;
-            } else {
-                redir_out_path_in_substr = strchr(redir_in_path, '>');
-                command->redir_append = 0;
-            }
+    if (*rest == ' ' || *rest == '\0') {
+        rest += strspn(rest, " ");
+    }
+    size_t length = strcspn(rest, " ");
+    if (length == 0) {
+        return (char *) -1;
+    }
+    redirection->path = strndup(rest, length);
+    return rest + length;
+}
 
-            length = redir_out_path_in_substr - redir_in_path;
-            char *command_with_args_in_path = malloc(sizeof(char) * (length + 1));
-            char *command_with_args_in_path_beginning = command_with_args_in_path;
-            memcpy(command_with_args_in_path, redir_in_path, length);
-            command_with_args_in_path[length] = '\0';
-            trim_whitespace_ending(command_with_args_in_path);
-            command->redir_in_path = strdup(command_with_args_in_path);
-            free(command_with_args_in_path_beginning);
-
-            if (append_out_flag == 1) {
-                redir_out_path_in_substr += 2;
-            } else {
-                redir_out_path_in_substr++;
-            }
+/**
+ * Free a list of numbered redirections.
+ *
+ * @param redirection The first redirection of the list.
+ */
+void free_fd_redirections(FdRedirection *redirection) {
+    while (redirection != NULL) {
+        FdRedirection *next = redirection->next;
+        free(redirection->path);
+        free(redirection);
+        redirection = next;
+    }
+}
 
-            // Path of the second Split (Handling redir_out_path)
-            length = strlen(redir_out_path_in_substr);
-            char *redir_out_path = malloc(sizeof(char) * (length + 1));
-            char *redir_out_path_beginning = redir_out_path;
-            memcpy(redir_out_path, redir_out_path_in_substr, length);
-            redir_out_path[length] = '\0';
-            trim_whitespace_leading(&redir_out_path);
-            command->redir_out_path = strdup(redir_out_path);
-            free(redir_out_path_beginning);
-            free(redir_in_path_beginning);
-        } else {
-            // First Split on redir_out_ptr (Handling Command With Args)
-            int length_command_with_args = redir_out_ptr - pipe_subcommand_copy;
-            char *command_with_args = malloc(sizeof(char) * (length_command_with_args + 1));
-            char *command_with_args_beginning = command_with_args;
-            memcpy(command_with_args, pipe_subcommand_copy, length_command_with_args);
-            command_with_args[length_command_with_args] = '\0';
-            trim_whitespace_ending(command_with_args);
-            if (append_out_flag == 1) {
-                redir_out_ptr += 2;
-                command->redir_append = 1;
-            } else {
-                redir_out_ptr++;
-                command->redir_append = 0;
-            }
-            command->command_with_args = strdup(command_with_args);
-            free(command_with_args_beginning);
-
-            // Handling remaining command
-            char *redir_out_path = malloc(sizeof(char) * (strlen(redir_out_ptr) + 1));
-            char *redir_out_path_beginning = redir_out_path;
-            int length = strlen(redir_out_ptr);
-            memcpy(redir_out_path, redir_out_ptr, length);
-            redir_out_path[length] = '\0';
-            trim_whitespace_leading(&redir_out_path);
-
-            // Second Split on redir_in_ptr (Handling redir_out_path)
-            char *redir_in_path_in_substr = strchr(redir_out_path, '<');
-            length = redir_in_path_in_substr - redir_out_path;
-            char *command_with_args_in_path = malloc(sizeof(char) * (length + 1));
-            char *command_with_args_in_path_beginning = command_with_args_in_path;
-            memcpy(command_with_args_in_path, redir_out_path, length);
-            command_with_args_in_path[length] = '\0';
-            trim_whitespace_ending(command_with_args_in_path);
-            command->redir_out_path = strdup(command_with_args_in_path);
-            free(command_with_args_in_path_beginning);
-            redir_in_path_in_substr++;
-
-            // Path of the second Split (Handling redir_in_path)
-            length = strlen(redir_in_path_in_substr);
-            char *redir_in_path = malloc(sizeof(char) * (length + 1));
-            char *redir_in_path_beginning = redir_in_path;
-            memcpy(redir_in_path, redir_in_path_in_substr, length);
-            redir_in_path[length] = '\0';
-            trim_whitespace_leading(&redir_in_path);
-            command->redir_in_path = strdup(redir_in_path);
-            free(redir_in_path_beginning);
-            free(redir_out_path_beginning);
+/**
+ * Take the numbered redirections out of a pipe subcommand, see
+ * parse_fd_redirection, leaving the rest of it to return_redirection_command.
+ *
+ * @param pipe_subcommand The trimmed pipe subcommand, modified in place.
+ * @param mask The special characters of the pipe subcommand, kept in step with it.
+ * @return The redirections, in the order they are written, NULL if there are
+ *         none, or (FdRedirection *) -1 if any is malformed.
+ */
+FdRedirection *take_fd_redirections(char *pipe_subcommand, LineMask *mask) {
+    FdRedirection *head = NULL;
+    FdRedirection **tail = &head;
+    size_t spaces = 0;
+
+    while (spaces < mask->length) {
+        size_t word = line_mask_skip(mask, spaces, ' ');
+        if (word == mask->length) {
+            break;
+        }
+        FdRedirection redirection;
+        char *end = parse_fd_redirection(pipe_subcommand + word, &redirection);
+        if (end == (char *) -1) {
+            ERR_PRINT(ERR_FD_REDIR, pipe_subcommand + word);
+            free_fd_redirections(head);
+            return (FdRedirection *) -1;
         }
+        if (end == NULL) {
+            spaces = line_mask_find(mask, word, ' ');
+            continue;
+        }
+        *tail = malloc(sizeof(FdRedirection));
+        **tail = redirection;
+        tail = &(*tail)->next;
+
+        // the rest of the line moves back over the redirection and its spaces
+        size_t taken = end - pipe_subcommand - spaces;
+        memmove(pipe_subcommand + spaces, end, mask->length - (end - pipe_subcommand) + 1);
+        line_mask_erase(mask, spaces, taken);
     }
+    pipe_subcommand[spaces] = '\0';
+    line_mask_erase(mask, spaces, mask->length - spaces);
 
-    return command;
+    size_t leading = line_mask_skip(mask, 0, ' ');
+    memmove(pipe_subcommand, pipe_subcommand + leading, mask->length - leading + 1);
+    line_mask_erase(mask, 0, leading);
+    return head;
 }
 
 /**
@@ -517,22 +562,28 @@ RedirectionCommand *return_redirection_command(char *pipe_subcommand) {
  * and arguments. It also resolves the executable path using the provided
  * environment variable path if necessary.
  *
+ * When late_bound is non-zero, the command is being compiled into a template and
+ * a command name that still holds a variable usage, or that cannot be found yet,
+ * is left unresolved (exec_path is NULL) until the template is instantiated.
+ *
  * @param commands_with_args The command string containing the executable path and arguments.
- * @param path Pointer to the head of the linked list of environment variables representing the PATH.
+ * @param context The parser context, whose variables start with PATH.
+ * @param late_bound Non-zero if variable usages are still present in commands_with_args.
  * @return A pointer to a Command structure containing the parsed information.
  *         Memory is allocated dynamically for the structure and its members.
  *         Returns NULL if memory allocation fails or if the executable path cannot be resolved.
  */
-Command* separate_command_and_args(char* commands_with_args, Variable* path) {
+Command* separate_command_and_args(char* commands_with_args, const ParserContext *context, uint8_t late_bound) {
     Command *command = malloc(sizeof(Command));
 
     // Handling the command's exec_path
     char *space_ptr = strchr(commands_with_args, ' ');
     if (space_ptr == NULL) {
         // Command takes no arguments
-        command->exec_path = resolve_executable(commands_with_args, path);
-
-        if (command->exec_path == NULL) {
+        if (late_bound && strchr(commands_with_args, VARIABLE_PARSE_MARKER)) {
+            command->exec_path = NULL;
+        } else if ((command->exec_path = resolve_command(context, commands_with_args)) == NULL &&
+                   !late_bound) {
             free(command);
             ERR_PRINT(ERR_NO_EXECU, commands_with_args);
             return NULL;
@@ -547,8 +598,10 @@ Command* separate_command_and_args(char* commands_with_args, Variable* path) {
     char command_name[command_name_len + 1];
     memcpy(command_name, commands_with_args, command_name_len);
     command_name[command_name_len] = '\0';
-    command->exec_path = resolve_executable(command_name, path);
-    if (command->exec_path == NULL) {
+    if (late_bound && strchr(command_name, VARIABLE_PARSE_MARKER)) {
+        command->exec_path = NULL;
+    } else if ((command->exec_path = resolve_command(context, command_name)) == NULL &&
+               !late_bound) {
         free(command);
         ERR_PRINT(ERR_NO_EXECU, command_name);
         return NULL;
@@ -558,14 +611,15 @@ Command* separate_command_and_args(char* commands_with_args, Variable* path) {
 
     // Handling the command's arguments
     int args_count = 0;
-    for (int i = 0; i < strlen(commands_with_args); i++) {
+    size_t args_length = strlen(commands_with_args);
+    for (size_t i = 0; i < args_length; i++) {
         if (commands_with_args[i] == ' ') {
             args_count++;
         }
     }
-    // Number of arguments is 1 more than the number of spaces and the name of the executable
-    // should also be in the args
-    args_count += 2;
+    // Number of arguments is 1 more than the number of spaces, the name of the executable
+    // should also be in the args, and the list is NULL terminated
+    args_count += 3;
     char **args = malloc(sizeof(char*) * args_count);
     args[0] = strdup(command_name);
     int i = 1;
@@ -577,58 +631,547 @@ Command* separate_command_and_args(char* commands_with_args, Variable* path) {
         commands_with_args+= length + 1;
         i++;
     }
-    int length_last_arg = strlen(commands_with_args);
-    args[i] = commands_with_args;
-    args[i][length_last_arg] = '\0';
+    // commands_with_args is owned by the caller, so the last argument needs its own copy
+    args[i] = strdup(commands_with_args);
     args[i + 1] = NULL;
     command->args = args;
     return command;
 }
 
+/**
+ * Check whether a line is a variable assignment rather than a command.
+ *
+ * A line is an assignment if the text before its first '=' is a single word,
+ * so "VAR=VALUE" (and the invalid "VAR =VALUE") are assignments, while
+ * "test $A = b" is a command.
+ *
+ * @param line The trimmed line to check.
+ * @return 1 if the line is an assignment, 0 otherwise.
+ */
+int is_assignment(const char *line) {
+    const char *equals = strchr(line, '=');
+    if (equals == NULL) {
+        return 0;
+    }
+    const char *space_ptr = strchr(line, ' ');
+    while (space_ptr != NULL && space_ptr < equals && *space_ptr == ' ') {
+        space_ptr++;
+    }
+    return space_ptr == NULL || space_ptr >= equals;
+}
+
+Command *build_commands(char *line, const LineMask *mask, const ParserContext *context, uint8_t late_bound);
+
+/**
+ * Find the `|&` of a fan-out in a classified line.
+ *
+ * @param mask The special characters of the line, see classify_line.
+ * @return The index of the `|&`, or mask->length if there is none.
+ */
+size_t find_fanout(const LineMask *mask) {
+    size_t pipe_index = 0;
+    while ((pipe_index = line_mask_find(mask, pipe_index, '|')) < mask->length) {
+        if (mask->line[pipe_index + 1] == FANOUT_OPERATOR[1]) {
+            return pipe_index;
+        }
+        pipe_index++;
+    }
+    return mask->length;
+}
+
+/**
+ * Build a fan-out, "producer |& { consumer, consumer... }", where the
+ * producer and every consumer may be pipelines of their own.
+ *
+ * @param line The line, with no `;`, `&&` or `||` in it.
+ * @param mask The special characters of the line, see classify_line.
+ * @param fanout The index of the `|&` in the line.
+ * @param context The parser context, whose variables start with PATH.
+ * @param late_bound Non-zero to build a template, see build_commands.
+ * @return The first command of the producer, whose last stage holds the
+ *         consumers in its fanout, or (Command *) -1 on error.
+ */
+Command *build_fanout(const char *line, const LineMask *mask, size_t fanout, const ParserContext *context,
+                      uint8_t late_bound) {
+    char text[MAX_SINGLE_LINE];
+    size_t braces = fanout + strlen(FANOUT_OPERATOR);
+    size_t text_start = copy_trimmed(text, mask, braces, mask->length - braces);
+    size_t length = strlen(text);
+    if (length < 2 || text[0] != FANOUT_START || text[length - 1] != FANOUT_END) {
+        ERR_PRINT(ERR_FANOUT_SYNTAX, line);
+        return (Command *) -1;
+    }
+    text[length - 1] = '\0';
+
+    Command *consumers = NULL;
+    Command **tail = &consumers;
+    char consumer[MAX_SINGLE_LINE];
+    LineMask consumer_mask;
+    char *save_ptr;
+    for (char *part = strtok_r(text + 1, FANOUT_SEPARATOR, &save_ptr); part != NULL;
+         part = strtok_r(NULL, FANOUT_SEPARATOR, &save_ptr)) {
+        // text is a copy of the line from text_start, so the parts are in its mask
+        copy_trimmed_mask(consumer, mask, text_start + (part - text), strlen(part), &consumer_mask);
+        Command *pipeline = (Command *) -1;
+        if (*consumer == '\0' || strstr(consumer, FANOUT_OPERATOR) != NULL) {
+            ERR_PRINT(ERR_FANOUT_SYNTAX, line);
+        } else {
+            pipeline = build_commands(consumer, &consumer_mask, context, late_bound);
+        }
+        free_line_mask(&consumer_mask);
+        if (pipeline == (Command *) -1) {
+            free_command(consumers);
+            return pipeline;
+        }
+        *tail = pipeline;
+        tail = &pipeline->next_pipeline;
+    }
+
+    copy_trimmed_mask(consumer, mask, 0, fanout, &consumer_mask);
+    Command *head = (Command *) -1;
+    if (consumers == NULL || *consumer == '\0') {
+        ERR_PRINT(ERR_FANOUT_SYNTAX, line);
+    } else {
+        head = build_commands(consumer, &consumer_mask, context, late_bound);
+    }
+    free_line_mask(&consumer_mask);
+    if (head == (Command *) -1) {
+        free_command(consumers);
+        return head;
+    }
+    Command *last = head;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    last->fanout = consumers;
+    return head;
+}
+
+/**
+ * Build the linked list of commands for a line that is not an assignment.
+ *
+ * The line is split on pipes, each subcommand has its redirections pulled out, and
+ * is finally separated into its executable and arguments.
+ *
+ * @param line The line to build commands from. Variables may or may not be replaced yet.
+ * @param mask The special characters of the line, see classify_line.
+ * @param context The parser context, whose variables start with PATH.
+ * @param late_bound Non-zero to build a template whose variable usages are kept in place.
+ * @return The first command of the line, or (Command *) -1 if any subcommand could not
+ *         be built. Memory is allocated dynamically for every command in the list.
+ */
+Command *build_commands(char *line, const LineMask *mask, const ParserContext *context, uint8_t late_bound) {
+    size_t fanout = find_fanout(mask);
+    if (fanout < mask->length) {
+        return build_fanout(line, mask, fanout, context, late_bound);
+    }
+    int pipe_count = num_pipes(mask);
+    int subcommand_count = pipe_count + 1;
+    size_t offsets[subcommand_count];
+    char **pipe_subcommands = return_pipe_subcommands(mask, pipe_count, offsets);
+
+    Command *subcommands[subcommand_count];
+    int built = 0;
+
+    for (int i = 0; i < subcommand_count; i++) {
+        LineMask subcommand_mask;
+        line_mask_slice(mask, offsets[i], strlen(pipe_subcommands[i]), pipe_subcommands[i], &subcommand_mask);
+        // the paths of numbered redirections may hold variable usages too
+        uint8_t has_variables = line_mask_find(&subcommand_mask, 0, VARIABLE_PARSE_MARKER) < subcommand_mask.length;
+        FdRedirection *fd_redirections = take_fd_redirections(pipe_subcommands[i], &subcommand_mask);
+        if (fd_redirections == (FdRedirection *) -1) {
+            free_line_mask(&subcommand_mask);
+            break;
+        }
+        RedirectionCommand *redir_command = return_redirection_command(&subcommand_mask);
+        free_line_mask(&subcommand_mask);
+        Command* command = separate_command_and_args(redir_command->command_with_args, context, late_bound);
+        free(redir_command->command_with_args);
+        if (command == NULL) {
+            free(redir_command->redir_in_path);
+            free(redir_command->redir_out_path);
+            free(redir_command);
+            free_fd_redirections(fd_redirections);
+            break;
+        }
+        command->redir_in_path = redir_command->redir_in_path;
+        command->redir_out_path = redir_command->redir_out_path;
+        command->redir_append = redir_command->redir_append;
+        command->stdin_fd = STDIN_FILENO;
+        command->stdout_fd = STDOUT_FILENO;
+        command->cpu = -1;
+        command->cgroup_fd = -1;
+        command->next_pipeline = NULL;
+        command->list_op = LIST_END;
+        command->deferred = 0;
+        command->fanout = NULL;
+        command->group = NULL;
+        command->subshell = 0;
+        command->fd_redirections = fd_redirections;
+        command->path_value = NULL;
+        command->late_bound = late_bound && (command->exec_path == NULL || has_variables);
+        command->next = NULL;
+
+        free(redir_command);
+        subcommands[i] = command;
+        built++;
+    }
+
+    for (int i = 0; i < subcommand_count; i++) {
+        free(pipe_subcommands[i]);
+    }
+
+    free(pipe_subcommands);
+
+    for (int i = 0; i < built - 1; i++) {
+        subcommands[i]->next = subcommands[i + 1];
+    }
+
+    if (built < subcommand_count) {
+        if (built > 0) {
+            free_command(subcommands[0]);
+        }
+        return (Command *) -1;
+    }
+
+    return subcommands[0];
+}
+
+/**
+ * Check whether a trimmed line can only be parsed right before it runs:
+ * assignments change the variables, and $((...)) and ${...} operators
+ * may expand to pipes and spaces, so they are expanded before splitting.
+ * Templates do not carry fan-outs either.
+ *
+ * @param line The trimmed line to check.
+ * @return 1 if the line cannot be built into a template, 0 otherwise.
+ */
+int is_parsed_when_run(const char *line) {
+    return is_assignment(line) || strstr(line, ARITH_START) != NULL ||
+           has_parameter_operators(line) || strstr(line, FANOUT_OPERATOR) != NULL;
+}
+
+/**
+ * Find the ')' that closes a '(' in a line, that of a "$((" or of a ( )
+ * group. Parentheses are not special characters, so the line is scanned
+ * byte by byte.
+ *
+ * @param line The line.
+ * @param from The index of the '('.
+ * @param length The length of the line.
+ * @return The index of the matching ')', or length if it is missing.
+ */
+size_t closing_paren_position(const char *line, size_t from, size_t length) {
+    int depth = 0;
+    for (size_t i = from; i < length; i++) {
+        if (line[i] == '(') {
+            depth++;
+        } else if (line[i] == ')' && --depth == 0) {
+            return i;
+        }
+    }
+    return length;
+}
+
+size_t closing_curl_position(const LineMask *mask, size_t from);
+
+/**
+ * Check whether a trimmed pipeline is a { } or ( ) group. Like a command
+ * name, the '{' of a group must be a word of its own.
+ *
+ * @param line The trimmed pipeline.
+ * @return 1 if the pipeline is a group, 0 otherwise.
+ */
+int is_group_start(const char *line) {
+    return *line == SUBSHELL_START ||
+           (*line == GROUP_START && (line[1] == ' ' || line[1] == '\0'));
+}
+
+/**
+ * Find the next `;`, `&&` or `||` that separates two pipelines of a list.
+ * Operators inside ${...}, $((...)) and groups belong to them.
+ *
+ * @param mask The special characters of the line, see classify_line.
+ * @param from The index to start at.
+ * @param op Set to the operator found, LIST_END if there is none.
+ * @return The index of the operator, or mask->length if there is none.
+ */
+size_t find_list_operator(const LineMask *mask, size_t from, ListOperator *op) {
+    const char *line = mask->line;
+    size_t i = from;
+    // '(' is not special, but a ( ) group may only start a pipeline
+    while (i < mask->length && line[i] == ' ') {
+        i++;
+    }
+    if (line[i] == SUBSHELL_START) {
+        i = closing_paren_position(line, i, mask->length) + 1;
+    }
+    while ((i = line_mask_next(mask, i)) < mask->length) {
+        char c = line[i];
+        if (c == ';') {
+            *op = LIST_SEQ;
+            return i;
+        }
+        if ((c == '&' || c == '|') && line[i + 1] == c) {
+            *op = c == '&' ? LIST_AND : LIST_OR;
+            return i;
+        }
+        if (c == VARIABLE_PARSE_MARKER && line[i + 1] == '{') {
+            i = closing_curl_position(mask, i + 2);
+        } else if (c == GROUP_START && (i == 0 || strchr(" ;&|", line[i - 1]) != NULL)) {
+            size_t close = closing_curl_position(mask, i + 1);
+            i = close < mask->length ? close : i;
+        } else if (c == VARIABLE_PARSE_MARKER && strncmp(line + i, ARITH_START, strlen(ARITH_START)) == 0) {
+            i = closing_paren_position(line, i + 1, mask->length);
+        }
+        i++;
+    }
+    *op = LIST_END;
+    return mask->length;
+}
+
 /*
-** Parses a single line of text and returns a linked list of commands.
-** The last command in the list has a next pointer that points to NULL.
-**
-** Return possibilities:
-** 1. The first in a list of commands that should execute roughly
-**    simultaneously (see instructions for details).
-**
-** 2. NULL if successfully parsed line, with *no commands*, this happens:
-**      -- Case 1: Empty line
-**      -- Case 2: Line is /exclusively/ a comment (i.e. first non-whitespace
-**                 char is '#'). Comments may also trail commands or assignments.
-**                 You must handle text before "#' characters.
-**      -- Case 3: Shell variable assignment (e.g. VAR=VALUE)
-**          -- The variable should added to the variables list
-**          -- or updated if the variable already exists
-**
-** 3. If there is an error, returns -1 cast as a (Command *)
+** Returns 1 if the (trimmed) line is a list of pipelines separated by
+** `;`, `&&` or `||`, 0 otherwise.
+*/
+int is_command_list(const char *line) {
+    LineMask mask;
+    classify_line(line, strlen(line), &mask);
+    ListOperator op;
+    int found = find_list_operator(&mask, 0, &op) < mask.length;
+    free_line_mask(&mask);
+    return found;
+}
+
+/**
+ * Build a list element that is only parsed when it is reached, see Command.
+ *
+ * @param text The trimmed text of the element.
+ * @return The deferred element, a single command whose args[0] is text.
+ */
+Command *new_deferred_command(const char *text) {
+    Command *command = calloc(1, sizeof(Command));
+    command->args = malloc(sizeof(char *) * 2);
+    command->args[0] = strdup(text);
+    command->args[1] = NULL;
+    command->stdin_fd = STDIN_FILENO;
+    command->stdout_fd = STDOUT_FILENO;
+    command->cpu = -1;
+    command->cgroup_fd = -1;
+    command->deferred = 1;
+    return command;
+}
+
+/**
+ * Get the text of a list operator, for error messages.
+ *
+ * @param op The operator.
+ * @return The operator as written in a line.
+ */
+const char *list_operator_text(ListOperator op) {
+    return op == LIST_AND ? "&&" : op == LIST_OR ? "||" : ";";
+}
+
+Command *parse_command_list(const ParserContext *context, const LineMask *mask);
+
+/**
+ * Build a { } or ( ) group into a single command, whose group is the
+ * list it runs. Nothing but redirections may follow the group, and they
+ * are kept as written, to be expanded when the group runs.
+ *
+ * @param line The trimmed pipeline, see is_group_start.
+ * @param mask The special characters of the pipeline, see classify_line.
+ * @param context The parser context, whose variables start with PATH.
+ * @return The group, or (Command *) -1 on a syntax error.
+ */
+Command *build_group(const char *line, const LineMask *mask, const ParserContext *context) {
+    size_t length = mask->length;
+    uint8_t subshell = *line == SUBSHELL_START;
+    size_t close = subshell ? closing_paren_position(line, 0, length) : closing_curl_position(mask, 1);
+
+    // the list of a { } group must be ended like any other, "{ echo; }"
+    char body[MAX_SINGLE_LINE];
+    LineMask body_mask;
+    copy_trimmed_mask(body, mask, 1, close < length ? close - 1 : 0, &body_mask);
+    size_t body_length = strlen(body);
+    if (close == length || body_length == 0 ||
+        (!subshell && body[body_length - 1] != ';')) {
+        ERR_PRINT(ERR_GROUP_SYNTAX, line);
+        free_line_mask(&body_mask);
+        return (Command *) -1;
+    }
+
+    LineMask rest_mask;
+    line_mask_slice(mask, close + 1, length - close - 1, line + close + 1, &rest_mask);
+    RedirectionCommand *redirections = return_redirection_command(&rest_mask);
+    free_line_mask(&rest_mask);
+    uint8_t only_redirections = *redirections->command_with_args == '\0' &&
+                                line_mask_find(mask, close + 1, '|') == length;
+    free(redirections->command_with_args);
+    if (!only_redirections) {
+        ERR_PRINT(ERR_GROUP_SYNTAX, line);
+        free(redirections->redir_in_path);
+        free(redirections->redir_out_path);
+        free(redirections);
+        free_line_mask(&body_mask);
+        return (Command *) -1;
+    }
+
+    // a single pipeline is a list too, of one element
+    Command *list = parse_command_list(context, &body_mask);
+    free_line_mask(&body_mask);
+    if (list == (Command *) -1 || list == NULL) {
+        free(redirections->redir_in_path);
+        free(redirections->redir_out_path);
+        free(redirections);
+        return (Command *) -1;
+    }
+
+    Command *group = calloc(1, sizeof(Command));
+    group->args = malloc(sizeof(char *) * 2);
+    group->args[0] = strndup(line, 1);
+    group->args[1] = NULL;
+    group->redir_in_path = redirections->redir_in_path;
+    group->redir_out_path = redirections->redir_out_path;
+    group->redir_append = redirections->redir_append;
+    group->stdin_fd = STDIN_FILENO;
+    group->stdout_fd = STDOUT_FILENO;
+    group->cpu = -1;
+    group->cgroup_fd = -1;
+    group->group = list;
+    group->subshell = subshell;
+    free(redirections);
+    return group;
+}
+
+/**
+ * Parse a line of pipelines separated by `;`, `&&` and `||` into a list.
+ *
+ * The line is split once, before anything in it is expanded, so that every
+ * pipeline sees the variables as the ones before it left them. Pipelines
+ * are built as templates, except for the ones is_parsed_when_run, which are
+ * deferred to execute_line, and groups, see build_group. A ';' may end the
+ * line, and a '#' starting a pipeline comments out the rest of it.
+ *
+ * @param context The parser context, whose variables start with PATH.
+ * @param mask The special characters of the trimmed line, see classify_line.
+ * @return The first pipeline of the list, or (Command *) -1 on a syntax error.
  */
-Command *parse_line(char *line, Variable **variables){
+Command *parse_command_list(const ParserContext *context, const LineMask *mask) {
+    Command *head = NULL;
+    Command **tail = &head;
+    ListOperator op = LIST_SEQ;
+    char element[MAX_SINGLE_LINE];
+
+    for (size_t start = 0; start <= mask->length; start += op == LIST_SEQ ? 1 : 2) {
+        ListOperator previous = op;
+        size_t end = find_list_operator(mask, start, &op);
+        LineMask element_mask;
+        copy_trimmed_mask(element, mask, start, end - start, &element_mask);
+        if (*element == '#') {
+            free_line_mask(&element_mask);
+            break;
+        }
+        if (*element == '\0') {
+            free_line_mask(&element_mask);
+            if (op == LIST_END && previous == LIST_SEQ && head != NULL) {
+                break;
+            }
+            ERR_PRINT(ERR_LIST_SYNTAX, list_operator_text(op == LIST_END ? previous : op));
+            free_command(head);
+            return (Command *) -1;
+        }
+
+        Command *pipeline = is_group_start(element) ? build_group(element, &element_mask, context) :
+                            is_parsed_when_run(element) ? new_deferred_command(element) :
+                            build_commands(element, &element_mask, context, 1);
+        free_line_mask(&element_mask);
+        if (pipeline == (Command *) -1) {
+            free_command(head);
+            return pipeline;
+        }
+        // the last pipeline keeps LIST_SEQ, so that even "cd /tmp;" is a list
+        pipeline->list_op = op == LIST_END ? LIST_SEQ : op;
+        *tail = pipeline;
+        tail = &pipeline->next_pipeline;
+        start = end;
+    }
+    // an assignment in the list may change PATH under the templates after it
+    if (head != NULL) {
+        Variable *path = context->variables;
+        head->path_value = strdup(path != NULL && strcmp(path->name, PATH_VAR_NAME) == 0 ?
+                                  path->value : "");
+    }
+    return head;
+}
+
+char *substitute_variables(const char *line, const LineMask *mask, Variable *variables,
+                           ParserContext *context, LineMask *new_mask);
+
+/*
+** Reentrant parse_line: parses a line against the variables of a context,
+** and adds assignments to them. The line itself is not modified.
+**
+** Return values are those of parse_line.
+*/
+Command *parse_line_r(ParserContext *context, const char *line){
     // Check for empty line or comment
     if (line == NULL) {
         return (Command *) -1;
     }
-    trim_whitespace_leading(&line);
-    trim_whitespace_ending(line);
-    if (*line == '\0' || *line == '#' || strlen(line) == 0) {
+    // the line is classified once, and its mask goes down to every helper
+    char *line_copy = strdup(line);
+    LineMask mask;
+    char *start = classify_trimmed(line_copy, &mask);
+    if (*start == '\0' || *start == '#') {
+        free_line_mask(&mask);
+        free(line_copy);
         return NULL;
     }
 
-    line = replace_variables_mk_line(line, *variables);
+    // lists and groups are split before their variables are replaced
+    ListOperator op;
+    if (find_list_operator(&mask, 0, &op) < mask.length || is_group_start(start)) {
+        Command *list = parse_command_list(context, &mask);
+        free_line_mask(&mask);
+        free(line_copy);
+        return list;
+    }
+
+    // only a line with usages in it becomes a new one, with a mask of its own
+    char *replaced;
+    LineMask substituted_mask;
+    LineMask *replaced_mask = &substituted_mask;
+    if (line_mask_find(&mask, 0, VARIABLE_PARSE_MARKER) < mask.length) {
+        replaced = substitute_variables(start, &mask, context->variables, context, &substituted_mask);
+        free_line_mask(&mask);
+        free(line_copy);
+        if (replaced == NULL) {
+            return (Command *) -1;
+        }
+    } else {
+        replaced = memmove(line_copy, start, mask.length + 1);
+        mask.line = replaced;
+        replaced_mask = &mask;
+    }
 
+    Command *commands = NULL;
     // Check for variable assignment
-    if (strchr(line, '=')) {
+    if (is_assignment(replaced)) {
+        free_line_mask(replaced_mask);
         // Parse variable assignment
-        const char *name = strtok(line, "=");
-        const char *value = strtok(NULL, "#");
+        char *save_ptr;
+        const char *name = strtok_r(replaced, "=", &save_ptr);
+        const char *value = strtok_r(NULL, "#", &save_ptr);
         if (name == NULL) {
             ERR_PRINT(ERR_VAR_START);
+            free(replaced);
             return (Command *) -1;
         }
 
-        for (int i = 0; i < strlen(name); i++) {
+        for (int i = 0; name[i] != '\0'; i++) {
             if (name[i] == '#') {
+                free(replaced);
                 return NULL;
             }
             if (isalpha(name[i]) == 0 && name[i] != '_') {
@@ -636,157 +1179,304 @@ Command *parse_line(char *line, Variable **variables){
                 // Handles Shell variables must be specified as a name, consisting of only alphabetic
                 // characters and _ (underscore) characters.
                 ERR_PRINT(ERR_VAR_NAME, name);
+                free(replaced);
                 return (Command *) -1;
             }
         }
-        add_variable(name, value, variables);
-        return NULL;
+        add_variable_r(context, name, value == NULL ? "" : value);
     } else {
-        int pipe_count = num_pipes(line);
-        char **pipe_subcommands = return_pipe_subcommands(line, pipe_count);
-        int subcommand_count = pipe_count + 1;
+        commands = build_commands(replaced, replaced_mask, context, 0);
+        free_line_mask(replaced_mask);
+    }
 
-        Command *subcommands[subcommand_count];
+    free(replaced);
+    return commands;
+}
 
-        for (int i = 0; i < subcommand_count; i++) {
-            RedirectionCommand *redir_command = return_redirection_command(pipe_subcommands[i]);
-            Command* command = separate_command_and_args(redir_command->command_with_args, *variables);
-            if (command == NULL) {
-                return NULL;
-            }
-            free(redir_command->command_with_args);
-            command->redir_in_path = redir_command->redir_in_path;
-            command->redir_out_path = redir_command->redir_out_path;
-            command->redir_append = redir_command->redir_append;
-            command->stdin_fd = STDIN_FILENO;
-            command->stdout_fd = STDOUT_FILENO;
-            command->next = NULL;
+/*
+** Reentrant compile_line, against the variables of a context.
+*/
+Command *compile_line_r(const ParserContext *context, const char *line){
+    char line_buf[MAX_SINGLE_LINE];
+    strncpy(line_buf, line, MAX_SINGLE_LINE - 1);
+    line_buf[MAX_SINGLE_LINE - 1] = '\0';
+
+    LineMask mask;
+    char *start = classify_trimmed(line_buf, &mask);
+    ListOperator op;
+    Command *template = NULL;
+    // expansions may hold pipes and spaces, so they are expanded before splitting
+    if (*start != '\0' && *start != '#' && !is_parsed_when_run(start) &&
+        find_list_operator(&mask, 0, &op) == mask.length && !is_group_start(start)) {
+        template = build_commands(start, &mask, context, 1);
+    }
+    free_line_mask(&mask);
+    return template;
+}
 
+/**
+ * Append the expansion of a single template argument to a growing argument vector.
+ *
+ * Values that contain spaces are split into several arguments, which matches what
+ * parse_line does when it replaces variables before splitting the line.
+ *
+ * @param args Pointer to the argument vector, grown as needed.
+ * @param count Pointer to the number of arguments currently in *args.
+ * @param capacity Pointer to the allocated size of *args.
+ * @param arg The template argument, possibly with variable usages.
+ * @param variables Pointer to the head of the linked list of variables.
+ */
+void append_expanded_args(char ***args, int *count, int *capacity, const char *arg, Variable *variables) {
+    char *expanded = replace_variables_mk_line(arg, variables);
+    char *word = expanded;
+    char *space_ptr;
 
-            free(redir_command);
-            subcommands[i] = command;
+    do {
+        space_ptr = strchr(word, ' ');
+        if (space_ptr != NULL) {
+            *space_ptr = '\0';
         }
-
-        for (int i = 0; i < subcommand_count; i++) {
-            free(pipe_subcommands[i]);
+        if (*word != '\0') {
+            // always keep room for the NULL terminator
+            if (*count + 2 > *capacity) {
+                *capacity *= 2;
+                *args = realloc(*args, sizeof(char *) * (*capacity));
+            }
+            (*args)[(*count)++] = strdup(word);
         }
+        word = space_ptr + 1;
+    } while (space_ptr != NULL);
+
+    free(expanded);
+}
+
+/*
+** Reentrant instantiate_command, against the variables of a context.
+*/
+Command *instantiate_command_r(const ParserContext *context, Command *template){
+    Variable *variables = context->variables;
+    Command *curr_template = template;
+    while (curr_template != NULL && curr_template->late_bound == 0) {
+        curr_template = curr_template->next;
+    }
+    if (curr_template == NULL) {
+        return template;
+    }
 
-        free(pipe_subcommands);
+    Command *head = NULL;
+    Command **tail = &head;
+    for (curr_template = template; curr_template != NULL; curr_template = curr_template->next) {
+        Command *command = malloc(sizeof(Command));
+        *command = *curr_template;
+        command->next = NULL;
+        command->next_pipeline = NULL;
+        command->list_op = LIST_END;
+        command->fanout = NULL;
+        command->group = NULL;
+        command->path_value = NULL;
+
+        int count = 0;
+        int capacity = 4;
+        command->args = malloc(sizeof(char *) * capacity);
+        for (int i = 0; curr_template->args[i] != NULL; i++) {
+            if (curr_template->late_bound) {
+                append_expanded_args(&command->args, &count, &capacity, curr_template->args[i], variables);
+            } else {
+                if (count + 2 > capacity) {
+                    capacity *= 2;
+                    command->args = realloc(command->args, sizeof(char *) * capacity);
+                }
+                command->args[count++] = strdup(curr_template->args[i]);
+            }
+        }
+        command->args[count] = NULL;
 
-        for (int i = 0; i < subcommand_count - 1; i++) {
-            subcommands[i]->next = subcommands[i + 1];
+        command->redir_in_path = NULL;
+        command->redir_out_path = NULL;
+        command->fd_redirections = NULL;
+        FdRedirection **fd_tail = &command->fd_redirections;
+        for (FdRedirection *redirection = curr_template->fd_redirections; redirection != NULL;
+             redirection = redirection->next) {
+            *fd_tail = malloc(sizeof(FdRedirection));
+            **fd_tail = *redirection;
+            if (redirection->path != NULL) {
+                (*fd_tail)->path = curr_template->late_bound ?
+                    replace_variables_mk_line(redirection->path, variables) :
+                    strdup(redirection->path);
+            }
+            (*fd_tail)->opened_fd = -1;
+            (*fd_tail)->next = NULL;
+            fd_tail = &(*fd_tail)->next;
+        }
+        if (curr_template->redir_in_path != NULL) {
+            command->redir_in_path = curr_template->late_bound ?
+                replace_variables_mk_line(curr_template->redir_in_path, variables) :
+                strdup(curr_template->redir_in_path);
+        }
+        if (curr_template->redir_out_path != NULL) {
+            command->redir_out_path = curr_template->late_bound ?
+                replace_variables_mk_line(curr_template->redir_out_path, variables) :
+                strdup(curr_template->redir_out_path);
         }
 
-        Command *curr_command = subcommands[0];
-        while (curr_command != NULL) {
-            curr_command = curr_command->next;
+        command->exec_path = NULL;
+        if (curr_template->exec_path != NULL) {
+            command->exec_path = strdup(curr_template->exec_path);
+        } else if (count > 0) {
+            command->exec_path = resolve_command(context, command->args[0]);
         }
+        command->late_bound = 0;
+
+        *tail = command;
+        tail = &command->next;
 
-        return subcommands[0];
+        if (command->exec_path == NULL) {
+            ERR_PRINT(ERR_NO_EXECU, count > 0 ? command->args[0] : "");
+            free_command(head);
+            return (Command *) -1;
+        }
     }
+    return head;
+}
 
+/*
+** Leaves every stage of a template unresolved, for instantiate_command to
+** resolve again: the template was built before a PATH assignment.
+*/
+void unbind_command(Command *template) {
+    for (Command *stage = template; stage != NULL; stage = stage->next) {
+        // a group resolves its own list when it runs
+        if (stage->group != NULL || stage->deferred) {
+            continue;
+        }
+        free(stage->exec_path);
+        stage->exec_path = NULL;
+        stage->late_bound = 1;
+    }
 }
 
 // HELPERS FOR replace_variables_mk_line
 /**
- * Get the number of variables in a line.
+ * Get the number of variables in a classified line.
  *
  * This function counts the number of variables ('$' symbols) present in a line.
  *
- * @param line The line containing variables.
+ * @param mask The special characters of the line, see classify_line.
  * @return The number of variables in the line.
  */
-int get_num_variables(const char *line) {
-    int count = 0;
-    for (int i = 0; i < strlen(line); i++) {
-        if (line[i] == '$') {
-            count++;
-        }
-    }
-    return count;
+int get_num_variables(const LineMask *mask) {
+    return line_mask_count(mask, VARIABLE_PARSE_MARKER);
 }
 
 typedef struct RemovedVariables {
     char **var_names;
+    uint8_t *braced;    // the name is the expression of a ${...}
     int removed;
     int num_removed;
 } RemovedVariables;
 
+/**
+ * Free a RemovedVariables structure and the names in it.
+ *
+ * @param removed_variables The structure to free.
+ */
+void free_removed_variables(RemovedVariables *removed_variables) {
+    for (int i = 0; i < removed_variables->num_removed; i++) {
+        free(removed_variables->var_names[i]);
+    }
+    free(removed_variables->var_names);
+    free(removed_variables->braced);
+    free(removed_variables);
+}
+
+/**
+ * Find the '}' that closes a "${" in a classified line, skipping nested ones.
+ *
+ * @param mask The special characters of the line, see classify_line.
+ * @param from The index just after the '{'.
+ * @return The index of the closing '}', or mask->length if it is missing.
+ */
+size_t closing_curl_position(const LineMask *mask, size_t from) {
+    int depth = 1;
+    while (1) {
+        size_t close = line_mask_find(mask, from, '}');
+        size_t open = line_mask_find(mask, from, '{');
+        if (close == mask->length || (open > close && --depth == 0)) {
+            return close;
+        }
+        if (open < close) {
+            depth++;
+            from = open + 1;
+        } else {
+            from = close + 1;
+        }
+    }
+}
+
 /**
  * Extract variable names, number of characters removed, and the number of variables removed from a line.
  *
  * This function extracts variable names from a line containing variables ('$' symbols).
+ * The name of a ${...} usage is its whole expression, and the '$' of any
+ * usages nested in it are left to expand_parameter.
  *
- * @param line The line containing variables.
+ * @param mask The special characters of the line containing variables, see classify_line.
  * @return A pointer to a RemovedVariables structure containing the extracted variable names and other information.
  *         Memory is allocated dynamically for the structure and its members.
+ *         Returns NULL if a "${" is never closed.
  */
-RemovedVariables *variable_names(const char *line) {
-    int num_vars = get_num_variables(line);
-    char **var_names = malloc(num_vars * sizeof(char *));
-    for (int i = 0; i < num_vars; i++) {
-        var_names[i] = malloc(sizeof(char) * MAX_SINGLE_LINE);
-    }
+RemovedVariables *variable_names(const LineMask *mask) {
+    const char *line = mask->line;
+    int num_vars = get_num_variables(mask);
+    RemovedVariables *removedVariablesToReturn = malloc(sizeof(RemovedVariables));
+    removedVariablesToReturn->var_names = malloc(num_vars * sizeof(char *));
+    removedVariablesToReturn->braced = malloc(num_vars * sizeof(uint8_t));
 
-    char *line_copy = strdup(line);
-    char *line_begin = line_copy;
     int i = 0;
     int removed = 0;
+    size_t dollar = 0;
 
-    while ((line_copy = strchr(line_copy, '$')) != NULL && strlen(line_copy) > 1) {
-        line_copy++;
+    while ((dollar = line_mask_find(mask, dollar, VARIABLE_PARSE_MARKER)) + 1 < mask->length) {
+        size_t name_start = dollar + 1;
+        size_t length;
+        uint8_t braced = line[name_start] == '{';
         removed++;
-        if (*line_copy == '{') {
-            char *right_curl_position = strchr(line_copy, '}');
-            int length =  right_curl_position - 1 - (line_copy + 1) + 1;
-            char name_var[length + 1];
+        if (braced) {
+            size_t right_curl_position = closing_curl_position(mask, name_start + 1);
+            if (right_curl_position == mask->length) {
+                ERR_PRINT(ERR_SUBST_EOF, (int) (mask->length - dollar), line + dollar);
+                removedVariablesToReturn->num_removed = i;
+                free_removed_variables(removedVariablesToReturn);
+                return NULL;
+            }
+            length = right_curl_position - (name_start + 1);
             removed += length + 2;
-            memcpy(name_var, line_copy + 1, length);
-            name_var[length] = '\0';
-            strcpy(var_names[i], name_var);
-            i++;
+            name_start++;
+            // usages nested in the expression are expanded along with it
+            dollar = right_curl_position;
         } else {
-            int length;
-            char *next_space = strchr(line_copy, ' ');
-            char *next_dollar = strchr(line_copy, '$');
-            char *next_ptr;
-
-            if (next_space == NULL && next_dollar == NULL) {
-                // WORKS FOR $ABC
-                length = strlen(line_begin) - (line_copy - line_begin);
-
-            } else if (next_dollar != NULL && (next_space == NULL || next_dollar < next_space)) {
-                // WORKS FOR CASES $ABC$XYZ
-                next_ptr = next_dollar;
-                length = next_ptr - line_copy;
-            } else {
-                // (next_dollar == NULL || next_space < next_dollar)
-                // WORK FOR $ABC $XYZ
-                next_ptr = next_space;
-                length = next_ptr - line_copy;
-            }
-            char name_var[length + 1];
+            // WORKS FOR $ABC, $ABC$XYZ and $ABC $XYZ: the name ends at whichever comes first
+            size_t next_space = line_mask_find(mask, name_start, ' ');
+            size_t next_dollar = line_mask_find(mask, name_start, VARIABLE_PARSE_MARKER);
+            size_t next_ptr = next_dollar < next_space ? next_dollar : next_space;
+            length = next_ptr - name_start;
             removed += length;
-            memcpy(name_var, line_copy, length);
-            name_var[length] = '\0';
-            strcpy(var_names[i], name_var);
-            i++;
+            dollar = dollar + 1;
         }
+        removedVariablesToReturn->var_names[i] = strndup(line + name_start, length);
+        removedVariablesToReturn->braced[i] = braced;
+        i++;
     }
-    RemovedVariables *removedVariablesToReturn = malloc(sizeof(RemovedVariables));
-    removedVariablesToReturn->var_names = malloc(num_vars);
-    for (int i = 0; i < num_vars; i++) {
-        removedVariablesToReturn->var_names[i] = malloc(sizeof(char) * (strlen(var_names[i]) + 1));
-        strcpy(removedVariablesToReturn->var_names[i], var_names[i]);
-    }
-    removedVariablesToReturn->removed = removed;
-    removedVariablesToReturn->num_removed = num_vars;
-
-    for (int i = 0; i < num_vars; i++) {
-        free(var_names[i]);
+    // a '$' that ends the line is a usage with an empty name
+    if (dollar + 1 == mask->length) {
+        removedVariablesToReturn->var_names[i] = strdup("");
+        removedVariablesToReturn->braced[i] = 0;
+        removed++;
+        i++;
     }
-    free(var_names);
 
+    removedVariablesToReturn->removed = removed;
+    removedVariablesToReturn->num_removed = i;
     return removedVariablesToReturn;
 }
 
@@ -795,33 +1485,53 @@ RemovedVariables *variable_names(const char *line) {
  *
  * This function retrieves the values corresponding to removed variables from the list of variables.
  * For each removed variable name, it searches the linked list of variables and copies the value
- * of the variable to the corresponding position in the returned array.
+ * of the variable to the corresponding position in the returned array. The expressions of
+ * ${...} usages are expanded by expand_parameter.
  *
  * @param removed_variables Pointer to a RemovedVariables structure containing removed variable names.
  * @param variables Pointer to the head of the linked list of variables.
+ * @param context The context ${VAR:=word} assigns through, or NULL to only substitute word.
  * @return An array of strings containing the values corresponding to the removed variables.
  *         Memory is allocated dynamically for the array and its elements.
- *         Returns NULL for variables whose values cannot be found.
+ *         Values that cannot be found are empty. Returns NULL on a bad substitution.
  */
-char **values_from_removed_variables(RemovedVariables *removed_variables, Variable *variables) {
+char **values_from_removed_variables(RemovedVariables *removed_variables, Variable *variables,
+                                     ParserContext *context) {
     char **values_from_removed_variables = malloc(removed_variables->num_removed * sizeof(char *));
     int num_removed = removed_variables->num_removed;
+    // each value is filled in here, and kept in just the space it needs
+    char value[MAX_SINGLE_LINE];
     for (int i = 0; i < num_removed; i++) {
-        values_from_removed_variables[i] = malloc(sizeof(char) * MAX_SINGLE_LINE);
-        memset(values_from_removed_variables[i], '\0', sizeof(char) * MAX_SINGLE_LINE);
-        int var_not_exit_flag = 0;
-        Variable *curr = variables;
-        while (curr != NULL) {
-            if (strcmp(curr->name, removed_variables->var_names[i]) == 0) {
-                strncpy(values_from_removed_variables[i], curr->value, strlen(curr->value));
-                values_from_removed_variables[i][strlen(curr->value)] = '\0';
-                var_not_exit_flag = 1;
+        value[0] = '\0';
+        if (removed_variables->braced[i]) {
+            const char *expression = removed_variables->var_names[i];
+            if (expand_parameter(expression, strlen(expression), variables, context,
+                                 value, MAX_SINGLE_LINE) < 0) {
+                for (int j = 0; j < i; j++) {
+                    free(values_from_removed_variables[j]);
+                }
+                free(values_from_removed_variables);
+                return NULL;
+            }
+            // an assignment may have added to the head of the list
+            if (context != NULL) {
+                variables = context->variables;
+            }
+        } else {
+            int var_not_exit_flag = 0;
+            Variable *curr = variables;
+            while (curr != NULL) {
+                if (strcmp(curr->name, removed_variables->var_names[i]) == 0) {
+                    snprintf(value, MAX_SINGLE_LINE, "%s", curr->value);
+                    var_not_exit_flag = 1;
+                }
+                curr = curr->next;
+            }
+            if (var_not_exit_flag == 0) {
+                ERR_PRINT(ERR_VAR_NOT_FOUND, removed_variables->var_names[i]);
             }
-            curr = curr->next;
-        }
-        if (var_not_exit_flag == 0) {
-            ERR_PRINT(ERR_VAR_NOT_FOUND, removed_variables->var_names[i]);
         }
+        values_from_removed_variables[i] = strdup(value);
     }
 
     return values_from_removed_variables;
@@ -832,47 +1542,121 @@ char **values_from_removed_variables(RemovedVariables *removed_variables, Variab
  *
  * This function creates a new line by substituting the values of removed variables with the provided values.
  * It calculates the size of the new line, allocates memory for it, and performs the substitution.
+ * The mask of the new line is built from the mask of the original one, and only the substituted
+ * values, which are new text, are classified.
  *
  * @param removed_variables Pointer to a RemovedVariables structure containing removed variable names.
- * @param line The original line containing variables to be substituted.
+ * @param mask The special characters of the original line, see classify_line.
  * @param values_to_substitute An array of strings containing the values to substitute for removed variables.
+ * @param new_mask Set to the special characters of the new line, or NULL if they are not needed.
  * @return A pointer to a newly allocated string containing the new line with substituted variable values.
  *         Memory is allocated dynamically for the new line.
  *         Returns NULL if memory allocation fails or if the arguments are invalid.
  */
-char *create_new_line(RemovedVariables *removed_variables, const char *line, char** values_to_substitute) {
+char *create_new_line(RemovedVariables *removed_variables, const LineMask *mask, char** values_to_substitute,
+                      LineMask *new_mask) {
+    const char *line = mask->line;
     // Calculating Size of New Line
-    int new_line_size = strlen(line) - removed_variables->removed;
+    int new_line_size = mask->length - removed_variables->removed;
     int num_removed = removed_variables->num_removed;
 
     for (int i = 0; i < num_removed; i++) {
         new_line_size += strlen(values_to_substitute[i]);
     }
-    new_line_size += 1;
     char *new_line = malloc(sizeof(char) * (new_line_size + 1));
-    memset(new_line, '\0', sizeof(char) * (new_line_size + 1));
+    new_line[new_line_size] = '\0';
+    if (new_mask != NULL) {
+        init_line_mask(new_line, new_line_size, new_mask);
+    }
 
-    char *line_copy = strdup(line);
-    char *line_begin = line_copy;
+    // Appended through an end pointer, so long lines are not rescanned by strcat
+    size_t new_line_end = 0;
+    size_t line_begin = 0;
+    size_t dollar;
     int i = 0;
-    while ((line_copy = strchr(line_begin, '$')) != NULL) {
-        strncat(new_line, line_begin, line_copy - line_begin);
-        line_begin = line_copy;
-        strncat(new_line, values_to_substitute[i], strlen(values_to_substitute[i]));
+    while ((dollar = line_mask_find(mask, line_begin, VARIABLE_PARSE_MARKER)) < mask->length && i < num_removed) {
+        memcpy(new_line + new_line_end, line + line_begin, dollar - line_begin);
+        if (new_mask != NULL) {
+            line_mask_copy(new_mask, new_line_end, mask, line_begin, dollar - line_begin);
+        }
+        new_line_end += dollar - line_begin;
+
+        size_t value_length = strlen(values_to_substitute[i]);
+        memcpy(new_line + new_line_end, values_to_substitute[i], value_length);
+        if (new_mask != NULL) {
+            LineMask value_mask;
+            classify_line(values_to_substitute[i], value_length, &value_mask);
+            line_mask_copy(new_mask, new_line_end, &value_mask, 0, value_length);
+            free_line_mask(&value_mask);
+        }
+        new_line_end += value_length;
 
-        line_begin += 1;
-        if (*line_begin == '{') {
+        line_begin = dollar + 1;
+        if (line[line_begin] == '{') {
             line_begin += 2;
         }
         line_begin += strlen(removed_variables->var_names[i]);
         i++;
     }
 
-    strncat(new_line, line_begin, strlen(line_begin));
-    new_line[new_line_size] = '\0';
+    memcpy(new_line + new_line_end, line + line_begin, mask->length - line_begin);
+    if (new_mask != NULL) {
+        line_mask_copy(new_mask, new_line_end, mask, line_begin, mask->length - line_begin);
+    }
 
     return new_line;
 }
+/**
+ * Replace the variable usages of a line, see replace_variables_mk_line.
+ *
+ * @param line The line containing variables.
+ * @param mask The special characters of the line, or NULL to classify it here.
+ * @param variables Pointer to the head of the linked list of variables.
+ * @param context The context ${VAR:=word} assigns through, or NULL to only substitute word.
+ * @param new_mask Set to the special characters of the new line if it is returned,
+ *                 see create_new_line, or NULL if they are not needed.
+ * @return The new line, or NULL if replacement parsing had an error.
+ */
+char *substitute_variables(const char *line, const LineMask *mask, Variable *variables,
+                           ParserContext *context, LineMask *new_mask) {
+    // Arithmetic is evaluated in-process, before any variable is replaced,
+    // and leaves a new line to classify
+    char *arith_line = NULL;
+    if (strstr(line, ARITH_START) != NULL) {
+        if ((arith_line = expand_arithmetic(line, variables)) == NULL) {
+            return NULL;
+        }
+        line = arith_line;
+        mask = NULL;
+    }
+    LineMask line_mask;
+    if (mask == NULL) {
+        classify_line(line, strlen(line), &line_mask);
+        mask = &line_mask;
+    }
+
+    char *newline = NULL;
+    RemovedVariables *removedVariables = variable_names(mask);
+    if (removedVariables != NULL) {
+        int num_removed = removedVariables->num_removed;
+        char **values_to_substitute = values_from_removed_variables(removedVariables, variables, context);
+        if (values_to_substitute != NULL) {
+            newline = create_new_line(removedVariables, mask, values_to_substitute, new_mask);
+            for (int i = 0; i < num_removed; i++) {
+                free(values_to_substitute[i]);
+            }
+            free(values_to_substitute);
+        }
+        free_removed_variables(removedVariables);
+    }
+    if (mask == &line_mask) {
+        free_line_mask(&line_mask);
+    }
+    free(arith_line);
+
+    return newline;
+}
+
 /*
 ** This function is partially implemented for you, but you may
 ** scrap the implementation as long as it produces the same result.
@@ -884,26 +1668,62 @@ char *create_new_line(RemovedVariables *removed_variables, const char *line, cha
 ** system calls fail and the shell needs to exit.
 */
 char *replace_variables_mk_line(const char *line, Variable *variables){
-    RemovedVariables *removedVariables = variable_names(line);
-    int num_removed = removedVariables->num_removed;
-    char **values_to_substitute = values_from_removed_variables(removedVariables, variables);
-    char *newline = create_new_line(removedVariables, line, values_to_substitute);
+    return substitute_variables(line, NULL, variables, NULL, NULL);
+}
 
-    for (int i = 0; i < num_removed; i++) {
-        free(removedVariables->var_names[i]);
-    }
-    free(removedVariables->var_names);
-    free(removedVariables);
+/*
+** Reentrant replace_variables_mk_line, against the variables of a
+** context: ${VAR:=word} assigns to them and bumps the generation of the
+** context, where replace_variables_mk_line only substitutes word.
+*/
+char *replace_variables_r(ParserContext *context, const char *line){
+    return substitute_variables(line, NULL, context->variables, context, NULL);
+}
 
-    for (int i = 0; i < num_removed; i++) {
-        free(values_to_substitute[i]);
-    }
-    free(values_to_substitute);
 
-    return newline;
+/**
+ * Free the commands of a single pipeline, but not the pipelines after it.
+ *
+ * @param command The first command of the pipeline.
+ */
+void free_pipeline(Command *command){
+    Command *curr_command = command;
+    while (curr_command != NULL) {
+        free(curr_command->exec_path);
+        free(curr_command->redir_in_path);
+        free(curr_command->redir_out_path);
+
+        int i = 0;
+        while (curr_command->args[i] != NULL) {
+            free(curr_command->args[i]);
+            i++;
+        }
+        free(curr_command->args);
+        free_command(curr_command->fanout);
+        free_command(curr_command->group);
+        free_fd_redirections(curr_command->fd_redirections);
+        free(curr_command->path_value);
+
+        Command* next_command = curr_command->next;
+        free(curr_command);
+        curr_command = next_command;
+    }
 }
 
+void free_command(Command *command){
+    while (command != NULL) {
+        Command *next_pipeline = command->next_pipeline;
+        free_pipeline(command);
+        command = next_pipeline;
+    }
+}
 
 void free_variable(Variable *var, uint8_t recursive){
-    // TODO:
+    while (var != NULL) {
+        Variable *next_var = var->next;
+        free(var->name);
+        free(var->value);
+        free(var);
+        var = recursive ? next_var : NULL;
+    }
 }
\ No newline at end of file
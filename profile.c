@@ -0,0 +1,178 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// The stacks sampled so far, PROFILE_MAX_DEPTH frames each, leaf first.
+// Both threads of the shell may be sampled, so slots are taken atomically
+static void **samples = NULL;
+static uint8_t *sample_depths = NULL;
+static uint32_t num_samples = 0;
+static uint64_t dropped_samples = 0;
+
+static FILE *profile_file = NULL;
+static const char *profile_path = NULL;
+
+
+/**
+ * Take a sample of the stack the shell was interrupted in.
+ *
+ * @param sig The signal received.
+ */
+void sample_stack(int sig) {
+    int saved_errno = errno;
+    uint32_t slot = __atomic_fetch_add(&num_samples, 1, __ATOMIC_RELAXED);
+    if (slot >= PROFILE_MAX_SAMPLES) {
+        __atomic_fetch_add(&dropped_samples, 1, __ATOMIC_RELAXED);
+        errno = saved_errno;
+        return;
+    }
+
+    // the first frames are this handler and the signal trampoline
+    void *frames[PROFILE_MAX_DEPTH + PROFILE_SKIPPED_FRAMES];
+    int depth = backtrace(frames, PROFILE_MAX_DEPTH + PROFILE_SKIPPED_FRAMES) - PROFILE_SKIPPED_FRAMES;
+    depth = depth < 0 ? 0 : depth;
+    memcpy(samples + (size_t) slot * PROFILE_MAX_DEPTH, frames + PROFILE_SKIPPED_FRAMES,
+           depth * sizeof(void *));
+    sample_depths[slot] = depth;
+    errno = saved_errno;
+}
+
+/*
+** Starts sampling the shell's own stack every PROFILE_INTERVAL_USEC of
+** the CPU time it uses, for --profile. Time spent waiting for children
+** is not sampled, only what the shell itself runs.
+**
+** Returns 0 on success, -1 if the profile file could not be created.
+*/
+int start_profile(const char *file_path) {
+    // opened now, so a later cd does not move it
+    profile_file = open_shell_stream(file_path, "we");
+    if (profile_file == NULL) {
+        ERR_PRINT(ERR_PROFILE, file_path, strerror(errno));
+        return -1;
+    }
+    profile_path = file_path;
+    samples = malloc((size_t) PROFILE_MAX_SAMPLES * PROFILE_MAX_DEPTH * sizeof(void *));
+    sample_depths = malloc(PROFILE_MAX_SAMPLES);
+
+    // backtrace loads the unwinder on first use, which must not happen in the handler
+    void *frame;
+    backtrace(&frame, 1);
+
+    struct sigaction sample_action = {0};
+    sample_action.sa_handler = sample_stack;
+    sample_action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &sample_action, NULL);
+
+    struct itimerval interval = {{0, PROFILE_INTERVAL_USEC}, {0, PROFILE_INTERVAL_USEC}};
+    setitimer(ITIMER_PROF, &interval, NULL);
+    return 0;
+}
+
+/**
+ * Append the name of a frame to a folded stack: its function if the
+ * shell exports it, else the object it is in, else its address.
+ *
+ * @param stream The folded stack.
+ * @param address The return address of the frame, or the sampled address of the leaf.
+ */
+void write_frame_name(FILE *stream, void *address) {
+    Dl_info info;
+    if (dladdr(address, &info) != 0 && info.dli_sname != NULL) {
+        fputs(info.dli_sname, stream);
+    } else if (info.dli_fname != NULL) {
+        const char *name = strrchr(info.dli_fname, '/');
+        fprintf(stream, "[%s]", name == NULL ? info.dli_fname : name + 1);
+    } else {
+        fprintf(stream, "%p", address);
+    }
+}
+
+/**
+ * Order two folded stacks, for qsort.
+ *
+ * @param a Pointer to the first stack.
+ * @param b Pointer to the second stack.
+ * @return Negative, zero or positive as a goes before, with or after b.
+ */
+int compare_folded_stacks(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * Get the CPU time of a getrusage result.
+ *
+ * @param usage The usage.
+ * @return The user and system time, in seconds.
+ */
+double usage_seconds(const struct rusage *usage) {
+    return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6 +
+           usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
+
+/*
+** Stops sampling and writes the samples in the folded stack format of
+** flamegraph tools, "main;run_script;parse_line 42" with the root frame
+** first, one line per distinct stack. A summary of the samples, and of
+** the CPU time of the shell against that of its children, goes to stderr.
+*/
+void stop_profile(void) {
+    if (profile_file == NULL) {
+        return;
+    }
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &off, NULL);
+    signal(SIGPROF, SIG_IGN);
+
+    uint32_t count = num_samples < PROFILE_MAX_SAMPLES ? num_samples : PROFILE_MAX_SAMPLES;
+    char **stacks = malloc((count + 1) * sizeof(char *));
+    for (uint32_t i = 0; i < count; i++) {
+        size_t length;
+        FILE *stack = open_memstream(&stacks[i], &length);
+        void **frames = samples + (size_t) i * PROFILE_MAX_DEPTH;
+        for (int j = sample_depths[i] - 1; j >= 0; j--) {
+            // a return address may already be past the end of its caller
+            write_frame_name(stack, j == 0 ? frames[j] : (char *) frames[j] - 1);
+            if (j > 0) {
+                fputc(';', stack);
+            }
+        }
+        fclose(stack);
+    }
+    qsort(stacks, count, sizeof(char *), compare_folded_stacks);
+
+    uint32_t run = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        run++;
+        if (i + 1 == count || strcmp(stacks[i], stacks[i + 1]) != 0) {
+            fprintf(profile_file, "%s %u\n", stacks[i], run);
+            run = 0;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        free(stacks[i]);
+    }
+    free(stacks);
+    fclose(profile_file);
+    profile_file = NULL;
+
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    fprintf(stderr, "profile: %u samples every %dus in %s (%lu dropped); "
+            "cpu: shell %.3fs, children %.3fs\n", count, PROFILE_INTERVAL_USEC, profile_path,
+            (unsigned long) dropped_samples, usage_seconds(&self), usage_seconds(&children));
+
+    free(samples);
+    free(sample_depths);
+    samples = NULL;
+    sample_depths = NULL;
+}
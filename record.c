@@ -0,0 +1,473 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <time.h>
+
+/*
+** A session record is a text file of tab separated records, one per line,
+** after a RECORD_MAGIC header:
+**
+**   L <ns since start> <cwd> <line>   a line the shell ran
+**   C <line>                          a further line of the block above
+**   V <name> <value>                  a variable the line(s) above set
+**
+** Fields escape '\\', tab and newline with a backslash.
+*/
+
+/*
+** A copy of the variables as of the last diff, to find what a line set.
+*/
+typedef struct VariableDiff {
+    Variable *previous;
+    uint64_t generation;
+} VariableDiff;
+
+/*
+** One line of a record being replayed, with the rest of its block and
+** the variables it set when it was recorded.
+*/
+typedef struct ReplayUnit {
+    uint64_t offset;
+    char *cwd;
+    char *line;
+    char *body;
+    size_t body_length;
+    FILE *body_stream;
+    char *expected;
+    size_t expected_length;
+    FILE *expected_stream;
+} ReplayUnit;
+
+/*
+** What a replay measured so far.
+*/
+typedef struct ReplayReport {
+    uint64_t lines;
+    uint64_t diverged;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+} ReplayReport;
+
+static FILE *record_file = NULL;
+static struct timespec record_start;
+static VariableDiff record_diff = {NULL, 0};
+
+
+/**
+ * Get the nanoseconds from one time on the monotonic clock to another.
+ *
+ * @param start The earlier time.
+ * @param end The later time.
+ * @return The nanoseconds in between.
+ */
+uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+/**
+ * Write a field of a record, escaping backslashes, tabs and newlines.
+ *
+ * @param stream The record.
+ * @param field The field to write.
+ */
+void write_record_field(FILE *stream, const char *field) {
+    for (const char *c = field; *c != '\0'; c++) {
+        if (*c == '\\') {
+            fputs("\\\\", stream);
+        } else if (*c == '\t') {
+            fputs("\\t", stream);
+        } else if (*c == '\n') {
+            fputs("\\n", stream);
+        } else {
+            fputc(*c, stream);
+        }
+    }
+}
+
+/**
+ * Undo the escaping of write_record_field, in place.
+ *
+ * @param field The field to unescape.
+ */
+void unescape_record_field(char *field) {
+    char *out = field;
+    for (char *c = field; *c != '\0'; c++) {
+        if (*c == '\\' && c[1] != '\0') {
+            c++;
+            *out++ = *c == 't' ? '\t' : *c == 'n' ? '\n' : *c;
+        } else {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+}
+
+/**
+ * Copy a variables list.
+ *
+ * @param variables The head of the list.
+ * @return The head of the copy.
+ */
+Variable *copy_variables(Variable *variables) {
+    Variable *head = NULL;
+    Variable **tail = &head;
+    for (Variable *curr = variables; curr != NULL; curr = curr->next) {
+        Variable *copy = malloc(sizeof(Variable));
+        copy->name = strdup(curr->name);
+        copy->value = strdup(curr->value);
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+    }
+    return head;
+}
+
+/**
+ * Write a V record for every variable set since the last diff, and
+ * remember the variables for the next one.
+ *
+ * @param diff The variables as of the last diff.
+ * @param variables The head of the variables list.
+ * @param stream Where to write the records.
+ */
+void write_variable_diff(VariableDiff *diff, Variable *variables, FILE *stream) {
+    if (diff->generation == variable_generation()) {
+        return;
+    }
+    for (Variable *curr = variables; curr != NULL; curr = curr->next) {
+        Variable *old = diff->previous;
+        while (old != NULL && strcmp(old->name, curr->name) != 0) {
+            old = old->next;
+        }
+        if (old == NULL || strcmp(old->value, curr->value) != 0) {
+            fprintf(stream, "%c\t", RECORD_VARIABLE);
+            write_record_field(stream, curr->name);
+            fputc('\t', stream);
+            write_record_field(stream, curr->value);
+            fputc('\n', stream);
+        }
+    }
+    free_variable(diff->previous, NON_ZERO_BYTE);
+    diff->previous = copy_variables(variables);
+    diff->generation = variable_generation();
+}
+
+/*
+** Starts recording the session to a file, for --record=FILE: every
+** input line from then on, and what each one changed in the variables.
+**
+** Returns 0 on success, -1 if the file could not be created.
+*/
+int start_recording(const char *file_path, Variable *variables) {
+    record_file = open_shell_stream(file_path, "we");
+    if (record_file == NULL) {
+        ERR_PRINT(ERR_RECORD, file_path, strerror(errno));
+        return -1;
+    }
+    // a record is worth most when the session ends badly, so it is kept current
+    setvbuf(record_file, NULL, _IOLBF, 0);
+    fprintf(record_file, RECORD_MAGIC "\n");
+    clock_gettime(CLOCK_MONOTONIC, &record_start);
+    record_diff.previous = copy_variables(variables);
+    record_diff.generation = variable_generation();
+    return 0;
+}
+
+/*
+** Records a raw input line, if recording: a RECORD_LINE is a line the
+** shell runs, with the time since recording started and the working
+** directory; a RECORD_CONTINUATION is a further line of an if, while or
+** for block. Before a RECORD_LINE, the variables the previous line set
+** are recorded, so variables is only needed for those.
+*/
+void record_line(char kind, const char *line, Variable *variables) {
+    if (record_file == NULL) {
+        return;
+    }
+    if (kind == RECORD_CONTINUATION) {
+        fprintf(record_file, "%c\t", RECORD_CONTINUATION);
+        write_record_field(record_file, line);
+        fputc('\n', record_file);
+        return;
+    }
+
+    write_variable_diff(&record_diff, variables, record_file);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char cwd[MAX_PATH_STR];
+    if (getcwd(cwd, MAX_PATH_STR) == NULL) {
+        cwd[0] = '\0';
+    }
+    fprintf(record_file, "%c\t%llu\t", RECORD_LINE,
+            (unsigned long long) elapsed_ns(&record_start, &now));
+    write_record_field(record_file, cwd);
+    fputc('\t', record_file);
+    write_record_field(record_file, line);
+    fputc('\n', record_file);
+}
+
+/*
+** Records what the last line set, and closes the record.
+*/
+void stop_recording(Variable *variables) {
+    if (record_file == NULL) {
+        return;
+    }
+    write_variable_diff(&record_diff, variables, record_file);
+    fclose(record_file);
+    record_file = NULL;
+    free_variable(record_diff.previous, NON_ZERO_BYTE);
+    record_diff.previous = NULL;
+}
+
+/**
+ * Free what a replayed line holds and get it ready for the next one.
+ *
+ * @param unit The line.
+ */
+void clear_replay_unit(ReplayUnit *unit) {
+    free(unit->cwd);
+    free(unit->line);
+    if (unit->body_stream != NULL) {
+        fclose(unit->body_stream);
+    }
+    if (unit->expected_stream != NULL) {
+        fclose(unit->expected_stream);
+    }
+    free(unit->body);
+    free(unit->expected);
+    memset(unit, 0, sizeof(ReplayUnit));
+}
+
+/**
+ * Run one line of a record, with its block if it starts one, the way
+ * run_interactive would.
+ *
+ * @param unit The line.
+ * @param root Pointer to the head of the variables list.
+ * @return 0 if the shell should go on, -1 if it has to stop.
+ */
+int run_replay_unit(ReplayUnit *unit, Variable **root) {
+    char *start = unit->line;
+    trim_whitespace_leading(&start);
+
+    if (is_block_start(start)) {
+        fflush(unit->body_stream);
+        FILE *body = fmemopen(unit->body, unit->body_length, "r");
+        if (body == NULL) {
+            perror("fmemopen");
+            return -1;
+        }
+        Block *block = compile_block(start, body, NULL, *root);
+        fclose(body);
+        if (block == (Block *) -1) {
+            ERR_PRINT(ERR_PARSING_LINE);
+            return 0;
+        }
+        int status = run_block(block, root);
+        free_block(block);
+        return status < 0 ? -1 : 0;
+    }
+
+    Command *commands = parse_line_cached(unit->line, root);
+    if (commands == (Command *) -1) {
+        ERR_PRINT(ERR_PARSING_LINE);
+        return 0;
+    }
+    if (commands == NULL) {
+        return 0;
+    }
+    int *last_ret_code_pt = execute_line(commands);
+    if (last_ret_code_pt == (int *) -1) {
+        ERR_PRINT(ERR_EXECUTE_LINE);
+        return -1;
+    }
+    free(last_ret_code_pt);
+    return 0;
+}
+
+/**
+ * Replay one line of a record: wait for its time if paced, move to its
+ * working directory, run it, and compare the variables it set with the
+ * recorded ones.
+ *
+ * @param unit The line.
+ * @param paced_start When the replay started if paced, NULL to run at once.
+ * @param diff The variables as of the previous line.
+ * @param report The report to add the line to.
+ * @param root Pointer to the head of the variables list.
+ * @return 0 if the shell should go on, -1 if it has to stop.
+ */
+int replay_unit(ReplayUnit *unit, const struct timespec *paced_start, VariableDiff *diff,
+                ReplayReport *report, Variable **root) {
+    if (paced_start != NULL) {
+        struct timespec due = *paced_start;
+        due.tv_sec += unit->offset / 1000000000ULL;
+        due.tv_nsec += unit->offset % 1000000000ULL;
+        if (due.tv_nsec >= 1000000000L) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+    }
+
+    char cwd[MAX_PATH_STR];
+    if (*unit->cwd != '\0' && (getcwd(cwd, MAX_PATH_STR) == NULL || strcmp(cwd, unit->cwd) != 0) &&
+        chdir(unit->cwd) < 0) {
+        ERR_PRINT(ERR_REPLAY, unit->cwd, strerror(errno));
+    }
+
+    record_line(RECORD_LINE, unit->line, *root);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = run_replay_unit(unit, root);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t ns = elapsed_ns(&start, &end);
+    report->lines++;
+    report->buckets[latency_bucket(ns)]++;
+    if (ns > report->max_ns) {
+        report->max_ns = ns;
+    }
+
+    char *actual = NULL;
+    size_t actual_length = 0;
+    FILE *actual_stream = open_memstream(&actual, &actual_length);
+    write_variable_diff(diff, *root, actual_stream);
+    fclose(actual_stream);
+    fflush(unit->expected_stream);
+    if (actual_length != unit->expected_length ||
+        memcmp(actual, unit->expected, actual_length) != 0) {
+        report->diverged++;
+        fprintf(stderr, "Replayed line %lu set other variables than recorded: %s\n",
+                (unsigned long) report->lines, unit->line);
+    }
+    free(actual);
+    return status;
+}
+
+/**
+ * Print what a replay measured on stderr.
+ *
+ * @param report The report of the replay.
+ * @param total_ns How long the whole replay took.
+ */
+void print_replay_report(const ReplayReport *report, uint64_t total_ns) {
+    fprintf(stderr, "replayed %lu lines in %.3fs, %lu diverged\n", (unsigned long) report->lines,
+            total_ns / 1e9, (unsigned long) report->diverged);
+    // the bound of the slowest bucket may be past the slowest line
+    int percents[] = {50, 90, 99};
+    fprintf(stderr, "latency ns:");
+    for (size_t i = 0; i < sizeof(percents) / sizeof(percents[0]); i++) {
+        uint64_t ns = latency_percentile(report->buckets, report->lines, percents[i]);
+        fprintf(stderr, " p%d %llu,", percents[i],
+                (unsigned long long) (ns < report->max_ns ? ns : report->max_ns));
+    }
+    fprintf(stderr, " max %llu\n", (unsigned long long) report->max_ns);
+
+    // quarter powers of two are too fine to read, so they are shown by power of two
+    for (int power = 0; power < LATENCY_BUCKETS / 4; power++) {
+        uint64_t count = 0;
+        for (int i = power * 4; i < power * 4 + 4; i++) {
+            count += report->buckets[i];
+        }
+        if (count > 0) {
+            fprintf(stderr, "  <= %12llu ns: %lu\n",
+                    (unsigned long long) latency_bucket_limit(power * 4 + 3), (unsigned long) count);
+        }
+    }
+}
+
+/*
+** Runs the lines of a record made with --record, for --replay=FILE and
+** --replay-paced=FILE: as fast as possible, or if paced, each at the
+** time it was recorded at. Every line runs in the working directory it
+** was recorded in.
+**
+** A latency histogram of the lines, and the lines whose variables ended
+** up different from the recording, are reported on stderr.
+**
+** Returns 0 on success, -1 if the record could not be read.
+*/
+int run_replay(const char *file_path, uint8_t paced, Variable **root) {
+    FILE *file = open_shell_stream(file_path, "re");
+    if (file == NULL) {
+        ERR_PRINT(ERR_REPLAY, file_path, strerror(errno));
+        return -1;
+    }
+    char *record = NULL;
+    size_t capacity = 0;
+    ssize_t length = getline(&record, &capacity, file);
+    if (length < 0 || strncmp(record, RECORD_MAGIC "\n", length) != 0) {
+        ERR_PRINT(ERR_REPLAY_FORMAT, file_path);
+        free(record);
+        fclose(file);
+        return -1;
+    }
+
+    ReplayUnit unit;
+    memset(&unit, 0, sizeof(ReplayUnit));
+    ReplayReport report;
+    memset(&report, 0, sizeof(ReplayReport));
+    VariableDiff diff = {copy_variables(*root), variable_generation()};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int status = 0;
+    while (status == 0) {
+        length = getline(&record, &capacity, file);
+        if (length > 0 && record[length - 1] == '\n') {
+            record[--length] = '\0';
+        }
+
+        // a line runs once the records of its block and its variables are read
+        if (length < 0 || record[0] == RECORD_LINE) {
+            if (unit.line != NULL) {
+                status = replay_unit(&unit, paced ? &start : NULL, &diff, &report, root);
+                clear_replay_unit(&unit);
+            }
+            if (length < 0) {
+                break;
+            }
+        }
+
+        // fields may be empty, so they are split with strsep
+        char *rest = record;
+        char *kind = strsep(&rest, "\t");
+        if (*kind == RECORD_LINE) {
+            char *offset = strsep(&rest, "\t");
+            char *cwd = strsep(&rest, "\t");
+            if (cwd == NULL) {
+                continue;
+            }
+            unescape_record_field(cwd);
+            if (rest != NULL) {
+                unescape_record_field(rest);
+            }
+            unit.offset = strtoull(offset, NULL, 10);
+            unit.cwd = strdup(cwd);
+            unit.line = strdup(rest == NULL ? "" : rest);
+            unit.body_stream = open_memstream(&unit.body, &unit.body_length);
+            unit.expected_stream = open_memstream(&unit.expected, &unit.expected_length);
+        } else if (*kind == RECORD_CONTINUATION && unit.line != NULL && rest != NULL) {
+            unescape_record_field(rest);
+            fprintf(unit.body_stream, "%s\n", rest);
+        } else if (*kind == RECORD_VARIABLE && unit.line != NULL && rest != NULL) {
+            // compared as written, since the replay writes its own the same way
+            fprintf(unit.expected_stream, "%c\t%s\n", RECORD_VARIABLE, rest);
+        }
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    print_replay_report(&report, elapsed_ns(&start, &end));
+
+    clear_replay_unit(&unit);
+    free_variable(diff.previous, NON_ZERO_BYTE);
+    free(record);
+    fclose(file);
+    return status;
+}
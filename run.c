@@ -29,18 +29,465 @@ int cd_cscshell(const char *target_dir){
     return 0;
 }
 
-/*
-** Executes a single "line" of commands (through pipes)
-** If a command fails, the rest of the line should not be executed.
-**
-** The error code from the last command is returned through a pointer
-** to a heap integer on success. If the line is a `cd` command, the
-** return value of `cd_cscshell` is stored by the heap int.
-** -- If there are no commands to execute, returns NULL
-** -- If there were any errors starting any commands,
-**    returns (pointer value) -1
-*/
-int *execute_line(Command *head){
+/**
+ * Close the files the numbered redirections of a command have open.
+ *
+ * @param command The command.
+ */
+void close_fd_redirections(Command *command) {
+    for (FdRedirection *redirection = command->fd_redirections; redirection != NULL;
+         redirection = redirection->next) {
+        if (redirection->opened_fd >= 0) {
+            close(redirection->opened_fd);
+            redirection->opened_fd = -1;
+        }
+    }
+}
+
+/**
+ * Close every file descriptor a command would hand to its child.
+ *
+ * @param command The command.
+ */
+void close_command_fds(Command *command) {
+    if (command->stdin_fd != STDIN_FILENO) {
+        close(command->stdin_fd);
+        command->stdin_fd = STDIN_FILENO;
+    }
+    if (command->stdout_fd != STDOUT_FILENO) {
+        close(command->stdout_fd);
+        command->stdout_fd = STDOUT_FILENO;
+    }
+    close_fd_redirections(command);
+}
+
+/**
+ * Close every file descriptor a line of commands would hand to its children.
+ *
+ * @param head The first command of the line.
+ */
+void close_line_fds(Command *head) {
+    for (Command *command = head; command != NULL; command = command->next) {
+        close_command_fds(command);
+    }
+}
+
+/**
+ * Open the redirections of a single command, see open_redirections.
+ *
+ * @param command The command.
+ * @return 0 on success, -1 if any redirection could not be opened. In that case
+ *         none of the command's file descriptors are left open.
+ */
+int open_command_redirections(Command *command) {
+    command->stdin_fd = STDIN_FILENO;
+    command->stdout_fd = STDOUT_FILENO;
+    for (FdRedirection *redirection = command->fd_redirections; redirection != NULL;
+         redirection = redirection->next) {
+        redirection->opened_fd = -1;
+    }
+
+    if (command->redir_in_path != NULL) {
+        int fd = open(command->redir_in_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            ERR_PRINT(ERR_REDIR, command->redir_in_path, strerror(errno));
+            close_command_fds(command);
+            return -1;
+        }
+        command->stdin_fd = fd;
+    }
+    if (command->redir_out_path != NULL) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        flags |= command->redir_append ? O_APPEND : O_TRUNC;
+        int fd = open(command->redir_out_path, flags, 0666);
+        if (fd < 0) {
+            ERR_PRINT(ERR_REDIR, command->redir_out_path, strerror(errno));
+            close_command_fds(command);
+            return -1;
+        }
+        command->stdout_fd = fd;
+    }
+    for (FdRedirection *redirection = command->fd_redirections; redirection != NULL;
+         redirection = redirection->next) {
+        if (redirection->path == NULL) {
+            continue;
+        }
+        // kept above the descriptors the child's redirections go to
+        redirection->opened_fd = move_shell_fd(open(redirection->path,
+                                                     redirection->flags | O_CLOEXEC, 0666));
+        if (redirection->opened_fd < 0) {
+            ERR_PRINT(ERR_REDIR, redirection->path, strerror(errno));
+            close_command_fds(command);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Open the redirections of every command of a line in the shell itself.
+ *
+ * The file descriptors are close-on-exec, and are stored as the stdin_fd and
+ * stdout_fd of their command, or the opened_fd of its numbered redirections,
+ * for the child to dup2 into place.
+ *
+ * @param head The first command of the line.
+ * @return 0 on success, -1 if any redirection could not be opened. In that case
+ *         no file descriptor is left open.
+ */
+int open_redirections(Command *head) {
+    // commands may be reused from a template or the parse cache, and
+    // close_line_fds must not see the descriptors of an earlier run
+    for (Command *command = head; command != NULL; command = command->next) {
+        command->stdin_fd = STDIN_FILENO;
+        command->stdout_fd = STDOUT_FILENO;
+        for (FdRedirection *redirection = command->fd_redirections; redirection != NULL;
+             redirection = redirection->next) {
+            redirection->opened_fd = -1;
+        }
+    }
+
+    for (Command *command = head; command != NULL; command = command->next) {
+        if (open_command_redirections(command) < 0) {
+            close_line_fds(head);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Connect the stages of a pipeline with pipes. A redirection takes
+ * precedence over the pipe, whose end is then closed unused.
+ *
+ * @param head The first command of the pipeline, with its redirections open.
+ * @return 0 on success, -1 if a pipe could not be created.
+ */
+int connect_stages(Command *head) {
+    for (Command *command = head; command->next != NULL; command = command->next) {
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            perror("pipe");
+            return -1;
+        }
+        count_pipe();
+        if (command->redir_out_path == NULL) {
+            command->stdout_fd = pipe_fds[1];
+        } else {
+            close(pipe_fds[1]);
+        }
+        if (command->next->redir_in_path == NULL) {
+            command->next->stdin_fd = pipe_fds[0];
+        } else {
+            close(pipe_fds[0]);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Create the pipes of a fan-out: one the last stage of the producer writes
+ * to, and one for each consumer to read from. The shell keeps the other
+ * ends, for copy_fanout. A redirection takes precedence over the pipe.
+ *
+ * @param pipelines The producer, then each of its consumers, with their redirections open.
+ * @param num_pipelines The number of pipelines.
+ * @param fanout_fds Filled with the read end of the producer's pipe, then the write
+ *                   end of each consumer's pipe, -1 for the redirected ones.
+ * @return 0 on success, -1 if a pipe could not be created, in which case
+ *         none of fanout_fds is left open.
+ */
+int open_fanout_pipes(Command **pipelines, int num_pipelines, int *fanout_fds) {
+    Command *last = pipelines[0];
+    while (last->next != NULL) {
+        last = last->next;
+    }
+
+    for (int i = 0; i < num_pipelines; i++) {
+        fanout_fds[i] = -1;
+        if ((i == 0 ? last->redir_out_path : pipelines[i]->redir_in_path) != NULL) {
+            continue;
+        }
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            perror("pipe");
+            for (int j = 0; j < i; j++) {
+                if (fanout_fds[j] >= 0) {
+                    close(fanout_fds[j]);
+                }
+            }
+            return -1;
+        }
+        count_pipe();
+        fcntl(pipe_fds[0], F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+        if (i == 0) {
+            last->stdout_fd = pipe_fds[1];
+            fanout_fds[i] = pipe_fds[0];
+        } else {
+            pipelines[i]->stdin_fd = pipe_fds[0];
+            fanout_fds[i] = pipe_fds[1];
+        }
+    }
+    return 0;
+}
+
+/**
+ * Open a redirection of a group, with its path expanded against the
+ * variables as the group finds them.
+ *
+ * @param path The path, as written after the group.
+ * @param flags The flags to open it with, on top of O_CLOEXEC.
+ * @param root Pointer to the head of the linked list of variables.
+ * @return The file descriptor, or -1 if it could not be opened.
+ */
+int open_group_redirection(const char *path, int flags, Variable **root) {
+    char *expanded = replace_variables(path, root);
+    if (expanded == NULL || expanded == (char *) -1) {
+        ERR_PRINT(ERR_PARSING_LINE);
+        return -1;
+    }
+    int fd = open(expanded, flags | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        ERR_PRINT(ERR_REDIR, expanded, strerror(errno));
+    }
+    free(expanded);
+    return fd;
+}
+
+/**
+ * Execute a { } or ( ) group, see execute_line. Its redirections are
+ * opened once and put in place of the shell's own stdin and stdout, for
+ * every pipeline of its list to inherit.
+ *
+ * @param group The group, see build_group.
+ * @return The error code of its list, as execute_line returns it.
+ */
+int *execute_group(Command *group) {
+    Variable **root = get_builtin_root();
+    int *error_code = malloc(sizeof(int));
+    *error_code = 0;
+
+    int targets[2] = {STDIN_FILENO, STDOUT_FILENO};
+    int fds[2] = {-1, -1};
+    if (group->redir_in_path != NULL) {
+        fds[0] = open_group_redirection(group->redir_in_path, O_RDONLY, root);
+    }
+    if (group->redir_out_path != NULL && (group->redir_in_path == NULL || fds[0] >= 0)) {
+        int flags = O_WRONLY | O_CREAT | (group->redir_append ? O_APPEND : O_TRUNC);
+        fds[1] = open_group_redirection(group->redir_out_path, flags, root);
+    }
+    if ((group->redir_in_path != NULL && fds[0] < 0) || (group->redir_out_path != NULL && fds[1] < 0)) {
+        if (fds[0] >= 0) {
+            close(fds[0]);
+        }
+        *error_code = 1;
+        return error_code;
+    }
+
+    // what the shell printed so far must not end up in the redirection
+    fflush(stdout);
+
+    if (group->subshell) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            for (int i = 0; i < 2; i++) {
+                if (fds[i] >= 0) {
+                    close(fds[i]);
+                }
+            }
+            free(error_code);
+            return (int *) -1;
+        }
+        if (pid == 0) {
+            for (int i = 0; i < 2; i++) {
+                if (fds[i] >= 0 && dup2(fds[i], targets[i]) < 0) {
+                    perror("dup2");
+                    _exit(EXIT_FAILURE);
+                }
+            }
+            int *list_code = execute_line(group->group);
+            int status = list_code == (int *) -1 ? EXIT_FAILURE : list_code == NULL ? 0 : *list_code;
+            fflush(stdout);
+            _exit(status);
+        }
+
+        count_fork();
+        for (int i = 0; i < 2; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        *error_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        return error_code;
+    }
+
+    // the shell's own streams are put back once the list is done
+    int saved[2] = {-1, -1};
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] < 0) {
+            continue;
+        }
+        saved[i] = fcntl(targets[i], F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+        if (saved[i] < 0 || dup2(fds[i], targets[i]) < 0) {
+            perror("dup2");
+            *error_code = -1;
+        }
+        close(fds[i]);
+    }
+    if (fds[0] >= 0) {
+        forget_read_buffer();
+    }
+    if (*error_code == 0) {
+        free(error_code);
+        error_code = execute_line(group->group);
+        fflush(stdout);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], targets[i]);
+            close(saved[i]);
+        }
+    }
+    if (fds[0] >= 0) {
+        forget_read_buffer();
+    }
+    return error_code;
+}
+
+/**
+ * Put a file descriptor in place of one of the shell's until
+ * restore_shell_fds, keeping a copy of the one it replaces.
+ *
+ * @param source_fd The file descriptor to put in place, or FD_CLOSE to close fd.
+ * @param fd The shell's file descriptor to replace.
+ * @param saved Set to a close-on-exec copy of fd, or -1 if it was not open.
+ * @return 0 on success, -1 on error, with fd left as it was.
+ */
+int swap_shell_fd(int source_fd, int fd, int *saved) {
+    *saved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+    if (*saved < 0 && errno != EBADF) {
+        perror("fcntl");
+        return -1;
+    }
+    if (source_fd == FD_CLOSE) {
+        close(fd);
+        return 0;
+    }
+    if (dup2(source_fd, fd) < 0) {
+        ERR_PRINT(ERR_BAD_FD, source_fd, strerror(errno));
+        if (*saved >= 0) {
+            close(*saved);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Put back the file descriptors replaced by swap_shell_fd, last first, so
+ * a descriptor redirected twice ends up as it was before the first.
+ *
+ * @param fds The shell's file descriptors that were replaced.
+ * @param saved The copies swap_shell_fd kept of them.
+ * @param count The number of file descriptors replaced.
+ */
+void restore_shell_fds(int *fds, int *saved, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], fds[i]);
+            close(saved[i]);
+        } else {
+            close(fds[i]);
+        }
+    }
+}
+
+/**
+ * Run a builtin in the shell itself, with its redirections in place of the
+ * shell's own file descriptors until it returns, as for a { } group. The
+ * redirections of an exec are for good instead, see run_builtin.
+ *
+ * @param builtin The builtin.
+ * @param command The command that runs it.
+ * @return The exit status of the builtin, or 1 if a redirection failed.
+ */
+int run_redirected_builtin(const Builtin *builtin, Command *command) {
+    if ((command->redir_in_path == NULL && command->redir_out_path == NULL &&
+         command->fd_redirections == NULL) || strcmp(builtin->name, EXEC) == 0) {
+        return run_builtin(builtin, command);
+    }
+    if (open_command_redirections(command) < 0) {
+        return 1;
+    }
+
+    int max_swaps = 2;
+    for (FdRedirection *redirection = command->fd_redirections; redirection != NULL;
+         redirection = redirection->next) {
+        max_swaps++;
+    }
+    int fds[max_swaps];
+    int saved[max_swaps];
+    int swapped = 0;
+    int failed = 0;
+
+    // what the shell printed so far must not end up in the redirection
+    fflush(stdout);
+    if (command->stdin_fd != STDIN_FILENO) {
+        fds[swapped] = STDIN_FILENO;
+        failed = swap_shell_fd(command->stdin_fd, STDIN_FILENO, &saved[swapped]) < 0;
+        swapped += !failed;
+    }
+    if (!failed && command->stdout_fd != STDOUT_FILENO) {
+        fds[swapped] = STDOUT_FILENO;
+        failed = swap_shell_fd(command->stdout_fd, STDOUT_FILENO, &saved[swapped]) < 0;
+        swapped += !failed;
+    }
+    for (FdRedirection *redirection = command->fd_redirections;
+         redirection != NULL && !failed; redirection = redirection->next) {
+        if (redirection->path == NULL && redirection->source_fd != FD_CLOSE &&
+            !is_user_fd(redirection->source_fd)) {
+            ERR_PRINT(ERR_BAD_FD, redirection->source_fd, strerror(EBADF));
+            failed = 1;
+            break;
+        }
+        int source_fd = redirection->path != NULL ? redirection->opened_fd : redirection->source_fd;
+        fds[swapped] = redirection->fd;
+        failed = swap_shell_fd(source_fd, redirection->fd, &saved[swapped]) < 0;
+        swapped += !failed;
+    }
+    close_command_fds(command);
+
+    // `read` must not take what it buffered from one stdin for the other's
+    int swaps_stdin = 0;
+    for (int i = 0; i < swapped; i++) {
+        swaps_stdin |= fds[i] == STDIN_FILENO;
+    }
+
+    int status = 1;
+    if (!failed) {
+        if (swaps_stdin) {
+            forget_read_buffer();
+        }
+        status = run_builtin(builtin, command);
+        fflush(stdout);
+    }
+    restore_shell_fds(fds, saved, swapped);
+    if (swaps_stdin) {
+        forget_read_buffer();
+    }
+    return status;
+}
+
+/**
+ * Execute a single pipeline, see execute_line.
+ *
+ * @param head The first command of the pipeline.
+ * @return The error code of the pipeline, as execute_line returns it.
+ */
+int *execute_pipeline(Command *head){
     int *error_code = malloc(sizeof(int)); // Allocate memory for error code
     *error_code = 0; // Initialize error code to 0
 
@@ -51,62 +498,129 @@ int *execute_line(Command *head){
         free(error_code);
         return NULL;
     }
+    if (head->group != NULL) {
+        free(error_code);
+        return execute_group(head);
+    }
 
-    // Check for cd
-    while (current_command != NULL) {
-        if (strcmp(current_command->args[0], "cd") == 0) {
-            *error_code = cd_cscshell(current_command->args[1]);
+    // A builtin on its own runs in the shell itself, so that cd or read
+    // change the shell. In a longer pipeline it is forked like any stage.
+    if (head->next == NULL && head->fanout == NULL) {
+        const Builtin *builtin = find_builtin(head->args[0]);
+        if (builtin != NULL) {
+            *error_code = run_redirected_builtin(builtin, head);
             return error_code;
         }
-        current_command = current_command->next;
     }
 
-    current_command = head;
+    // The consumers of a fan-out are set up and started along with the producer
+    Command *last = head;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    int num_pipelines = 1;
+    for (current_command = last->fanout; current_command != NULL;
+         current_command = current_command->next_pipeline) {
+        num_pipelines++;
+    }
+    Command *pipelines[num_pipelines];
+    pipelines[0] = head;
+    current_command = last->fanout;
+    for (int i = 1; i < num_pipelines; i++) {
+        pipelines[i] = current_command;
+        current_command = current_command->next_pipeline;
+    }
 
     int command_count = 0;
-    while (current_command != NULL) {
-        command_count++;
-        current_command = current_command->next;
+    for (int i = 0; i < num_pipelines; i++) {
+        for (current_command = pipelines[i]; current_command != NULL; current_command = current_command->next) {
+            command_count++;
+        }
     }
 
-    int child_file_descriptors[command_count - 1][2];
-    current_command = head;
-    int i = 0;
-    while (current_command->next!= NULL) {
-        int error = pipe(child_file_descriptors[i]);
-        if (error == -1) {
-            perror("pipe");
-            *error_code = -1;
-            return error_code;
+    // Every redirection is opened before anything is spawned,
+    // so a bad path aborts the line without a single fork
+    int opened = 0;
+    while (opened < num_pipelines && open_redirections(pipelines[opened]) == 0) {
+        opened++;
+    }
+    if (opened < num_pipelines) {
+        for (int i = 0; i < opened; i++) {
+            close_line_fds(pipelines[i]);
+        }
+        *error_code = 1;
+        return error_code;
+    }
+
+    int fanout_fds[num_pipelines];
+    int connected = 0;
+    for (int i = 0; i < num_pipelines && connected == 0; i++) {
+        connected = connect_stages(pipelines[i]);
+    }
+    if (connected == 0 && num_pipelines > 1) {
+        connected = open_fanout_pipes(pipelines, num_pipelines, fanout_fds);
+    }
+    if (connected < 0) {
+        for (int i = 0; i < num_pipelines; i++) {
+            close_line_fds(pipelines[i]);
         }
-        current_command->stdout_fd = child_file_descriptors[i][1];
-        current_command->next->stdin_fd = child_file_descriptors[i][0];
-        current_command = current_command->next;
-        i++;
+        *error_code = -1;
+        return error_code;
     }
 
 
+    // a builtin stage must not print again what the shell has buffered
+    fflush(stdout);
+
+    Variable *variables = get_builtin_variables();
+    place_pipeline(head, variables);
+
+    char cgroup_path[MAX_PATH_STR];
+    int cgroup_fd = open_line_cgroup(variables, cgroup_path);
+    for (int i = 0; i < num_pipelines; i++) {
+        for (current_command = pipelines[i]; current_command != NULL; current_command = current_command->next) {
+            current_command->cgroup_fd = cgroup_fd;
+        }
+    }
+
     pid_t children_pid_arr[command_count];
-    current_command = head;
-    i = 0;
-    while (current_command != NULL) {
-        pid_t result = run_command(current_command);
-        if (result == -1) {
-            return error_code;
+    int spawned = 0;
+    pid_t result = 0;
+    for (int i = 0; i < num_pipelines && result >= 0; i++) {
+        for (current_command = pipelines[i]; current_command != NULL; current_command = current_command->next) {
+            result = run_command(current_command);
+            if (result < 0) {
+                // the rest of the line is never started
+                close_line_fds(current_command);
+                for (int rest = i + 1; rest < num_pipelines; rest++) {
+                    close_line_fds(pipelines[rest]);
+                }
+                break;
+            }
+            children_pid_arr[spawned] = result;
+            spawned++;
         }
-        children_pid_arr[i] = result;
-        i++;
-        current_command = current_command->next;
     }
 
-    for (int i = 0; i < command_count; i++) {
+    // the shell copies the producer's output while the whole line runs
+    if (num_pipelines > 1) {
+        if (result < 0 && fanout_fds[0] >= 0) {
+            close(fanout_fds[0]);
+            fanout_fds[0] = -1;
+        }
+        copy_fanout(fanout_fds[0], fanout_fds + 1, num_pipelines - 1);
+    }
+
+    for (int i = 0; i < spawned; i++) {
         int status;
         pid_t pid = children_pid_arr[i];
         waitpid(pid, &status, 0);
         if (WIFEXITED(status)) {
             int exit_status = WEXITSTATUS(status);
             if (exit_status != 0) {
-                perror("invalid exit status");
+                #ifdef DEBUG
+                fprintf(stderr, "invalid exit status: %d\n", exit_status);
+                #endif
                 *error_code = exit_status;
             }
         } else {
@@ -114,7 +628,17 @@ int *execute_line(Command *head){
             *error_code = -1;
         }
     }
-    free_command(current_command);
+
+    if (result == EXEC_FAILED) {
+        *error_code = errno == ENOENT ? EXIT_NOT_FOUND : EXIT_CANNOT_EXEC;
+    }
+    if (cgroup_fd >= 0) {
+        close_line_cgroup(cgroup_fd, cgroup_path, head, *error_code, variables);
+    }
+    if (result < 0 && result != EXEC_FAILED) {
+        free(error_code);
+        return (int *) -1;
+    }
     return error_code;
 
     #ifdef DEBUG
@@ -139,86 +663,239 @@ int *execute_line(Command *head){
 
 }
 
+/**
+ * Get a pipeline of a command list ready to run: its template is
+ * instantiated, or its text is parsed now if it was deferred.
+ *
+ * @param pipeline The pipeline, in a list built by parse_line.
+ * @param built_path The PATH value the list was built against.
+ * @param root Pointer to the head of the linked list of variables.
+ * @return The commands to run, which may be the template itself, NULL if
+ *         there are none (an assignment), or (Command *) -1 on error.
+ */
+Command *prepare_list_pipeline(Command *pipeline, const char *built_path, Variable **root) {
+    if (!pipeline->deferred) {
+        // the template resolved its executables against a PATH assigned over since
+        if (built_path != NULL && *root != NULL && strcmp((*root)->name, PATH_VAR_NAME) == 0 &&
+            strcmp(built_path, (*root)->value) != 0) {
+            unbind_command(pipeline);
+        }
+        return instantiate_command(pipeline, *root);
+    }
+    char line[MAX_SINGLE_LINE];
+    strncpy(line, pipeline->args[0], MAX_SINGLE_LINE - 1);
+    line[MAX_SINGLE_LINE - 1] = '\0';
+    return parse_line(line, root);
+}
+
+/**
+ * Execute a command list, one pipeline at a time, see execute_line.
+ *
+ * && and || bind equally tightly, from left to right, so a pipeline
+ * that is skipped leaves the status as it was for the operator after it.
+ *
+ * @param head The first pipeline of the list.
+ * @return The error code of the last pipeline run, as execute_line returns it.
+ */
+int *execute_list(Command *head){
+    Variable **root = get_builtin_root();
+    int status = 0;
+    ListOperator op = LIST_SEQ;
+
+    for (Command *pipeline = head; pipeline != NULL; pipeline = pipeline->next_pipeline) {
+        uint8_t skip = (op == LIST_AND && status != 0) || (op == LIST_OR && status == 0);
+        op = pipeline->list_op;
+        if (skip) {
+            continue;
+        }
+
+        Command *commands = prepare_list_pipeline(pipeline, head->path_value, root);
+        if (commands == (Command *) -1) {
+            // the rest of the list still runs, so a || can recover from it
+            if (pipeline->deferred) {
+                ERR_PRINT(ERR_PARSING_LINE);
+            }
+            status = pipeline->deferred ? 1 : EXIT_NOT_FOUND;
+            continue;
+        }
+        if (commands == NULL) {
+            status = 0;
+            continue;
+        }
+
+        int *error_code = execute_pipeline(commands);
+        if (commands != pipeline) {
+            free_command(commands);
+        }
+        if (error_code == (int *) -1) {
+            return error_code;
+        }
+        status = *error_code;
+        free(error_code);
+    }
+
+    int *error_code = malloc(sizeof(int));
+    *error_code = status;
+    return error_code;
+}
+
+/*
+** Executes a single "line" of commands (through pipes)
+** If a command fails, the rest of the line should not be executed.
+**
+** The error code from the last command is returned through a pointer
+** to a heap integer on success. If the line is a `cd` command, the
+** return value of `cd_cscshell` is stored by the heap int.
+** If a command cannot be exec'd, the stages after it are never started
+** and the error code is EXIT_NOT_FOUND or EXIT_CANNOT_EXEC.
+** -- If there are no commands to execute, returns NULL
+** -- If there were any errors starting any commands,
+**    returns (pointer value) -1
+**
+** A command list is run one pipeline at a time, skipping the pipeline
+** after a && that failed or after a || that succeeded; its error code is
+** that of the last pipeline run.
+*/
+int *execute_line(Command *head){
+    if (head != NULL && head->list_op != LIST_END) {
+        return execute_list(head);
+    }
+    return execute_pipeline(head);
+}
+
+
+/**
+ * Apply the numbered redirections of a command in the child that runs
+ * it, in order, after its stdin and stdout are in place.
+ *
+ * @param command The command.
+ * @return 0 on success, -1 if a descriptor could not be duplicated.
+ */
+int apply_fd_redirections(Command *command) {
+    for (FdRedirection *redirection = command->fd_redirections; redirection != NULL;
+         redirection = redirection->next) {
+        if (redirection->source_fd == FD_CLOSE) {
+            close(redirection->fd);
+            continue;
+        }
+        if (redirection->path == NULL && !is_user_fd(redirection->source_fd)) {
+            ERR_PRINT(ERR_BAD_FD, redirection->source_fd, strerror(EBADF));
+            return -1;
+        }
+        int source_fd = redirection->path != NULL ? redirection->opened_fd : redirection->source_fd;
+        if (dup2(source_fd, redirection->fd) < 0) {
+            ERR_PRINT(ERR_BAD_FD, source_fd, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
 
 /*
 ** Forks a new process and execs the command
 ** making sure all file descriptors are set up correctly.
+** A builtin is run in the new process instead of exec'd.
 **
-** Parent process returns -1 on error.
+** The child reports a failed execv through a close-on-exec status pipe,
+** so the parent knows whether the command started before returning.
+**
+** Parent process returns -1 on error, or EXEC_FAILED (with errno set to
+** the error of execv) if the child could not exec. In both cases no child
+** is left to wait for.
 ** Any child processes should not return.
 */
 int run_command(Command *command){
-    pid_t pid = fork();
+    int status_pipe[2];
+    if (pipe2(status_pipe, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    // a numbered redirection must not land on the status pipe in the child
+    if (command->fd_redirections != NULL) {
+        status_pipe[0] = move_shell_fd(status_pipe[0]);
+        status_pipe[1] = move_shell_fd(status_pipe[1]);
+    }
+
+    pid_t pid = command->cgroup_fd >= 0 ? fork_into_cgroup(command->cgroup_fd) : fork();
 
     if (pid < 0) {
         perror("Fork failed");
+        close(status_pipe[0]);
+        close(status_pipe[1]);
         return -1;
     } else if (pid == 0) {
-        // Redirect input if needed
-        if (command->redir_in_path != NULL) {
-            FILE* input_file = fopen(command->redir_in_path, "r");
-            if (input_file == NULL) {
-                perror("fopen");
-                exit(EXIT_FAILURE);
-            }
-            if (dup2(fileno(input_file), fileno(stdin)) == -1) {
-                perror("dup2");
-                exit(EXIT_FAILURE);
-            }
+        // Redirections and pipes were all opened by the parent
+        if (command->stdin_fd != STDIN_FILENO &&
+            dup2(command->stdin_fd, STDIN_FILENO) == -1) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+        if (command->stdout_fd != STDOUT_FILENO &&
+            dup2(command->stdout_fd, STDOUT_FILENO) == -1) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
 
-            fclose(input_file);
-        } else{
-            if (dup2(command->stdin_fd, fileno(stdin)) == -1) {
-                perror("dup2");
-            }
+        if (apply_fd_redirections(command) < 0) {
+            _exit(EXIT_FAILURE);
         }
 
-        if (command->redir_out_path != NULL) {
-            // Redirect output if needed
-            FILE *output_file;
-            if (command->redir_append != 0) {
-                output_file = fopen(command->redir_out_path, "a");
-            } else {
-                output_file = fopen(command->redir_out_path, "w");
-            }
+        if (command->cpu >= 0) {
+            pin_to_cpu(command->cpu);
+        }
 
-            if (output_file == NULL) {
-                perror("fopen");
-                exit(EXIT_FAILURE);
-            }
-            if (dup2(fileno(output_file), fileno(stdout)) == -1) {
-                perror("dup2");
-                exit(EXIT_FAILURE);
-            }
-            fclose(output_file);
-        } else {
-            if (dup2(command->stdout_fd, fileno(stdout)) == -1) {
-                perror("dup2");
+        // A builtin stage of a longer pipeline runs in the child itself
+        const Builtin *builtin = find_builtin(command->args[0]);
+        if (builtin != NULL) {
+            if (command->stdin_fd != STDIN_FILENO) {
+                forget_read_buffer();
             }
+            int builtin_status = run_builtin(builtin, command);
+            fflush(stdout);
+            _exit(builtin_status < 0 ? EXIT_FAILURE : builtin_status);
         }
 
-        if (command->stdout_fd != fileno(stdout)) {
-            close(command->stdout_fd);
-        }
-        if (command->stdin_fd != fileno(stdin)) {
-            close(command->stdin_fd);
-        }
-        // Execute the command
-        if (execv(command->exec_path, command->args) == -1) {
+        // Execute the command, the status pipe closes itself on success
+        execv(command->exec_path, command->args);
+
+        int exec_errno = errno;
+        if (write(status_pipe[1], &exec_errno, sizeof(int)) < 0) {
             perror("execv");
-            exit(EXIT_FAILURE);
         }
+        // _exit, so stdio does not touch the streams shared with the shell
+        _exit(exec_errno == ENOENT ? EXIT_NOT_FOUND : EXIT_CANNOT_EXEC);
     } else {
         // Parent Process
+        count_fork();
         if (command->stdout_fd != fileno(stdout)) {
             close(command->stdout_fd);
+            command->stdout_fd = STDOUT_FILENO;
         }
         if (command->stdin_fd != fileno(stdin)) {
             close(command->stdin_fd);
+            command->stdin_fd = STDIN_FILENO;
+        }
+        close_fd_redirections(command);
+
+        // Nothing is read back unless execv failed
+        close(status_pipe[1]);
+        int exec_errno;
+        ssize_t bytes_read;
+        do {
+            bytes_read = read(status_pipe[0], &exec_errno, sizeof(int));
+        } while (bytes_read < 0 && errno == EINTR);
+        close(status_pipe[0]);
+
+        if (bytes_read == sizeof(int)) {
+            waitpid(pid, NULL, 0);
+            count_exec_failure();
+            ERR_PRINT(ERR_EXEC_FAILED, command->exec_path, strerror(exec_errno));
+            errno = exec_errno;
+            return EXEC_FAILED;
         }
         return pid;
     }
-    return 0;
 }
 
 /*
@@ -228,35 +905,68 @@ int run_command(Command *command){
 ** Returns 0 on success, -1 on error
 */
 int run_script(char *file_path, Variable **root){
-    long error;
     char line[MAX_SINGLE_LINE];
 
-    FILE* file = fopen(file_path, "r");
+    // the script stays open while it runs, out of the way of exec 3<file
+    FILE* file = open_shell_stream(file_path, "r");
 
     if (file == NULL) {
         perror("fopen");
         return -1;
     }
 
-    while ((error = (long) fgets(line, MAX_SINGLE_LINE, file)) > 0) {
-        // kill the newline
-        line[strlen(line) - 1] = '\0';
+    // Upcoming lines are compiled while the current one runs
+    ParseAhead *ahead = start_parse_ahead(file, *root);
+    Command *template;
+    while (next_parsed_line(ahead, line, &template, *root)) {
+        record_line(RECORD_LINE, line, *root);
+        char *start = line;
+        trim_whitespace_leading(&start);
+        if (is_block_start(start)) {
+            Block *block = compile_block(start, file, NULL, *root);
+            if (block == (Block *) -1) {
+                ERR_PRINT(ERR_PARSING_LINE);
+                continue;
+            }
+            int status = run_block(block, root);
+            free_block(block);
+            if (status < 0) {
+                stop_parse_ahead(ahead);
+                fclose(file);
+                return -1;
+            }
+            continue;
+        }
 
-        Command *commands = parse_line(line, root);
+        Command *commands;
+        if (template != NULL) {
+            commands = instantiate_command(template, *root);
+        } else {
+            commands = parse_line_cached(line, root);
+        }
         if (commands == (Command *) -1) {
             ERR_PRINT(ERR_PARSING_LINE);
+            free_command(template);
             continue;
         }
         if (commands == NULL) continue;
 
         int *last_ret_code_pt = execute_line(commands);
+        if (template != NULL) {
+            if (commands != template) {
+                free_command(commands);
+            }
+            free_command(template);
+        }
         if (last_ret_code_pt == (int *) -1) {
             ERR_PRINT(ERR_EXECUTE_LINE);
-            free(last_ret_code_pt);
+            stop_parse_ahead(ahead);
+            fclose(file);
             return -1;
         }
         free(last_ret_code_pt);
     }
+    stop_parse_ahead(ahead);
 
     if (fclose(file) == EOF) {
         perror("fclose");
@@ -265,24 +975,5 @@ int run_script(char *file_path, Variable **root){
     printf("\n");
 
 
-    return (int) error;
-}
-
-void free_command(Command *command){
-    Command *curr_command = command;
-    while (curr_command != NULL) {
-        free(command->exec_path);
-        free(command->redir_in_path);
-        free(command->redir_out_path);
-
-        int i = 0;
-        while (command->args[i] != NULL) {
-            free(command->args[i]);
-            i++;
-        }
-
-        Command* next_command = curr_command->next;
-        free(curr_command);
-        curr_command = next_command;
-    }
+    return 0;
 }
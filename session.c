@@ -0,0 +1,152 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <time.h>
+
+/*
+** The shell parses everything against a single variables list, so its
+** parser context only needs to carry the generation from call to call.
+** The builtins and the PATH lookup cache are plugged in as hooks.
+*/
+
+// Bumped every time the variables list changes
+static uint64_t generation = 0;
+
+
+/**
+ * Tell whether a command is one of the shell's builtins.
+ *
+ * @param name The name of the command.
+ * @return 1 if name is a builtin, 0 otherwise.
+ */
+int is_shell_builtin(const char *name) {
+    return find_builtin(name) != NULL;
+}
+
+/**
+ * Set up the parser context of the shell for a variables list.
+ *
+ * @param context The context to set up.
+ * @param variables The head of the variables list, PATH first.
+ */
+void shell_context(ParserContext *context, Variable *variables) {
+    init_parser_context(context, variables);
+    context->generation = generation;
+    context->is_builtin = is_shell_builtin;
+    context->path_lookup = path_cache_lookup;
+    context->path_insert = path_cache_insert;
+}
+
+/**
+ * Keep what a parse changed in the parser context of the shell.
+ *
+ * @param context The context that was parsed with.
+ * @param variables Pointer to the head of the variables list, updated if it changed.
+ */
+void leave_shell_context(const ParserContext *context, Variable **variables) {
+    *variables = context->variables;
+    if (generation != context->generation) {
+        count_variables(context->variables);
+    }
+    generation = context->generation;
+}
+
+/*
+** Parses a single line of text and returns a linked list of commands.
+** The last command in the list has a next pointer that points to NULL.
+**
+** Return possibilities:
+** 1. The first in a list of commands that should execute roughly
+**    simultaneously (see instructions for details).
+**
+** 2. NULL if successfully parsed line, with *no commands*, this happens:
+**      -- Case 1: Empty line
+**      -- Case 2: Line is /exclusively/ a comment (i.e. first non-whitespace
+**                 char is '#'). Comments may also trail commands or assignments.
+**                 You must handle text before "#' characters.
+**      -- Case 3: Shell variable assignment (e.g. VAR=VALUE)
+**          -- The variable should added to the variables list
+**          -- or updated if the variable already exists
+**
+** 3. If there is an error, returns -1 cast as a (Command *)
+ */
+Command *parse_line(char *line, Variable **variables){
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ParserContext context;
+    shell_context(&context, *variables);
+    Command *commands = parse_line_r(&context, line);
+    leave_shell_context(&context, variables);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    count_parse((end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec);
+    return commands;
+}
+
+/*
+** Compiles a single line into a reusable Command template.
+**
+** Unlike parse_line, variable usages are *not* replaced: the stages that
+** hold them, or whose executable cannot be found yet, are marked late_bound
+** and are filled in by instantiate_command.
+** Assignments are not compiled, since they have no commands, and neither
+** are lines with $((...)) or ${...} operators, which must be expanded
+** before they are split.
+**
+** Returns NULL for empty lines, comments, assignments and expansions, (Command *) -1
+** on error, otherwise the first command of the template.
+*/
+Command *compile_line(const char *line, Variable *variables){
+    ParserContext context;
+    shell_context(&context, variables);
+    return compile_line_r(&context, line);
+}
+
+/*
+** Creates a runnable list of commands from a template built by compile_line.
+**
+** Only late_bound stages are touched: their variable usages are replaced with
+** the current values and their executable is resolved if its name was a
+** variable. If no stage is late_bound, the template itself is returned and
+** must not be freed by the caller.
+**
+** Returns (Command *) -1 if an executable could not be resolved.
+*/
+Command *instantiate_command(Command *template, Variable *variables){
+    ParserContext context;
+    shell_context(&context, variables);
+    return instantiate_command_r(&context, template);
+}
+
+/*
+** Adds a variable to the list, or updates it if it already exists.
+** PATH is always kept at the head of the list.
+*/
+void add_variable(const char *name, const char *value, Variable **variables) {
+    ParserContext context;
+    shell_context(&context, *variables);
+    add_variable_r(&context, name, value);
+    leave_shell_context(&context, variables);
+}
+
+/*
+** replace_variables_mk_line for the shell's own variables list, which
+** ${VAR:=word} may add to.
+*/
+char *replace_variables(const char *line, Variable **variables) {
+    ParserContext context;
+    shell_context(&context, *variables);
+    char *replaced = replace_variables_r(&context, line);
+    leave_shell_context(&context, variables);
+    return replaced;
+}
+
+/*
+** Returns the generation of the variables list, which changes every time
+** a variable is added or updated.
+*/
+uint64_t variable_generation(void) {
+    return generation;
+}
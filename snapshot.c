@@ -0,0 +1,387 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+** A snapshot file is this header, followed by num_variables records, then
+** the PATH section: one record of PATH_VAR_NAME and the PATH value its
+** lookups were made against, then num_paths records. Each record is two
+** uint32_t lengths followed by the two NUL terminated strings (name and
+** value, or name and path).
+*/
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t num_variables;
+    uint32_t num_paths;
+    // identity of the init file the snapshot was made from
+    uint64_t init_dev;
+    uint64_t init_ino;
+    int64_t init_size;
+    int64_t init_mtime_sec;
+    int64_t init_mtime_nsec;
+    uint64_t init_hash;
+    int64_t created_sec;
+} SnapshotHeader;
+
+
+/**
+ * Hash the contents of a file with 64-bit FNV-1a.
+ *
+ * @param file_path The file to hash.
+ * @param hash Set to the hash of the file.
+ * @return 0 on success, -1 if the file cannot be read.
+ */
+int hash_file(const char *file_path, uint64_t *hash) {
+    FILE *file = fopen(file_path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    *hash = 0xcbf29ce484222325ULL;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        *hash ^= (unsigned char) c;
+        *hash *= 0x100000001b3ULL;
+    }
+    fclose(file);
+    return 0;
+}
+
+/**
+ * Check that an init file only assigns variables, so that restoring its
+ * variables is all it takes to replay it.
+ *
+ * @param file_path The init file to check.
+ * @return 1 if every line is empty, a comment or an assignment, 0 otherwise.
+ */
+int init_only_assigns(const char *file_path) {
+    FILE *file = fopen(file_path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    char line[MAX_SINGLE_LINE];
+    int only_assigns = 1;
+    while (only_assigns && fgets(line, MAX_SINGLE_LINE, file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char *start = line;
+        trim_whitespace_leading(&start);
+        only_assigns = *start == '\0' || *start == '#' ||
+                       (is_assignment(start) && !is_command_list(start));
+    }
+    fclose(file);
+    return only_assigns;
+}
+
+/**
+ * Append one record to a snapshot being written.
+ *
+ * @param file The snapshot being written.
+ * @param first The first string of the record.
+ * @param second The second string of the record.
+ * @return 0 on success, -1 on a write error.
+ */
+int write_record(FILE *file, const char *first, const char *second) {
+    uint32_t lengths[2] = {strlen(first), strlen(second)};
+    if (fwrite(lengths, sizeof(uint32_t), 2, file) != 2 ||
+        fwrite(first, 1, lengths[0] + 1, file) != lengths[0] + 1 ||
+        fwrite(second, 1, lengths[1] + 1, file) != lengths[1] + 1) {
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct PathRecordWriter {
+    FILE *file;
+    uint32_t count;
+    int error;
+} PathRecordWriter;
+
+/**
+ * Write one PATH lookup cache entry as a snapshot record.
+ *
+ * @param name The command name.
+ * @param exec_path Where the command was found.
+ * @param data The PathRecordWriter of the snapshot.
+ */
+void write_path_record(const char *name, const char *exec_path, void *data) {
+    PathRecordWriter *writer = data;
+    if (write_record(writer->file, name, exec_path) < 0) {
+        writer->error = 1;
+    }
+    writer->count++;
+}
+
+/**
+ * Read one record of a mapped snapshot.
+ *
+ * @param cursor Pointer to the current position, moved past the record.
+ * @param end The end of the mapping.
+ * @param first Set to the first string of the record.
+ * @param second Set to the second string of the record.
+ * @return 0 on success, -1 if the record is truncated.
+ */
+int read_record(const char **cursor, const char *end,
+                const char **first, const char **second) {
+    uint32_t lengths[2];
+    if (end - *cursor < (long) sizeof(lengths)) {
+        return -1;
+    }
+    memcpy(lengths, *cursor, sizeof(lengths));
+    *cursor += sizeof(lengths);
+
+    if ((uint64_t) (end - *cursor) < (uint64_t) lengths[0] + lengths[1] + 2) {
+        return -1;
+    }
+    *first = *cursor;
+    *second = *cursor + lengths[0] + 1;
+    if ((*first)[lengths[0]] != '\0' || (*second)[lengths[1]] != '\0') {
+        return -1;
+    }
+    *cursor += lengths[0] + lengths[1] + 2;
+    return 0;
+}
+
+/*
+** Loads the variables and PATH lookups saved by save_snapshot into root,
+** instead of running the init file. The snapshot is mmap'd and only used
+** if it was made from this exact init file, so its size, mtime and inode
+** must match; if the init file changed in the second the snapshot was
+** made, its content hash is checked as well.
+**
+** Returns 0 if the snapshot was loaded, -1 if it is missing or stale.
+*/
+int load_snapshot(const char *snapshot_path, const char *init_file, Variable **root) {
+    struct stat init_stat;
+    if (stat(init_file, &init_stat) < 0) {
+        return -1;
+    }
+
+    int fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat snapshot_stat;
+    if (fstat(fd, &snapshot_stat) < 0 || snapshot_stat.st_size < (off_t) sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    const char *mapping = mmap(NULL, snapshot_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("load_snapshot");
+        return -1;
+    }
+    const char *end = mapping + snapshot_stat.st_size;
+
+    int ret_code = -1;
+    SnapshotHeader header;
+    memcpy(&header, mapping, sizeof(SnapshotHeader));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.init_dev != (uint64_t) init_stat.st_dev ||
+        header.init_ino != (uint64_t) init_stat.st_ino ||
+        header.init_size != (int64_t) init_stat.st_size ||
+        header.init_mtime_sec != (int64_t) init_stat.st_mtim.tv_sec ||
+        header.init_mtime_nsec != (int64_t) init_stat.st_mtim.tv_nsec) {
+        goto load_cleanup;
+    }
+
+    // a change within the same second may not show in the mtime
+    if (header.init_mtime_sec >= header.created_sec) {
+        uint64_t hash;
+        if (hash_file(init_file, &hash) < 0 || hash != header.init_hash) {
+            goto load_cleanup;
+        }
+    }
+
+    // check every record first, so a corrupt snapshot changes nothing
+    const char *cursor = mapping + sizeof(SnapshotHeader);
+    const char *first;
+    const char *second;
+    for (uint64_t i = 0; i < (uint64_t) header.num_variables + 1 + header.num_paths; i++) {
+        if (read_record(&cursor, end, &first, &second) < 0) {
+            goto load_cleanup;
+        }
+    }
+
+    cursor = mapping + sizeof(SnapshotHeader);
+    for (uint32_t i = 0; i < header.num_variables; i++) {
+        read_record(&cursor, end, &first, &second);
+        add_variable(first, second, root);
+    }
+    // lookups made against any other PATH would resolve the wrong commands
+    read_record(&cursor, end, &first, &second);
+    uint8_t same_path = *root != NULL && strcmp(second, (*root)->value) == 0;
+    for (uint32_t i = 0; i < header.num_paths && same_path; i++) {
+        read_record(&cursor, end, &first, &second);
+        path_cache_insert(first, second, (*root)->value);
+    }
+    ret_code = 0;
+
+    load_cleanup:
+    munmap((void *) mapping, snapshot_stat.st_size);
+    return ret_code;
+}
+
+/*
+** Saves the variables in root, and the PATH lookups made so far, as a
+** snapshot of init_file for load_snapshot. Init files that run commands
+** are not snapshotted, since skipping them would skip those commands.
+**
+** Returns 0 on success, -1 if no snapshot was written.
+*/
+int save_snapshot(const char *snapshot_path, const char *init_file, Variable *root) {
+    if (!init_only_assigns(init_file)) {
+        ERR_PRINT(ERR_SNAPSHOT_COMMANDS, init_file);
+        return -1;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(SnapshotHeader));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+    struct stat init_stat;
+    if (stat(init_file, &init_stat) < 0 || hash_file(init_file, &header.init_hash) < 0) {
+        perror("save_snapshot");
+        return -1;
+    }
+    header.init_dev = init_stat.st_dev;
+    header.init_ino = init_stat.st_ino;
+    header.init_size = init_stat.st_size;
+    header.init_mtime_sec = init_stat.st_mtim.tv_sec;
+    header.init_mtime_nsec = init_stat.st_mtim.tv_nsec;
+    header.created_sec = time(NULL);
+
+    // written aside and renamed, so a reader never sees half a snapshot
+    char tmp_path[MAX_PATH_STR];
+    snprintf(tmp_path, MAX_PATH_STR, "%s.%d", snapshot_path, (int) getpid());
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        perror("save_snapshot");
+        return -1;
+    }
+
+    int error = fwrite(&header, sizeof(SnapshotHeader), 1, file) != 1;
+    for (Variable *var = root; var != NULL && !error; var = var->next) {
+        error = write_record(file, var->name, var->value != NULL ? var->value : "") < 0;
+        header.num_variables++;
+    }
+
+    const char *path_value = root != NULL ? root->value : "";
+    if (!error) {
+        error = write_record(file, PATH_VAR_NAME, path_value) < 0;
+    }
+    PathRecordWriter writer = {file, 0, error};
+    if (root != NULL && !error) {
+        path_cache_foreach(path_value, write_path_record, &writer);
+    }
+    header.num_paths = writer.count;
+    error = writer.error;
+
+    if (!error) {
+        error = fseek(file, 0, SEEK_SET) < 0 ||
+                fwrite(&header, sizeof(SnapshotHeader), 1, file) != 1;
+    }
+    if (fclose(file) == EOF || error || rename(tmp_path, snapshot_path) < 0) {
+        perror("save_snapshot");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Count one PATH lookup cache entry.
+ *
+ * @param name Unused.
+ * @param exec_path Unused.
+ * @param data Pointer to the uint32_t count.
+ */
+void count_path_record(const char *name, const char *exec_path, void *data) {
+    (*(uint32_t *) data)++;
+}
+
+/*
+** Rewrites the PATH lookups of an existing snapshot with the ones made
+** since, keeping its variables as they were right after the init file.
+** Only lookups made against the snapshot's own PATH value are kept, so a
+** script that changes PATH cannot plant commands for later runs.
+** Nothing is written if no lookups were added.
+**
+** Returns 0 on success or if nothing changed, -1 on error.
+*/
+int update_snapshot_paths(const char *snapshot_path) {
+    int fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat snapshot_stat;
+    if (fstat(fd, &snapshot_stat) < 0 || snapshot_stat.st_size < (off_t) sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    const char *mapping = mmap(NULL, snapshot_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("update_snapshot_paths");
+        return -1;
+    }
+    const char *end = mapping + snapshot_stat.st_size;
+
+    int ret_code = -1;
+    SnapshotHeader header;
+    memcpy(&header, mapping, sizeof(SnapshotHeader));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        goto update_cleanup;
+    }
+
+    // the variable records and the PATH value they had are copied as they are
+    const char *cursor = mapping + sizeof(SnapshotHeader);
+    const char *first;
+    const char *second;
+    for (uint32_t i = 0; i < header.num_variables + 1; i++) {
+        if (read_record(&cursor, end, &first, &second) < 0) {
+            goto update_cleanup;
+        }
+    }
+    const char *path_value = second;
+
+    uint32_t num_paths = 0;
+    path_cache_foreach(path_value, count_path_record, &num_paths);
+    if (num_paths <= header.num_paths) {
+        ret_code = 0;
+        goto update_cleanup;
+    }
+
+    char tmp_path[MAX_PATH_STR];
+    snprintf(tmp_path, MAX_PATH_STR, "%s.%d", snapshot_path, (int) getpid());
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        perror("update_snapshot_paths");
+        goto update_cleanup;
+    }
+
+    size_t variables_size = cursor - (mapping + sizeof(SnapshotHeader));
+    header.num_paths = num_paths;
+    int error = fwrite(&header, sizeof(SnapshotHeader), 1, file) != 1 ||
+                fwrite(mapping + sizeof(SnapshotHeader), 1, variables_size, file) != variables_size;
+
+    PathRecordWriter writer = {file, 0, error};
+    if (!error) {
+        path_cache_foreach(path_value, write_path_record, &writer);
+    }
+    if (fclose(file) == EOF || writer.error || rename(tmp_path, snapshot_path) < 0) {
+        perror("update_snapshot_paths");
+        unlink(tmp_path);
+        goto update_cleanup;
+    }
+    ret_code = 0;
+
+    update_cleanup:
+    munmap((void *) mapping, snapshot_stat.st_size);
+    return ret_code;
+}
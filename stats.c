@@ -0,0 +1,248 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+#include "cscshell.h"
+#include <signal.h>
+
+/*
+** One counter, as it is reported.
+*/
+typedef struct StatValue {
+    const char *name;
+    uint64_t value;
+} StatValue;
+
+// Only the shell's own thread counts these, see path_cache_stats for the rest
+static uint64_t lines_parsed = 0;
+static uint64_t parse_ns_total = 0;
+static uint64_t parse_ns_buckets[LATENCY_BUCKETS];
+static uint64_t forks = 0;
+static uint64_t exec_failures = 0;
+static uint64_t pipes = 0;
+static uint64_t num_variables = 0;
+static uint64_t variable_bytes = 0;
+
+
+/*
+** Latency histograms bin durations in quarter powers of two, over
+** LATENCY_BUCKETS buckets. Returns the bucket of a duration in ns.
+*/
+int latency_bucket(uint64_t ns) {
+    if (ns < 4) {
+        return ns;
+    }
+    int log = 63 - __builtin_clzll(ns);
+    return log * 4 + ((ns >> (log - 2)) & 3);
+}
+
+/*
+** Returns the longest duration, in ns, that falls in a latency bucket.
+*/
+uint64_t latency_bucket_limit(int bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+    int log = bucket / 4;
+    return ((uint64_t) (4 + bucket % 4 + 1) << (log - 2)) - 1;
+}
+
+/*
+** Returns a percentile of a latency histogram of count durations, to the
+** precision of the buckets: the upper bound of the bucket it falls in,
+** 0 if the histogram is empty.
+*/
+uint64_t latency_percentile(const uint64_t *buckets, uint64_t count, int percent) {
+    uint64_t target = count - count * (100 - percent) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS && target > 0; i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return latency_bucket_limit(i);
+        }
+    }
+    return 0;
+}
+
+/*
+** Counters the shell keeps from start to exit, cheap enough to be always
+** on. Only the shell's own thread counts, except for the PATH lookups,
+** which path_cache_stats keeps.
+*/
+void count_parse(uint64_t ns) {
+    lines_parsed++;
+    parse_ns_total += ns;
+    parse_ns_buckets[latency_bucket(ns)]++;
+}
+
+void count_fork(void) {
+    forks++;
+}
+
+void count_exec_failure(void) {
+    exec_failures++;
+}
+
+void count_pipe(void) {
+    pipes++;
+}
+
+/*
+** Recounts the variables and the bytes they take, after the list changed.
+*/
+void count_variables(Variable *variables) {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    for (Variable *curr = variables; curr != NULL; curr = curr->next) {
+        count++;
+        bytes += sizeof(Variable) + strlen(curr->name) + strlen(curr->value) + 2;
+    }
+    num_variables = count;
+    variable_bytes = bytes;
+}
+
+/**
+ * Collect every counter, in the order they are reported.
+ *
+ * @param values The array to fill, STATS_NUM_VALUES long.
+ * @return The number of counters.
+ */
+int collect_stats(StatValue *values) {
+    PathCacheStats path;
+    path_cache_stats(&path);
+    StatValue collected[] = {
+        {"lines_parsed", lines_parsed},
+        {"parse_ns_total", parse_ns_total},
+        {"parse_ns_p99", latency_percentile(parse_ns_buckets, lines_parsed, 99)},
+        {"forks", forks},
+        {"exec_failures", exec_failures},
+        {"path_lookups", path.lookups},
+        {"path_cache_hits", path.hits},
+        {"path_cache_misses", path.misses},
+        {"variables", num_variables},
+        {"variable_bytes", variable_bytes},
+        {"pipes", pipes},
+    };
+    int count = sizeof(collected) / sizeof(collected[0]);
+    memcpy(values, collected, sizeof(collected));
+    return count;
+}
+
+/**
+ * Append a string to a buffer, as far as it fits.
+ *
+ * @param buffer The buffer, STATS_BUFFER_SIZE long.
+ * @param length Pointer to the length of the buffer, advanced.
+ * @param text The string to append.
+ */
+void append_stat_text(char *buffer, size_t *length, const char *text) {
+    while (*text != '\0' && *length < STATS_BUFFER_SIZE) {
+        buffer[(*length)++] = *text++;
+    }
+}
+
+/**
+ * Append a number to a buffer in decimal, as far as it fits.
+ *
+ * @param buffer The buffer, STATS_BUFFER_SIZE long.
+ * @param length Pointer to the length of the buffer, advanced.
+ * @param value The number to append.
+ */
+void append_stat_number(char *buffer, size_t *length, uint64_t value) {
+    char digits[24];
+    int i = sizeof(digits) - 1;
+    digits[i] = '\0';
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    append_stat_text(buffer, length, digits + i);
+}
+
+/*
+** Writes every counter to fd as "name: value" lines. Only uses write,
+** so it may be called from a signal handler.
+*/
+void print_stats(int fd) {
+    StatValue values[STATS_NUM_VALUES];
+    int count = collect_stats(values);
+
+    char buffer[STATS_BUFFER_SIZE];
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+        append_stat_text(buffer, &length, values[i].name);
+        append_stat_text(buffer, &length, ": ");
+        append_stat_number(buffer, &length, values[i].value);
+        append_stat_text(buffer, &length, "\n");
+    }
+
+    size_t written = 0;
+    while (written < length) {
+        ssize_t result = write(fd, buffer + written, length - written);
+        if (result < 0 && errno != EINTR) {
+            return;
+        }
+        written += result < 0 ? 0 : result;
+    }
+}
+
+/**
+ * Dump the counters to stderr, without disturbing what the shell was doing.
+ *
+ * @param sig The signal received.
+ */
+void dump_stats(int sig) {
+    int saved_errno = errno;
+    print_stats(STDERR_FILENO);
+    errno = saved_errno;
+}
+
+/*
+** Makes SIGUSR1 dump the counters to stderr, see print_stats.
+*/
+void init_stats(void) {
+    struct sigaction dump_action = {0};
+    dump_action.sa_handler = dump_stats;
+    dump_action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &dump_action, NULL);
+}
+
+/*
+** Writes every counter to a file as a JSON object, for --stats=FILE.
+**
+** Returns 0 on success, -1 if the file could not be written.
+*/
+int write_stats_json(const char *file_path) {
+    FILE *file = fopen(file_path, "w");
+    if (file == NULL) {
+        ERR_PRINT(ERR_STATS, file_path, strerror(errno));
+        return -1;
+    }
+
+    StatValue values[STATS_NUM_VALUES];
+    int count = collect_stats(values);
+    fprintf(file, "{");
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "%s\"%s\": %llu", i == 0 ? "" : ", ", values[i].name,
+                (unsigned long long) values[i].value);
+    }
+    fprintf(file, "}\n");
+
+    if (fclose(file) != 0) {
+        ERR_PRINT(ERR_STATS, file_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+** Prints the runtime counters of the shell, see print_stats: `stats`.
+**
+** Returns 0.
+*/
+int builtin_stats(char **args, Variable **root) {
+    fflush(stdout);
+    print_stats(STDOUT_FILENO);
+    return 0;
+}
@@ -0,0 +1,209 @@
+/*****************************************************************************/
+/*                           CSC209-24s A3 CSCSHELL                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+
+/*
+** Stress test for libcscparse: parses the same script from many threads at
+** once, each with its own ParserContext, and checks that every thread gets
+** exactly what a single thread got on its own.
+**
+** Usage: parse_stress [THREADS [ITERATIONS]], 16 threads by default.
+** Exits 1 on any mismatch. Under ThreadSanitizer:
+**     make clean && make stress CFLAGS="-std=gnu99 -pthread -g -fsanitize=thread"
+*/
+
+#include "../cscshell.h"
+#include <pthread.h>
+
+#define STRESS_THREADS 16
+#define STRESS_ITERATIONS 64
+#define STRESS_PIPE_STAGES 40
+
+// Run in order from a fresh context, so assignments feed later lines
+static const char *script[] = {
+    "ls -l /tmp | grep x | wc -l",
+    "cat < in.txt > out.txt",
+    "cat in.txt >> log.txt",
+    "echo $A ${B} | tr a b",
+    "X=1",
+    "Y=$A$B",
+    "echo $X $Y > ${DIR}/out.txt",
+    "echo $((N * 3 + 1)) ${UNSET:-default} $((X << 4 | N))",
+    "echo ${Z:=assigned} $Z",
+    "true && echo ok || echo no; echo done",
+    "false || X=2; echo $X",
+    "{ echo a; echo b; } > grp.txt",
+    "( cd /tmp; ls ) >> grp.txt",
+    "sort 3<in.txt <&3 2>&1",
+    "cat 2>/dev/null 4>&- < in.txt",
+    "# a comment",
+    "",
+    "head -n $N in.txt | sort -r | uniq -c | sort -n | tail -n 1",
+    "echo ${A}x${B}y$((N + N))",
+    "A=changed",
+    "echo $A $B $X $Y $Z",
+    NULL, // the long pipeline, see build_long_pipeline
+};
+
+#define SCRIPT_LINES (sizeof(script) / sizeof(script[0]))
+
+static char *expected;
+static int num_iterations = STRESS_ITERATIONS;
+static int mismatches = 0;
+
+
+/**
+ * Describe a list of commands, as parse_line_r or instantiate_command_r
+ * returned it, with everything that tells two parses apart.
+ *
+ * @param out Where to write the description.
+ * @param command The first command, NULL, or (Command *) -1.
+ */
+void describe_commands(FILE *out, Command *command) {
+    if (command == NULL) {
+        fprintf(out, "NULL");
+        return;
+    }
+    if (command == (Command *) -1) {
+        fprintf(out, "ERROR");
+        return;
+    }
+    for (Command *pipeline = command; pipeline != NULL; pipeline = pipeline->next_pipeline) {
+        fprintf(out, "[");
+        for (Command *stage = pipeline; stage != NULL; stage = stage->next) {
+            fprintf(out, "{%s", stage->exec_path != NULL ? stage->exec_path : "-");
+            for (int i = 0; stage->args != NULL && stage->args[i] != NULL; i++) {
+                fprintf(out, " '%s'", stage->args[i]);
+            }
+            fprintf(out, " <%s >%s%s late=%d deferred=%d",
+                    stage->redir_in_path != NULL ? stage->redir_in_path : "-",
+                    stage->redir_append ? ">" : "",
+                    stage->redir_out_path != NULL ? stage->redir_out_path : "-",
+                    stage->late_bound, stage->deferred);
+            for (FdRedirection *redirection = stage->fd_redirections; redirection != NULL;
+                 redirection = redirection->next) {
+                fprintf(out, " %d:%d:%s:%d", redirection->fd, redirection->source_fd,
+                        redirection->path != NULL ? redirection->path : "-", redirection->flags);
+            }
+            if (stage->group != NULL) {
+                fprintf(out, " %s", stage->subshell ? "(" : "{");
+                describe_commands(out, stage->group);
+            }
+            fprintf(out, "}");
+        }
+        fprintf(out, "] op=%d ", pipeline->list_op);
+    }
+}
+
+/**
+ * Parse the whole script once from a fresh context, the way every
+ * iteration of every thread does it.
+ *
+ * @return The description of every line, parsed and compiled, in one
+ *         string to be freed by the caller.
+ */
+char *run_script_once(void) {
+    ParserContext context;
+    init_parser_context(&context, NULL);
+    add_variable_r(&context, PATH_VAR_NAME, "/bin:/usr/bin");
+    add_variable_r(&context, "A", "alpha");
+    add_variable_r(&context, "B", "beta");
+    add_variable_r(&context, "N", "7");
+    add_variable_r(&context, "DIR", "/tmp/stress");
+
+    char *description = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&description, &length);
+    for (int i = 0; i < SCRIPT_LINES; i++) {
+        Command *commands = parse_line_r(&context, script[i]);
+        describe_commands(out, commands);
+        if (commands != NULL && commands != (Command *) -1) {
+            free_command(commands);
+        }
+
+        // the same line as a template, filled in with the current values
+        Command *template = compile_line_r(&context, script[i]);
+        fprintf(out, " | ");
+        if (template == NULL || template == (Command *) -1) {
+            describe_commands(out, template);
+        } else {
+            Command *instance = instantiate_command_r(&context, template);
+            describe_commands(out, instance);
+            if (instance != template && instance != (Command *) -1) {
+                free_command(instance);
+            }
+            free_command(template);
+        }
+        fprintf(out, "\n");
+    }
+    fclose(out);
+
+    free_variable(context.variables, 1);
+    return description;
+}
+
+/**
+ * Fill in the last line of the script: a pipeline long enough to spread
+ * its stages over several 64-bit words of the lexer's mask.
+ */
+void build_long_pipeline(void) {
+    static char line[STRESS_PIPE_STAGES * 16];
+    char *end = line;
+    end += sprintf(end, "cat in.txt");
+    for (int i = 1; i < STRESS_PIPE_STAGES; i++) {
+        end += sprintf(end, i % 2 ? " | grep $A" : " | sort -k%d", i);
+    }
+    script[SCRIPT_LINES - 1] = line;
+}
+
+/**
+ * Parse the script over and over, comparing every run with the expected one.
+ *
+ * @param arg Unused.
+ * @return NULL.
+ */
+void *stress_thread(void *arg) {
+    for (int i = 0; i < num_iterations; i++) {
+        char *description = run_script_once();
+        if (strcmp(description, expected) != 0) {
+            __atomic_fetch_add(&mismatches, 1, __ATOMIC_RELAXED);
+        }
+        free(description);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = argc > 1 ? atoi(argv[1]) : STRESS_THREADS;
+    if (argc > 2) {
+        num_iterations = atoi(argv[2]);
+    }
+    if (num_threads <= 0 || num_iterations <= 0) {
+        fprintf(stderr, "Usage: %s [THREADS [ITERATIONS]]\n", argv[0]);
+        return 2;
+    }
+    build_long_pipeline();
+
+    expected = run_script_once();
+    if (strstr(expected, "ERROR") != NULL) {
+        fprintf(stderr, "parse_stress: the script does not parse on one thread:\n%s", expected);
+        return 1;
+    }
+
+    pthread_t threads[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, stress_thread, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("parse_stress: %d threads x %d runs of %d lines, classifier %s: %d mismatches\n",
+           num_threads, num_iterations, (int) SCRIPT_LINES, lexer_name(), mismatches);
+    free(expected);
+    return mismatches == 0 ? 0 : 1;
+}
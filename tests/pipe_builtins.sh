@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Regression test for builtins inside pipelines: every stage of a pipeline
+# must run, a builtin in a longer pipeline runs in a child of its own, and
+# a builtin on its own still runs in the shell.
+#
+# Usage: tests/pipe_builtins.sh [SHELL]
+
+SHELL_BIN=${1:-./cscshell}
+
+if [ ! -x "$SHELL_BIN" ]; then
+    echo "pipe_builtins: $SHELL_BIN is not executable" >&2
+    exit 2
+fi
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/cscshell-check.XXXXXX") || exit 2
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+echo "PATH=/bin:/usr/bin" > "$DIR/init"
+echo "file-a file-b" > "$DIR/in.txt"
+
+cat > "$DIR/script" <<EOF
+X=unset
+echo from-pipe | read X && echo read-ok
+echo X=\$X
+echo one two three | read A B && echo chained
+echo one two | read A B | cat
+read C D
+echo C=\$C D=\$D
+read A B < $DIR/in.txt
+echo A=\$A B=\$B
+parsecache | wc -l > $DIR/count
+stats | head -n 1 | cut -d: -f1
+echo last | cat
+EOF
+
+cat > "$DIR/expected" <<EOF
+read-ok
+X=unset
+chained
+C=stdin-1 D=rest of it
+A=file-a B=file-b
+lines_parsed
+last
+EOF
+
+# the builtins in pipelines must leave the shell's own stdin alone
+printf 'stdin-1 rest of it\nstdin-2\n' |
+    "$SHELL_BIN" --init-file="$DIR/init" "$DIR/script" > "$DIR/out" 2> "$DIR/err"
+STATUS=$?
+
+FAILED=0
+if [ $STATUS -ne 0 ] || [ -s "$DIR/err" ]; then
+    echo "pipe_builtins: the shell exited with $STATUS, stderr:" >&2
+    head -n 5 "$DIR/err" >&2
+    FAILED=1
+fi
+# the shell prints an empty line as it exits
+sed '/^$/d' "$DIR/out" > "$DIR/actual"
+if ! cmp -s "$DIR/expected" "$DIR/actual"; then
+    echo "pipe_builtins: unexpected output:" >&2
+    diff "$DIR/expected" "$DIR/actual" >&2
+    FAILED=1
+fi
+if ! grep -q '^ *[1-9][0-9]*$' "$DIR/count" 2> /dev/null; then
+    echo "pipe_builtins: parsecache | wc -l did not count any line" >&2
+    FAILED=1
+fi
+
+if [ $FAILED -ne 0 ]; then
+    exit 1
+fi
+echo "pipe_builtins: ok"
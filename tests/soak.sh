@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# Soak test for the shell's steady state: runs a script of millions of
+# lines and fails if the shell's RSS is still growing once it has warmed up.
+#
+# Usage: tests/soak.sh [SHELL]
+#   SOAK_LINES      lines in the generated script (default 3000000)
+#   SOAK_SLACK_KB   growth allowed after warm-up (default 256)
+#
+# Every line is different, so each one goes through the lexer, the parser
+# and the parse cache instead of hitting a cached entry, and the cache
+# keeps evicting and freeing commands. Most lines are commands with
+# ${...} expansions, redirections and ; or && lists: builtins, which run
+# in the shell with their redirections swapped in, and now and then a
+# forked pipeline and a for block. They only ever set the same few
+# variables and truncate the same few files, so nothing in them has a
+# reason to keep memory.
+
+SHELL_BIN=${1:-./cscshell}
+LINES=${SOAK_LINES:-3000000}
+SLACK_KB=${SOAK_SLACK_KB:-256}
+
+if [ ! -x "$SHELL_BIN" ]; then
+    echo "soak: $SHELL_BIN is not executable" >&2
+    exit 2
+fi
+if [ ! -r /proc/self/status ]; then
+    echo "soak: /proc is needed to sample RSS" >&2
+    exit 2
+fi
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/cscshell-soak.XXXXXX") || exit 2
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+echo "PATH=/bin:/usr/bin" > "$DIR/init"
+echo "first line" > "$DIR/in"
+awk -v lines="$LINES" -v dir="$DIR" 'BEGIN {
+    print "IN=" dir "/in"
+    print "OUT=" dir "/out"
+    print "D=."
+    for (i = 0; n < lines; i++) {
+        print "A=" i "; B=${A}x" i
+        print "cd ${D} && read R S < ${IN} && C=$((A % 97 + " i "))"
+        print "read R S 3< ${IN} <&3 > ${OUT}; E=${UNSET:-e" i "}"
+        print "stats > ${OUT} && parsecache 2> ${OUT} > ${OUT}.copy; F=${E}" i
+        n += 4
+        if (i % 1000 == 0) {
+            print "echo ${A} ${C} | cat > ${OUT} && cat < ${OUT} > ${OUT}.copy"
+            n += 1
+        }
+        if (i % 5000 == 0) {
+            print "for W in a b c; do"
+            print "X=${W}" i
+            print "done"
+            n += 3
+        }
+    }
+}' > "$DIR/script"
+
+"$SHELL_BIN" --init-file="$DIR/init" "$DIR/script" > /dev/null 2> "$DIR/err" &
+PID=$!
+
+# VmRSS in kB, one sample per line, until the shell exits
+while [ -r "/proc/$PID/status" ]; do
+    awk '/^VmRSS:/ { print $2 }' "/proc/$PID/status" 2> /dev/null
+    sleep 0.2
+done > "$DIR/rss"
+
+wait $PID
+STATUS=$?
+if [ $STATUS -ne 0 ]; then
+    echo "soak: $SHELL_BIN exited with status $STATUS" >&2
+    exit 1
+fi
+if [ -s "$DIR/err" ]; then
+    echo "soak: the script did not run cleanly:" >&2
+    head -n 5 "$DIR/err" >&2
+    exit 1
+fi
+
+# The first fifth of the run is warm-up: the parse cache, the PATH cache
+# and the allocator's arenas fill up. After that, the peak of the last
+# half must not be above the peak of the first half by more than the slack.
+awk -v slack="$SLACK_KB" -v lines="$LINES" '
+    { rss[n++] = $1 }
+    END {
+        if (n < 10) {
+            print "soak: only " n " RSS samples, raise SOAK_LINES" > "/dev/stderr"
+            exit 2
+        }
+        start = int(n / 5)
+        middle = start + int((n - start) / 2)
+        for (i = start; i < n; i++) {
+            if (i < middle && rss[i] > early) early = rss[i]
+            if (i >= middle && rss[i] > late) late = rss[i]
+        }
+        printf "soak: %d lines, %d samples, RSS %d kB after warm-up, %d kB at the end\n",
+               lines, n, early, late
+        if (late > early + slack) {
+            printf "soak: RSS grew by %d kB after warm-up\n", late - early > "/dev/stderr"
+            exit 1
+        }
+    }' "$DIR/rss"